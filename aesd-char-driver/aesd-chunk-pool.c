@@ -0,0 +1,457 @@
+/**
+ * @file aesd-chunk-pool.c
+ * @brief Chunked storage of the writes the aesdchar device keeps
+ *
+ * Chunks come from a dedicated cache in the kernel and from malloc in user space, so the
+ * same code runs in the driver and in userspace harnesses.  Callers reserve the chunks a
+ * write may need before taking their lock and release what is left over after dropping it,
+ * only moving chunk pointers while the lock is held.
+ *
+ * Readers find a write without the lock, so it may be evicted while they take a reference on
+ * it.  Its memory is only freed once no reader can still be looking: after an RCU grace period
+ * in the kernel, and in user space once aesd_chunk_pool_reclaim has been called twice, with
+ * the caller making sure readers went through a quiescent state in between.
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/rcupdate.h>
+#define chunk_alloc(pool) kmem_cache_alloc((pool)->cache, GFP_KERNEL)
+#define chunk_free(pool, chunk) kmem_cache_free((pool)->cache, chunk)
+/* Tables of large writes may not fit in contiguous pages */
+#define table_alloc(size) kvmalloc(size, GFP_KERNEL)
+#define table_free(ptr) kvfree(ptr)
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#define copy_from_user(to, from, n) (memcpy(to, from, n), 0)
+#define table_alloc(size) malloc(size)
+#define table_free(ptr) free(ptr)
+#endif
+
+#include "aesd-chunk-pool.h"
+
+#ifndef __KERNEL__
+static void *chunk_alloc(struct aesd_chunk_pool *pool)
+{
+    void *chunk = malloc(AESD_CHUNK_SIZE);
+
+    if (chunk != NULL)
+    {
+        __atomic_fetch_add(&pool->outstanding, 1, __ATOMIC_RELAXED);
+    }
+    return chunk;
+}
+
+static void chunk_free(struct aesd_chunk_pool *pool, void *chunk)
+{
+    __atomic_fetch_sub(&pool->outstanding, 1, __ATOMIC_RELAXED);
+    free(chunk);
+}
+#endif
+
+/* Smallest table allocated, most writes fit in one chunk */
+#define MIN_TABLE_CAPACITY 4
+
+static void list_push(struct aesd_chunk_list *list, void *chunk)
+{
+    *(void **)chunk = list->head;
+    list->head = chunk;
+    list->count++;
+}
+
+static void *list_pop(struct aesd_chunk_list *list)
+{
+    void *chunk = list->head;
+
+    if (chunk != NULL)
+    {
+        list->head = *(void **)chunk;
+        list->count--;
+    }
+    return chunk;
+}
+
+/**
+ * Initializes @param pool, creating the cache its chunks come from in the kernel
+ * @return 0 on success or -ENOMEM
+ */
+int aesd_chunk_pool_init(struct aesd_chunk_pool *pool)
+{
+#ifdef __KERNEL__
+    pool->cache = kmem_cache_create("aesdchar_chunk", AESD_CHUNK_SIZE, 0, 0, NULL);
+    return pool->cache != NULL ? 0 : -ENOMEM;
+#else
+    pool->outstanding = 0;
+    pool->retired = NULL;
+    pool->waiting = NULL;
+    return 0;
+#endif
+}
+
+/**
+ * Destroys @param pool once the data released to it are freed.  Every other chunk taken from
+ * it must have been given back, and no reader may look at its data anymore.
+ */
+void aesd_chunk_pool_destroy(struct aesd_chunk_pool *pool)
+{
+#ifdef __KERNEL__
+    /* Wait for the data still waiting for a grace period */
+    rcu_barrier();
+    kmem_cache_destroy(pool->cache);
+    pool->cache = NULL;
+#else
+    aesd_chunk_pool_reclaim(pool);
+    aesd_chunk_pool_reclaim(pool);
+#endif
+}
+
+/**
+ * Allocates chunks from @param pool into @param list until it holds @param count.  May sleep,
+ * so callers reserve what they need before taking their lock.
+ * @return 0 on success, or -ENOMEM with the chunks allocated so far left in @param list
+ */
+int aesd_chunk_pool_reserve(struct aesd_chunk_pool *pool, struct aesd_chunk_list *list, size_t count)
+{
+    void *chunk;
+
+    while (list->count < count)
+    {
+        chunk = chunk_alloc(pool);
+        if (chunk == NULL)
+        {
+            return -ENOMEM;
+        }
+        list_push(list, chunk);
+    }
+    return 0;
+}
+
+/**
+ * Gives every chunk of @param list back to @param pool, leaving @param list empty
+ */
+void aesd_chunk_pool_release(struct aesd_chunk_pool *pool, struct aesd_chunk_list *list)
+{
+    void *chunk;
+
+    while ((chunk = list_pop(list)) != NULL)
+    {
+        chunk_free(pool, chunk);
+    }
+}
+
+/* Number of bytes the chunk at index has room for */
+static size_t chunk_room(const struct aesd_chunked_data *data, size_t index)
+{
+    return index == 0 && data->head_size != 0 ? data->head_size : AESD_CHUNK_SIZE;
+}
+
+/* Offset of the first byte of the chunk at index */
+static size_t chunk_start(const struct aesd_chunked_data *data, size_t index)
+{
+    if (index == 0)
+    {
+        return 0;
+    }
+    return data->head_size + (index - (data->head_size != 0)) * AESD_CHUNK_SIZE;
+}
+
+/**
+ * Allocates an empty data with room for at least @param capacity chunks, and a head chunk of
+ * @param head_size bytes stored after its table unless it is 0.  Heads are at most AESD_CHUNK_SIZE,
+ * so @param capacity = aesd_chunks_for(n) holds n bytes whatever the head size.  The caller holds
+ * the one reference of the new data.  May sleep.
+ * @return the data, or NULL if memory is exhausted
+ */
+struct aesd_chunked_data *aesd_chunked_data_alloc(size_t capacity, size_t head_size)
+{
+    struct aesd_chunked_data *data;
+
+    if (head_size > AESD_CHUNK_SIZE)
+    {
+        head_size = AESD_CHUNK_SIZE;
+    }
+    if (capacity < MIN_TABLE_CAPACITY)
+    {
+        capacity = MIN_TABLE_CAPACITY;
+    }
+    data = table_alloc(sizeof(*data) + capacity * sizeof(data->chunk[0]) + head_size);
+    if (data != NULL)
+    {
+        data->next = NULL;
+        data->head_table = NULL;
+#ifdef __KERNEL__
+        refcount_set(&data->refs, 1);
+#else
+        data->refs = 1;
+#endif
+        data->size = 0;
+        data->head_size = head_size;
+        data->count = 0;
+        data->capacity = capacity;
+        if (head_size != 0)
+        {
+            data->chunk[data->count++] = (char *)&data->chunk[capacity];
+        }
+    }
+    return data;
+}
+
+/**
+ * Moves the chunks of @param from, which may be NULL, into the larger empty table @param to,
+ * allocated without a head.  Only chunk pointers are copied, the bytes stay where they are.
+ * @param retired_rtn set to the table the caller frees with aesd_chunked_data_free once its lock is
+ *      dropped, or NULL when @param from stores the head and is kept until @param to is released
+ * @return @param to, holding what @param from did
+ */
+struct aesd_chunked_data *aesd_chunked_data_grow(struct aesd_chunked_data *to, struct aesd_chunked_data *from,
+            struct aesd_chunked_data **retired_rtn)
+{
+    *retired_rtn = from;
+    if (from != NULL)
+    {
+        memcpy(to->chunk, from->chunk, from->count * sizeof(from->chunk[0]));
+        to->size = from->size;
+        to->head_size = from->head_size;
+        to->count = from->count;
+        to->head_table = from->head_table;
+        if (from->head_size != 0 && from->head_table == NULL)
+        {
+            to->head_table = from;
+            *retired_rtn = NULL;
+        }
+    }
+    return to;
+}
+
+/**
+ * @param data the data to append to
+ * @param add_size the number of bytes about to be appended
+ * @return the number of chunks to take from the pool for @param add_size more bytes, after filling
+ * the last chunk of @param data.  The table of @param data needs room for them as well.
+ */
+size_t aesd_chunked_data_chunks_needed(const struct aesd_chunked_data *data, size_t add_size)
+{
+    size_t room = data->count == 0 ? 0 : chunk_start(data, data->count) - data->size;
+
+    return add_size <= room ? 0 : aesd_chunks_for(add_size - room);
+}
+
+/**
+ * Frees the tables of every data in the list starting at @param list, which may be empty, without their chunks
+ */
+void aesd_chunked_data_free(struct aesd_chunked_data *list)
+{
+    struct aesd_chunked_data *next;
+
+    while (list != NULL)
+    {
+        next = list->next;
+        table_free(list);
+        list = next;
+    }
+}
+
+/* Give the chunks of data back to the pool and free its tables */
+static void data_destroy(struct aesd_chunk_pool *pool, struct aesd_chunked_data *data)
+{
+    size_t i;
+
+    /* The head is stored with a table, not in the pool */
+    for (i = data->head_size != 0; i < data->count; i++)
+    {
+        chunk_free(pool, data->chunk[i]);
+    }
+    table_free(data->head_table);
+    table_free(data);
+}
+
+#ifdef __KERNEL__
+static void data_free_rcu(struct rcu_head *head)
+{
+    struct aesd_chunked_data *data = container_of(head, struct aesd_chunked_data, rcu);
+
+    data_destroy(data->pool, data);
+}
+#else
+/**
+ * Frees the data released to @param pool before the previous call.  The caller makes sure every
+ * reader that could see them went through a quiescent state since, standing in for RCU grace
+ * periods in user space, and is the only one calling it.
+ */
+void aesd_chunk_pool_reclaim(struct aesd_chunk_pool *pool)
+{
+    struct aesd_chunked_data *next;
+
+    while (pool->waiting != NULL)
+    {
+        next = pool->waiting->next;
+        data_destroy(pool, pool->waiting);
+        pool->waiting = next;
+    }
+    pool->waiting = __atomic_exchange_n(&pool->retired, NULL, __ATOMIC_ACQ_REL);
+}
+#endif
+
+/**
+ * Takes a reference on @param data, so it stays valid while it is used without the lock.  The
+ * memory of @param data must stay valid during the call, which an RCU read-side section does
+ * for data found by a reader.
+ * @return true on success, false if the last reference is already dropped and @param data is going away
+ */
+bool aesd_chunked_data_get(struct aesd_chunked_data *data)
+{
+#ifdef __KERNEL__
+    return refcount_inc_not_zero(&data->refs);
+#else
+    int refs = __atomic_load_n(&data->refs, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (refs == 0)
+        {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&data->refs, &refs, refs + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+#endif
+}
+
+/**
+ * Drops a reference on @param data.  Dropping the last one frees it once no reader may still
+ * look at it, giving its chunks back to @param pool.  Does not sleep.
+ */
+void aesd_chunked_data_put(struct aesd_chunk_pool *pool, struct aesd_chunked_data *data)
+{
+#ifdef __KERNEL__
+    if (refcount_dec_and_test(&data->refs))
+    {
+        data->pool = pool;
+        call_rcu(&data->rcu, data_free_rcu);
+    }
+#else
+    if (__atomic_sub_fetch(&data->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        data->next = __atomic_load_n(&pool->retired, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&pool->retired, &data->next, data, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+#endif
+}
+
+/**
+ * Drops the reference held on every data in the list starting at @param list, see aesd_chunked_data_put
+ */
+void aesd_chunked_data_release(struct aesd_chunk_pool *pool, struct aesd_chunked_data *list)
+{
+    struct aesd_chunked_data *next;
+
+    while (list != NULL)
+    {
+        next = list->next;
+        aesd_chunked_data_put(pool, list);
+        list = next;
+    }
+}
+
+/**
+ * Appends @param count bytes from @param buf to @param data, filling its last chunk before
+ * taking new ones from @param spare.  @param spare and the table of @param data must have room
+ * for them, see aesd_chunked_data_chunks_needed.  Never allocates, so it may be called with a lock held.
+ * @param newline_rtn set to whether the appended bytes hold a newline
+ * @return 0 on success, or -EFAULT if @param buf could not be read or -ENOMEM if there was no room,
+ * with @param data and @param spare as they were before
+ */
+int aesd_chunked_data_append(struct aesd_chunked_data *data, struct aesd_chunk_list *spare,
+            const char __user *buf, size_t count, bool *newline_rtn)
+{
+    size_t old_size = data->size;
+    size_t old_count = data->count;
+    size_t offset, length;
+    bool newline = false;
+    char *dst;
+    int retval = 0;
+
+    while (count > 0)
+    {
+        /* Every chunk is full, take the next one */
+        if (data->size == chunk_start(data, data->count))
+        {
+            if (data->count == data->capacity || spare->count == 0)
+            {
+                retval = -ENOMEM;
+                break;
+            }
+            data->chunk[data->count++] = list_pop(spare);
+        }
+        offset = data->size - chunk_start(data, data->count - 1);
+        length = chunk_room(data, data->count - 1) - offset;
+        if (length > count)
+        {
+            length = count;
+        }
+        dst = data->chunk[data->count - 1] + offset;
+        if (copy_from_user(dst, buf, length))
+        {
+            retval = -EFAULT;
+            break;
+        }
+        newline = newline || memchr(dst, '\n', length) != NULL;
+        data->size += length;
+        buf += length;
+        count -= length;
+    }
+
+    if (retval != 0)
+    {
+        /* Drop what was appended, the chunks taken go back to the spare ones */
+        while (data->count > old_count)
+        {
+            list_push(spare, data->chunk[--data->count]);
+        }
+        data->size = old_size;
+        return retval;
+    }
+    *newline_rtn = newline;
+    return 0;
+}
+
+/**
+ * @param data the data to read from
+ * @param offset the zero referenced offset of the first byte to read
+ * @param length_rtn set to the number of bytes stored contiguously from @param offset, up to the end
+ *      of its chunk or of @param data.  Only set when @param offset is within @param data.
+ * @return the location of the byte at @param offset, or NULL if @param data holds fewer bytes
+ */
+const char *aesd_chunked_data_at(const struct aesd_chunked_data *data, size_t offset, size_t *length_rtn)
+{
+    size_t index, within;
+
+    if (data == NULL || offset >= data->size)
+    {
+        return NULL;
+    }
+    if (offset < data->head_size)
+    {
+        index = 0;
+        within = offset;
+    }
+    else
+    {
+        index = (offset - data->head_size) / AESD_CHUNK_SIZE + (data->head_size != 0);
+        within = (offset - data->head_size) % AESD_CHUNK_SIZE;
+    }
+    *length_rtn = chunk_room(data, index) - within;
+    if (*length_rtn > data->size - offset)
+    {
+        *length_rtn = data->size - offset;
+    }
+    return data->chunk[index] + within;
+}
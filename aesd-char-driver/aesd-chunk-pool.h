@@ -0,0 +1,152 @@
+/*
+ * aesd-chunk-pool.h
+ *
+ * Chunked storage of the writes the aesdchar device keeps.  The bytes of a write live in
+ * fixed size chunks taken from a pool, so appending to a write never copies the bytes it
+ * already holds, and chunks can be taken from the pool and given back to it while the
+ * device lock is not held.  Writes are reference counted, so readers copy from them without
+ * the lock while the writer is free to evict them.
+ */
+
+#ifndef AESD_CHUNK_POOL_H
+#define AESD_CHUNK_POOL_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/refcount.h>
+struct kmem_cache;
+#else
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#define __user
+#endif
+
+/**
+ * Bytes of data in each chunk, one page so the pool packs a chunk per page
+ */
+#define AESD_CHUNK_SIZE 4096
+
+struct aesd_chunk_pool
+{
+#ifdef __KERNEL__
+    /**
+     * Cache every chunk is allocated from
+     */
+    struct kmem_cache *cache;
+#else
+    /**
+     * Number of chunks allocated and not yet freed, for harnesses to check for leaks
+     */
+    long outstanding;
+    /**
+     * Data whose last reference was dropped, moved to waiting by aesd_chunk_pool_reclaim
+     */
+    struct aesd_chunked_data *retired;
+    /**
+     * Data freed by the next aesd_chunk_pool_reclaim
+     */
+    struct aesd_chunked_data *waiting;
+#endif
+};
+
+/**
+ * Chunks taken from a pool but not holding data, linked through their first bytes
+ */
+struct aesd_chunk_list
+{
+    void *head;
+    size_t count;
+};
+
+/**
+ * The contents of one write.  The first chunk may be a head stored right after the table,
+ * sized to the bytes of the write call that started the write, so a line written at once
+ * takes a single allocation of about its size.  The other chunks come from the pool.  Every
+ * chunk but the last one is full, so the chunk holding a byte is found by a division.
+ */
+struct aesd_chunked_data
+{
+    /**
+     * Next data in a list of data waiting to be released
+     */
+    struct aesd_chunked_data *next;
+    /**
+     * The table the head is stored after when the table has grown since, freed along with this one
+     */
+    struct aesd_chunked_data *head_table;
+#ifdef __KERNEL__
+    /**
+     * References of the circular buffer and of the readers copying from the data
+     */
+    refcount_t refs;
+    /**
+     * Frees the data once no reader may look at it anymore
+     */
+    struct rcu_head rcu;
+    /**
+     * Pool the chunks go back to, set when the last reference is dropped
+     */
+    struct aesd_chunk_pool *pool;
+#else
+    int refs;
+#endif
+    /**
+     * Number of bytes stored
+     */
+    size_t size;
+    /**
+     * Number of bytes the head chunk has room for, 0 without a head
+     */
+    size_t head_size;
+    /**
+     * Number of chunks holding the bytes, the head included
+     */
+    size_t count;
+    /**
+     * Number of chunks the table has room for
+     */
+    size_t capacity;
+    char *chunk[];
+};
+
+extern int aesd_chunk_pool_init(struct aesd_chunk_pool *pool);
+
+extern void aesd_chunk_pool_destroy(struct aesd_chunk_pool *pool);
+
+extern int aesd_chunk_pool_reserve(struct aesd_chunk_pool *pool, struct aesd_chunk_list *list, size_t count);
+
+extern void aesd_chunk_pool_release(struct aesd_chunk_pool *pool, struct aesd_chunk_list *list);
+
+#ifndef __KERNEL__
+extern void aesd_chunk_pool_reclaim(struct aesd_chunk_pool *pool);
+#endif
+
+extern struct aesd_chunked_data *aesd_chunked_data_alloc(size_t capacity, size_t head_size);
+
+extern struct aesd_chunked_data *aesd_chunked_data_grow(struct aesd_chunked_data *to, struct aesd_chunked_data *from,
+            struct aesd_chunked_data **retired_rtn);
+
+extern size_t aesd_chunked_data_chunks_needed(const struct aesd_chunked_data *data, size_t add_size);
+
+extern void aesd_chunked_data_free(struct aesd_chunked_data *list);
+
+extern void aesd_chunked_data_release(struct aesd_chunk_pool *pool, struct aesd_chunked_data *list);
+
+extern bool aesd_chunked_data_get(struct aesd_chunked_data *data);
+
+extern void aesd_chunked_data_put(struct aesd_chunk_pool *pool, struct aesd_chunked_data *data);
+
+extern int aesd_chunked_data_append(struct aesd_chunked_data *data, struct aesd_chunk_list *spare,
+            const char __user *buf, size_t count, bool *newline_rtn);
+
+extern const char *aesd_chunked_data_at(const struct aesd_chunked_data *data, size_t offset, size_t *length_rtn);
+
+/**
+ * @return the number of chunks @param size bytes take
+ */
+static inline size_t aesd_chunks_for(size_t size)
+{
+    return (size + AESD_CHUNK_SIZE - 1) / AESD_CHUNK_SIZE;
+}
+
+#endif /* AESD_CHUNK_POOL_H */
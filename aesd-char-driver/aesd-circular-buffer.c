@@ -10,12 +10,62 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+/* Slot arrays of large buffers may not fit in contiguous pages */
+#define slots_alloc(count, size) kvcalloc(count, size, GFP_KERNEL)
+#define slots_free(ptr) kvfree(ptr)
 #else
+#include <stdlib.h>
 #include <string.h>
+#define slots_alloc(count, size) calloc(count, size)
+#define slots_free(ptr) free(ptr)
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/* Slot count places after slot, count at most the capacity */
+static inline uint32_t slot_after(const struct aesd_circular_buffer *buffer, uint32_t slot, uint32_t count)
+{
+    /* Both are below the capacity, so one subtraction wraps it, without the division of a modulo */
+    slot += count;
+    return slot >= buffer->capacity ? slot - buffer->capacity : slot;
+}
+
+/* Slot of the entry entry_number places after the oldest one */
+static inline uint32_t entry_index(const struct aesd_circular_buffer *buffer, uint32_t entry_number)
+{
+    return slot_after(buffer, buffer->out_offs, entry_number);
+}
+
+/* File position of the first byte of the entry entry_number places after the oldest one */
+static inline size_t entry_position(const struct aesd_circular_buffer *buffer, uint32_t entry_number)
+{
+    return buffer->entry_start[entry_index(buffer, entry_number)] - buffer->base_offset;
+}
+
+/**
+ * @param buffer the buffer to take the entry from.  Any necessary locking must be performed by caller.
+ * @param entry_number the zero referenced number of the entry, counting from the oldest valid one
+ * @param entry_start_rtn is a pointer specifying a location to store the file position of the first byte of
+ *      the returned entry, the total size of the entries before it.  This value is only set when the entry exists.
+ * @return the struct aesd_buffer_entry structure of entry @param entry_number, or NULL if @param buffer holds
+ * fewer entries.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            size_t entry_number, size_t *entry_start_rtn)
+{
+    if (buffer == NULL || entry_number >= aesd_circular_buffer_entry_count(buffer))
+    {
+        return NULL;
+    }
+    if (entry_start_rtn != NULL)
+    {
+        *entry_start_rtn = entry_position(buffer, entry_number);
+    }
+    return &buffer->entry[entry_index(buffer, entry_number)];
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -29,76 +79,97 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t index, entry_count, i;
+    uint32_t low, count, half;
 
-    /* Check if buffer is NULL */
-    if (buffer == NULL)
+    /* Check if buffer is NULL or the position is past the data it holds */
+    if (buffer == NULL || char_offset >= buffer->total_size)
     {
         return NULL;
     }
 
-    /* Initialize index to the first valid entry */
-    index = buffer->out_offs;
-    
-    /* Determine number of valid entries in the buffer */
-    if (buffer->full)
-    {
-        /* All entries are valid */
-        entry_count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
-    else if (buffer->in_offs >= buffer->out_offs)
+    /*
+     * Binary search for the last entry starting at or before char_offset.  Entry positions only grow,
+     * and an empty entry shares its position with the next one, so the last match is never empty.
+     * The first entry starts at 0 and always matches; each step halves the entries after low that
+     * may still match, and moves low without a branch the CPU would have to guess.
+     */
+    low = 0;
+    count = aesd_circular_buffer_entry_count(buffer);
+    while (count > 1)
     {
-        /* Entries from out_offs to in_offs are valid */
-        entry_count = buffer->in_offs - buffer->out_offs;
+        half = count / 2;
+        low = entry_position(buffer, low + half) <= char_offset ? low + half : low;
+        count -= half;
     }
-    else
+
+    if (entry_offset_byte_rtn != NULL)
     {
-        /* Entries from out_offs to end and from beginning to in_offs are valid */
-        entry_count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + buffer->in_offs - buffer->out_offs;
+        *entry_offset_byte_rtn = char_offset - entry_position(buffer, low);
     }
+    return &buffer->entry[entry_index(buffer, low)];
+}
 
-    /* Search through the valid entries for the requested char_offset */
-    for (i = 0; i < entry_count; i++)
+/**
+* Removes the oldest entry of @param buffer, if it holds any.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry, for the caller to release, or NULL if @param buffer is empty
+*/
+const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest;
+    const char *buffptr;
+
+    if (buffer == NULL || aesd_circular_buffer_entry_count(buffer) == 0)
     {
-        if (char_offset < buffer->entry[index].size)
-        {
-            if (entry_offset_byte_rtn != NULL)
-            {
-                *entry_offset_byte_rtn = char_offset;
-            }
-            return &buffer->entry[index];
-        }
-        char_offset -= buffer->entry[index].size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        return NULL;
     }
-    return NULL;
+    oldest = &buffer->entry[buffer->out_offs];
+    buffptr = oldest->buffptr;
+
+    /* The file now starts with the entry after it */
+    buffer->base_offset += oldest->size;
+    buffer->total_size -= oldest->size;
+
+    /* Empty slots have a NULL buffptr and chunks, so a loop over every slot never sees the entry again */
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    oldest->chunks = NULL;
+    buffer->out_offs = slot_after(buffer, buffer->out_offs, 1);
+    buffer->count--;
+    buffer->full = false;
+    return buffptr;
 }
 
 /**
-* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* Adds entry @param add_entry to @param buffer in the slot specified by buffer->in_offs.
+* First removes the oldest entries while the buffer is full or the new entry would exceed its byte budget,
+* advancing buffer->out_offs to the new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* Keeps the entry positions and the total size up to date, so lookups never walk the entries.  Each entry is
+* removed at most once, so adding is O(1) amortized however many entries one addition removes.
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    uint32_t index;
+
     if ((buffer != NULL) && (add_entry != NULL))
     {
-        /* Add the new entry */
-        buffer->entry[buffer->in_offs] = *add_entry;
-
-        /* Increment the in_offset */
-        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-        /* If the buffer was full, increment the out_offset to point to the oldest entry */
-        if (buffer->full)
+        while (aesd_circular_buffer_must_evict(buffer, add_entry->size))
         {
-            buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+            aesd_circular_buffer_remove_oldest(buffer);
         }
 
+        /* Add the new entry after the data of the others */
+        index = buffer->in_offs;
+        buffer->entry[index] = *add_entry;
+        buffer->entry_start[index] = buffer->base_offset + buffer->total_size;
+        buffer->total_size += add_entry->size;
+        buffer->in_offs = slot_after(buffer, buffer->in_offs, 1);
+        buffer->count++;
+
         /* If the buffer is now full, set the full flag */
-        if (buffer->in_offs == buffer->out_offs)
+        if (aesd_circular_buffer_entry_count(buffer) == buffer->capacity)
         {
             buffer->full = true;
         }
@@ -106,9 +177,177 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct keeping
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its inline slots
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->entry_start = buffer->inline_entry_start;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Allocates in @param slots what a buffer needs to keep @param capacity entries, from 1 to
+* AESD_CIRCULAR_BUFFER_MAX_CAPACITY: nothing while @param capacity fits the inline slots, and slots for exactly
+* @param capacity entries otherwise.  Needs no lock, so the allocation can happen before the caller takes any.
+* @return 0 on success, or -1 if the capacity is out of range or memory is exhausted
+*/
+int aesd_circular_buffer_prepare_capacity(struct aesd_circular_buffer_slots *slots, uint32_t capacity)
+{
+    slots->capacity = capacity;
+    slots->entry = NULL;
+    slots->entry_start = NULL;
+    if (capacity == 0 || capacity > AESD_CIRCULAR_BUFFER_MAX_CAPACITY)
+    {
+        return -1;
+    }
+    if (capacity > AESD_CIRCULAR_BUFFER_INLINE_SLOTS)
+    {
+        slots->entry = slots_alloc(capacity, sizeof(*slots->entry));
+        slots->entry_start = slots_alloc(capacity, sizeof(*slots->entry_start));
+        if (slots->entry == NULL || slots->entry_start == NULL)
+        {
+            aesd_circular_buffer_release_slots(slots);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+* Releases @param slots prepared by aesd_circular_buffer_prepare_capacity but not committed
+*/
+void aesd_circular_buffer_release_slots(struct aesd_circular_buffer_slots *slots)
+{
+    slots_free(slots->entry);
+    slots_free(slots->entry_start);
+    slots->entry = NULL;
+    slots->entry_start = NULL;
+}
+
+/**
+* Changes the number of entries @param buffer keeps to the capacity @param slots were prepared for, and cannot fail.
+* The valid entries are moved in order to the first of the new slots.  @param buffer may not hold more entries than
+* the new capacity, the caller removes the oldest ones first.  @param slots are taken over by @param buffer, or
+* released if it already had that capacity.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_commit_capacity(struct aesd_circular_buffer *buffer, struct aesd_circular_buffer_slots *slots)
+{
+    struct aesd_buffer_entry moved[AESD_CIRCULAR_BUFFER_INLINE_SLOTS];
+    size_t moved_start[AESD_CIRCULAR_BUFFER_INLINE_SLOTS];
+    struct aesd_buffer_entry *entry = slots->entry;
+    size_t *entry_start = slots->entry_start;
+    uint32_t capacity = slots->capacity;
+    uint32_t count = aesd_circular_buffer_entry_count(buffer);
+    uint32_t i, from;
+
+    if (capacity == buffer->capacity)
+    {
+        aesd_circular_buffer_release_slots(slots);
+        return;
+    }
+    slots->entry = NULL;
+    slots->entry_start = NULL;
+
+    if (entry == NULL)
+    {
+        entry = buffer->inline_entry;
+        entry_start = buffer->inline_entry_start;
+        if (buffer->entry == buffer->inline_entry)
+        {
+            /* Moving within the inline slots, the entries go through a copy */
+            for (i = 0; i < count; i++)
+            {
+                from = entry_index(buffer, i);
+                moved[i] = buffer->entry[from];
+                moved_start[i] = buffer->entry_start[from];
+            }
+            memset(buffer->inline_entry, 0, sizeof(buffer->inline_entry));
+            memcpy(buffer->inline_entry, moved, count * sizeof(moved[0]));
+            memcpy(buffer->inline_entry_start, moved_start, count * sizeof(moved_start[0]));
+        }
+        else
+        {
+            /* Shrinking back into the inline slots, unused since the buffer grew out of them */
+            memset(entry, 0, sizeof(buffer->inline_entry));
+        }
+    }
+
+    /* Entries keep their positions, only their slots change */
+    if (entry != buffer->entry)
+    {
+        for (i = 0; i < count; i++)
+        {
+            from = entry_index(buffer, i);
+            entry[i] = buffer->entry[from];
+            entry_start[i] = buffer->entry_start[from];
+        }
+        if (buffer->entry != buffer->inline_entry)
+        {
+            slots_free(buffer->entry);
+            slots_free(buffer->entry_start);
+        }
+        buffer->entry = entry;
+        buffer->entry_start = entry_start;
+    }
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = count == capacity ? 0 : count;
+    buffer->full = count == capacity;
+}
+
+/**
+* Changes the number of entries @param buffer keeps to @param capacity, from 1 to AESD_CIRCULAR_BUFFER_MAX_CAPACITY,
+* with aesd_circular_buffer_prepare_capacity and aesd_circular_buffer_commit_capacity.  @param buffer may not hold
+* more than @param capacity entries, the caller removes the oldest ones first.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, or -1 with @param buffer unchanged if the capacity is out of range, too small for the
+* entries held or memory is exhausted
+*/
+int aesd_circular_buffer_set_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    struct aesd_circular_buffer_slots slots;
+
+    if (buffer == NULL || capacity < aesd_circular_buffer_entry_count(buffer))
+    {
+        return -1;
+    }
+    if (capacity == buffer->capacity)
+    {
+        return 0;
+    }
+    if (aesd_circular_buffer_prepare_capacity(&slots, capacity) != 0)
+    {
+        return -1;
+    }
+    aesd_circular_buffer_commit_capacity(buffer, &slots);
+    return 0;
+}
+
+/**
+* Limits the bytes @param buffer keeps in all entries together to @param max_bytes, 0 for no limit.
+* Entries already over the new limit stay until the caller removes them, for instance while
+* aesd_circular_buffer_size exceeds it, or until entries are added.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_set_max_bytes(struct aesd_circular_buffer *buffer, size_t max_bytes)
+{
+    buffer->max_bytes = max_bytes;
+}
+
+/**
+* Releases the slots @param buffer allocated and initializes it again.  The memory of its entries
+* is not released, the caller does that first, for instance with AESD_CIRCULAR_BUFFER_FOREACH.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->entry != buffer->inline_entry)
+    {
+        slots_free(buffer->entry);
+        slots_free(buffer->entry_start);
+    }
+    aesd_circular_buffer_init(buffer);
 }
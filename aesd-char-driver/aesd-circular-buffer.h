@@ -16,8 +16,24 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of entries a buffer keeps after aesd_circular_buffer_init, until its capacity is changed
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+/**
+ * Largest capacity aesd_circular_buffer_set_capacity accepts
+ */
+#define AESD_CIRCULAR_BUFFER_MAX_CAPACITY (1u << 20)
+
+/**
+ * Slots stored inside the buffer structure, more than the default capacity, so a buffer
+ * needs no allocation until it is made larger
+ */
+#define AESD_CIRCULAR_BUFFER_INLINE_SLOTS 16
+
+struct aesd_chunked_data;
+
 struct aesd_buffer_entry
 {
     /**
@@ -28,27 +44,80 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * The chunks storing the contents instead of buffptr, which is NULL then, see aesd-chunk-pool.h.
+     * The buffer never looks at the contents, only the caller does.
+     */
+    struct aesd_chunked_data *chunks;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations, with
+     * capacity slots in use.  Points to inline_entry or to an allocated array.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Position of the first byte of each entry in the stream of every byte ever added, kept
+     * for the same slots as entry.  Positions grow by each added size and may wrap around,
+     * so only their differences from base_offset are meaningful.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t *entry_start;
+    /**
+     * Stream position of the first byte of the oldest entry, the file position 0
+     */
+    size_t base_offset;
+    /**
+     * Number of bytes in all valid entries together
+     */
+    size_t total_size;
+    /**
+     * Number of entries kept, which is also the number of slots in use.  Adding one more
+     * overwrites the oldest.
+     */
+    uint32_t capacity;
+    /**
+     * Most bytes kept in all entries together, 0 for no limit.  Adding an entry removes the
+     * oldest ones until it fits, though the newest entry is kept even if it alone is larger.
+     */
+    size_t max_bytes;
     /**
      * The current location in the entry structure where the next write should
-     * be stored.
+     * be stored, below capacity
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
+    /**
+     * Number of valid entries.  in_offs equals out_offs both when the buffer is empty and
+     * when it is full, this tells them apart without looking at full.
+     */
+    uint32_t count;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds capacity entries
      */
     bool full;
+    /**
+     * Storage of the slots while there are at most AESD_CIRCULAR_BUFFER_INLINE_SLOTS
+     */
+    struct aesd_buffer_entry inline_entry[AESD_CIRCULAR_BUFFER_INLINE_SLOTS];
+    size_t inline_entry_start[AESD_CIRCULAR_BUFFER_INLINE_SLOTS];
+};
+
+/**
+ * Slots allocated for a new capacity before the buffer is locked, see aesd_circular_buffer_prepare_capacity
+ */
+struct aesd_circular_buffer_slots
+{
+    uint32_t capacity;
+    /**
+     * Slots for capacity entries, NULL if the inline slots hold them
+     */
+    struct aesd_buffer_entry *entry;
+    size_t *entry_start;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,16 +125,70 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_set_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern int aesd_circular_buffer_prepare_capacity(struct aesd_circular_buffer_slots *slots, uint32_t capacity);
+
+extern void aesd_circular_buffer_commit_capacity(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_slots *slots);
+
+extern void aesd_circular_buffer_release_slots(struct aesd_circular_buffer_slots *slots);
+
+extern void aesd_circular_buffer_set_max_bytes(struct aesd_circular_buffer *buffer, size_t max_bytes);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            size_t entry_number, size_t *entry_start_rtn);
+
+/**
+ * @param buffer the buffer to count the entries of.  Any necessary locking must be performed by caller.
+ * @return the number of valid entries in @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_entry_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->count;
+}
+
+/**
+ * @return the number of bytes stored in all valid entries of @param buffer together
+ */
+static inline size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
+/**
+ * @param buffer the buffer to check.  Any necessary locking must be performed by caller.
+ * @param add_size the size of the entry about to be added
+ * @return true if the oldest entry of @param buffer has to be removed before an entry of @param add_size
+ * bytes is added, because the buffer holds capacity entries or the entry would exceed max_bytes.
+ * Callers that release the memory of removed entries call aesd_circular_buffer_remove_oldest while this
+ * holds, then aesd_circular_buffer_add_entry.
+ */
+static inline bool aesd_circular_buffer_must_evict(const struct aesd_circular_buffer *buffer, size_t add_size)
+{
+    if (aesd_circular_buffer_entry_count(buffer) == 0)
+    {
+        return false;
+    }
+    return aesd_circular_buffer_entry_count(buffer) >= buffer->capacity ||
+           (buffer->max_bytes != 0 && buffer->total_size + add_size > buffer->max_bytes);
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
+ * Slots without a valid entry have a NULL buffptr and chunks.
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +197,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -38,9 +38,17 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set the number of writes the device keeps, dropping the oldest ones that no longer fit
+#define AESDCHAR_IOCSCAPACITY _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Get the number of writes the device keeps
+#define AESDCHAR_IOCGCAPACITY _IOR(AESD_IOC_MAGIC, 3, uint32_t)
+// Set the bytes the device keeps in all writes together, 0 for no limit, dropping the oldest writes that no longer fit
+#define AESDCHAR_IOCSMAXBYTES _IOW(AESD_IOC_MAGIC, 4, uint64_t)
+// Get the bytes the device keeps in all writes together, 0 for no limit
+#define AESDCHAR_IOCGMAXBYTES _IOR(AESD_IOC_MAGIC, 5, uint64_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
@@ -9,7 +9,10 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/rwsem.h>
 #include "aesd-circular-buffer.h"
+#include "aesd-chunk-pool.h"
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -28,12 +31,18 @@
 
 struct aesd_dev
 {
-    /* Working entry for partial writes */
-    struct aesd_buffer_entry add_entry;
+    /* Working entry for partial writes, NULL until the first bytes of a write arrive */
+    struct aesd_chunked_data *pending;
+    /* Pool the chunks of all writes come from */
+    struct aesd_chunk_pool pool;
     /* Circular buffer */
     struct aesd_circular_buffer buffer;
-    /* Lock for mutual exclusion */
+    /* Lock for mutual exclusion of writers, readers never take it */
     struct mutex lock;
+    /* Changed by writers around every change of the buffer, readers retry lookups it saw change */
+    seqcount_mutex_t seq;
+    /* Taken by readers for lookups and by capacity changes while the slots move */
+    struct rw_semaphore resize_lock;
     struct cdev cdev;     /* Char device structure      */
 };
 
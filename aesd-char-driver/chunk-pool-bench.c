@@ -0,0 +1,347 @@
+/**
+ * @file chunk-pool-bench.c
+ * @brief Userspace harness of the write path of the aesdchar driver
+ *
+ * Replays writes arriving in pieces, the way a writer without a full line to hand sends them,
+ * through two versions of the driver's write path: growing the whole entry with krealloc for
+ * each piece, as the driver did before, and appending the piece to chunks of an
+ * aesd_chunk_pool.  krealloc is emulated with power of two allocations, the sizes kmalloc
+ * rounds to, so it copies the entry whenever it outgrows its allocation.  Both keep the
+ * entries in an aesd_circular_buffer and free the ones evicted; the entries kept are then
+ * read back through the lookups of the read path and compared with what was written, and
+ * every chunk must be back in the pool at the end.
+ *
+ * Usage: chunk-pool-bench [-e entry_size -p piece_size] [-b bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-chunk-pool.h"
+
+struct scenario
+{
+    size_t entry_size;
+    size_t piece_size;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Smallest power of two holding size, the size krealloc would give an entry */
+static size_t kmalloc_size(size_t size)
+{
+    size_t allocated = 8;
+
+    while (allocated < size)
+    {
+        allocated *= 2;
+    }
+    return allocated;
+}
+
+/* Write the entries in pieces, growing each with krealloc as the driver did. Returns ns per piece. */
+static double run_krealloc(struct aesd_circular_buffer *buffer, const char *source, size_t entry_size,
+                           size_t piece_size, long entries)
+{
+    struct aesd_buffer_entry entry;
+    char *pending = NULL;
+    char *grown;
+    size_t size = 0, allocated = 0;
+    size_t offset, length;
+    long pieces = 0;
+    double start;
+    long i;
+
+    start = now_ns();
+    for (i = 0; i < entries; i++)
+    {
+        for (offset = 0; offset < entry_size; offset += length, pieces++)
+        {
+            length = piece_size < entry_size - offset ? piece_size : entry_size - offset;
+            if (size + length > allocated)
+            {
+                allocated = kmalloc_size(size + length);
+                grown = malloc(allocated);
+                if (grown == NULL)
+                {
+                    perror("malloc");
+                    exit(EXIT_FAILURE);
+                }
+                if (pending != NULL)
+                {
+                    memcpy(grown, pending, size);
+                    free(pending);
+                }
+                pending = grown;
+            }
+            memcpy(pending + size, source + offset, length);
+            size += length;
+            if (memchr(pending + size - length, '\n', length))
+            {
+                while (aesd_circular_buffer_must_evict(buffer, size))
+                {
+                    free((char *)aesd_circular_buffer_remove_oldest(buffer));
+                }
+                entry.buffptr = pending;
+                entry.size = size;
+                entry.chunks = NULL;
+                aesd_circular_buffer_add_entry(buffer, &entry);
+                pending = NULL;
+                size = 0;
+                allocated = 0;
+            }
+        }
+    }
+    return (now_ns() - start) / pieces;
+}
+
+/* Write the entries in pieces, appending each to chunks as the driver does. Returns ns per piece. */
+static double run_chunked(struct aesd_circular_buffer *buffer, struct aesd_chunk_pool *pool, const char *source,
+                          size_t entry_size, size_t piece_size, long entries)
+{
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry *oldest;
+    struct aesd_chunk_list spare = { NULL, 0 };
+    struct aesd_chunked_data *pending = NULL;
+    struct aesd_chunked_data *table, *retired, *released;
+    size_t offset, length, chunks, capacity;
+    bool newline;
+    long pieces = 0;
+    double start;
+    long i;
+
+    start = now_ns();
+    for (i = 0; i < entries; i++)
+    {
+        for (offset = 0; offset < entry_size; offset += length, pieces++)
+        {
+            length = piece_size < entry_size - offset ? piece_size : entry_size - offset;
+
+            /* What the driver allocates before taking its lock */
+            retired = NULL;
+            released = NULL;
+            if (pending == NULL)
+            {
+                pending = aesd_chunked_data_alloc(aesd_chunks_for(length), length);
+                if (pending == NULL)
+                {
+                    perror("aesd_chunked_data_alloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            chunks = aesd_chunked_data_chunks_needed(pending, length);
+            if (pending->count + chunks > pending->capacity)
+            {
+                capacity = pending->count + chunks;
+                if (capacity < pending->capacity * 2)
+                {
+                    capacity = pending->capacity * 2;
+                }
+                table = aesd_chunked_data_alloc(capacity, 0);
+                if (table == NULL)
+                {
+                    perror("aesd_chunked_data_alloc");
+                    exit(EXIT_FAILURE);
+                }
+                pending = aesd_chunked_data_grow(table, pending, &retired);
+            }
+            if (aesd_chunk_pool_reserve(pool, &spare, chunks) != 0)
+            {
+                perror("aesd_chunk_pool_reserve");
+                exit(EXIT_FAILURE);
+            }
+
+            /* What it does with the lock held */
+            if (aesd_chunked_data_append(pending, &spare, source + offset, length, &newline) != 0)
+            {
+                fprintf(stderr, "append failed\n");
+                exit(EXIT_FAILURE);
+            }
+            if (newline)
+            {
+                while (aesd_circular_buffer_must_evict(buffer, pending->size))
+                {
+                    oldest = aesd_circular_buffer_get_entry(buffer, 0, NULL);
+                    oldest->chunks->next = released;
+                    released = oldest->chunks;
+                    aesd_circular_buffer_remove_oldest(buffer);
+                }
+                entry.buffptr = NULL;
+                entry.size = pending->size;
+                entry.chunks = pending;
+                aesd_circular_buffer_add_entry(buffer, &entry);
+                pending = NULL;
+            }
+
+            /* And after dropping it */
+            aesd_chunk_pool_release(pool, &spare);
+            aesd_chunked_data_free(retired);
+            aesd_chunked_data_release(pool, released);
+            /* Without readers every point is past a grace period */
+            aesd_chunk_pool_reclaim(pool);
+        }
+    }
+    return (now_ns() - start) / pieces;
+}
+
+/* Compare every entry kept with the source through the lookups of the read path, then free them */
+static int check_and_free(struct aesd_circular_buffer *buffer, struct aesd_chunk_pool *pool,
+                          const char *source, size_t entry_size)
+{
+    struct aesd_buffer_entry *entry;
+    struct aesd_chunked_data *released = NULL;
+    const char *data;
+    size_t position, entry_offset, length;
+    uint32_t index;
+    int rc = 0;
+
+    for (position = 0; position < aesd_circular_buffer_size(buffer); position += length)
+    {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, position, &entry_offset);
+        if (entry == NULL)
+        {
+            rc = -1;
+            break;
+        }
+        if (entry->chunks != NULL)
+        {
+            data = aesd_chunked_data_at(entry->chunks, entry_offset, &length);
+        }
+        else
+        {
+            data = entry->buffptr + entry_offset;
+            length = entry->size - entry_offset;
+        }
+        if (data == NULL || memcmp(data, source + (position % entry_size), length) != 0)
+        {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc != 0)
+    {
+        fprintf(stderr, "position %zu differs from what was written\n", position);
+    }
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index)
+    {
+        if (entry->chunks != NULL)
+        {
+            entry->chunks->next = released;
+            released = entry->chunks;
+        }
+        free((char *)entry->buffptr);
+    }
+    aesd_chunked_data_release(pool, released);
+    aesd_circular_buffer_free(buffer);
+    return rc;
+}
+
+/* Run one scenario through both write paths and print its line of the table */
+static int run(const struct scenario *scenario, size_t bytes)
+{
+    static struct aesd_circular_buffer buffer;
+    struct aesd_chunk_pool pool;
+    char *source;
+    long entries = bytes / scenario->entry_size;
+    double krealloc_ns, chunked_ns;
+    size_t i;
+    int rc = 0;
+
+    if (entries < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 2)
+    {
+        entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 2;
+    }
+    source = malloc(scenario->entry_size);
+    if (source == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < scenario->entry_size; i++)
+    {
+        source[i] = 'a' + i % 26;
+    }
+    source[scenario->entry_size - 1] = '\n';
+
+    aesd_chunk_pool_init(&pool);
+    aesd_circular_buffer_init(&buffer);
+    krealloc_ns = run_krealloc(&buffer, source, scenario->entry_size, scenario->piece_size, entries);
+    rc |= check_and_free(&buffer, &pool, source, scenario->entry_size);
+
+    aesd_circular_buffer_init(&buffer);
+    chunked_ns = run_chunked(&buffer, &pool, source, scenario->entry_size, scenario->piece_size, entries);
+    rc |= check_and_free(&buffer, &pool, source, scenario->entry_size);
+    aesd_chunk_pool_destroy(&pool);
+    if (pool.outstanding != 0)
+    {
+        fprintf(stderr, "%ld chunks not given back to the pool\n", pool.outstanding);
+        rc = -1;
+    }
+
+    printf("%-10zu %-10zu %10.1f %10.1f %9.1fx\n", scenario->entry_size, scenario->piece_size,
+           krealloc_ns, chunked_ns, krealloc_ns / chunked_ns);
+    fflush(stdout);
+    free(source);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct scenario default_scenarios[] = {
+        { 64, 64 }, { 4096, 512 }, { 65536, 1024 }, { 1048576, 4096 }, { 16777216, 65536 },
+    };
+    struct scenario scenario = { 0, 0 };
+    size_t bytes = 256 * 1024 * 1024;
+    int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:p:b:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                scenario.entry_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                scenario.piece_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                bytes = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-e entry_size -p piece_size] [-b bytes]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    printf("ns per piece written, krealloc of the entry against appending to chunks\n");
+    printf("%-10s %-10s %10s %10s %10s\n", "entry", "piece", "krealloc", "chunked", "speedup");
+    if (scenario.entry_size != 0 || scenario.piece_size != 0)
+    {
+        if (scenario.entry_size == 0 || scenario.piece_size == 0)
+        {
+            fprintf(stderr, "-e and -p go together and may not be 0\n");
+            return EXIT_FAILURE;
+        }
+        return run(&scenario, bytes) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    for (i = 0; i < (int)(sizeof(default_scenarios) / sizeof(default_scenarios[0])); i++)
+    {
+        if (run(&default_scenarios[i], bytes) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Userspace benchmark of the position lookups of the aesdchar circular buffer
+ *
+ * For each capacity, fills a buffer with entries of random sizes, wrapping it several times
+ * so the oldest entry sits in the middle of the slots, then times the three lookups the
+ * driver performs under its lock: the entry holding a file position (read), the total size
+ * (llseek) and the start of an entry (AESDCHAR_IOCSEEKTO).  Each is measured with the
+ * buffer's cumulative offsets and with the walk over the entries the driver did before,
+ * which also checks the results.
+ *
+ * Usage: circular-buffer-bench [-c capacity] [-n lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+/* Largest entry added, sizes are uniform from 1 byte up to this */
+#define MAX_ENTRY_SIZE 200
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Entry holding the file position, walking the entries from the oldest as the driver did */
+static struct aesd_buffer_entry *walk_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                           size_t *entry_offset_byte_rtn)
+{
+    uint32_t count = aesd_circular_buffer_entry_count(buffer);
+    uint32_t i, index;
+
+    for (i = 0; i < count; i++)
+    {
+        index = (buffer->out_offs + i) % buffer->capacity;
+        if (char_offset < buffer->entry[index].size)
+        {
+            *entry_offset_byte_rtn = char_offset;
+            return &buffer->entry[index];
+        }
+        char_offset -= buffer->entry[index].size;
+    }
+    return NULL;
+}
+
+/* Total size, summing every entry as the driver's llseek did */
+static size_t walk_size(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    size_t size = 0;
+    uint32_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index)
+    {
+        size += entry->size;
+    }
+    return size;
+}
+
+/* Start of an entry, summing the entries before it as the driver's ioctl did */
+static size_t walk_entry_start(struct aesd_circular_buffer *buffer, uint32_t entry_number)
+{
+    size_t offset = 0;
+    uint32_t i;
+
+    for (i = 0; i < entry_number; i++)
+    {
+        offset += buffer->entry[(buffer->out_offs + i) % buffer->capacity].size;
+    }
+    return offset;
+}
+
+/* Fill a buffer of the given capacity, check and time its lookups and print its lines of the table */
+static int run(uint32_t capacity, long lookups)
+{
+    static struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry *found, *expected;
+    size_t *positions;
+    uint32_t *entry_numbers;
+    size_t found_offset = 0, expected_offset = 0;
+    volatile size_t sink = 0;
+    double start, indexed_ns, walk_ns;
+    size_t total;
+    uint32_t count;
+    long i;
+    int rc = -1;
+
+    aesd_circular_buffer_init(&buffer);
+    if (aesd_circular_buffer_set_capacity(&buffer, capacity) != 0)
+    {
+        fprintf(stderr, "capacity %u refused\n", capacity);
+        return -1;
+    }
+    for (i = 0; i < (long)capacity * 3 + capacity / 2; i++)
+    {
+        /* Only the sizes matter, the lookups never touch the data */
+        entry.buffptr = NULL;
+        entry.chunks = NULL;
+        entry.size = 1 + rand() % MAX_ENTRY_SIZE;
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    count = aesd_circular_buffer_entry_count(&buffer);
+    total = aesd_circular_buffer_size(&buffer);
+    positions = malloc(lookups * sizeof(*positions));
+    entry_numbers = malloc(lookups * sizeof(*entry_numbers));
+    if (positions == NULL || entry_numbers == NULL)
+    {
+        perror("malloc");
+        goto out;
+    }
+    if (count != capacity || total != walk_size(&buffer))
+    {
+        fprintf(stderr, "%u entries of %zu bytes, entries hold %zu\n", count, total, walk_size(&buffer));
+        goto out;
+    }
+    for (i = 0; i < lookups; i++)
+    {
+        positions[i] = (size_t)rand() % total;
+        entry_numbers[i] = (uint32_t)rand() % count;
+    }
+
+    for (i = 0; i < lookups; i++)
+    {
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, positions[i], &found_offset);
+        expected = walk_find(&buffer, positions[i], &expected_offset);
+        if (found != expected || found_offset != expected_offset)
+        {
+            fprintf(stderr, "position %zu: lookup disagrees with the walk\n", positions[i]);
+            goto out;
+        }
+        if (aesd_circular_buffer_get_entry(&buffer, entry_numbers[i], &found_offset) == NULL ||
+            found_offset != walk_entry_start(&buffer, entry_numbers[i]))
+        {
+            fprintf(stderr, "entry %u: start disagrees with the walk\n", entry_numbers[i]);
+            goto out;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < lookups; i++)
+    {
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, positions[i], &found_offset);
+        sink += found_offset + (found != NULL);
+    }
+    indexed_ns = (now_ns() - start) / lookups;
+    start = now_ns();
+    for (i = 0; i < lookups; i++)
+    {
+        found = walk_find(&buffer, positions[i], &found_offset);
+        sink += found_offset + (found != NULL);
+    }
+    walk_ns = (now_ns() - start) / lookups;
+    printf("%-10u %-12s %10.1f %12.1f %9.1fx\n", capacity, "fpos", indexed_ns, walk_ns, walk_ns / indexed_ns);
+
+    start = now_ns();
+    for (i = 0; i < lookups; i++)
+    {
+        /* Keep the compiler from hoisting the load out of the loop */
+        __asm__ volatile("" ::: "memory");
+        sink += aesd_circular_buffer_size(&buffer);
+    }
+    indexed_ns = (now_ns() - start) / lookups;
+    start = now_ns();
+    for (i = 0; i < lookups; i++)
+    {
+        __asm__ volatile("" ::: "memory");
+        sink += walk_size(&buffer);
+    }
+    walk_ns = (now_ns() - start) / lookups;
+    printf("%-10u %-12s %10.1f %12.1f %9.1fx\n", capacity, "total size", indexed_ns, walk_ns, walk_ns / indexed_ns);
+
+    start = now_ns();
+    for (i = 0; i < lookups; i++)
+    {
+        aesd_circular_buffer_get_entry(&buffer, entry_numbers[i], &found_offset);
+        sink += found_offset;
+    }
+    indexed_ns = (now_ns() - start) / lookups;
+    start = now_ns();
+    for (i = 0; i < lookups; i++)
+    {
+        sink += walk_entry_start(&buffer, entry_numbers[i]);
+    }
+    walk_ns = (now_ns() - start) / lookups;
+    printf("%-10u %-12s %10.1f %12.1f %9.1fx\n", capacity, "seekto", indexed_ns, walk_ns, walk_ns / indexed_ns);
+    fflush(stdout);
+    rc = sink == 0 ? -1 : 0;
+
+out:
+    free(positions);
+    free(entry_numbers);
+    aesd_circular_buffer_free(&buffer);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t default_capacities[] = { 10, 100, 1000, 10000, 100000 };
+    uint32_t capacities[16];
+    int num_capacities = 0;
+    long lookups = 0;
+    long run_lookups;
+    int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (num_capacities == (int)(sizeof(capacities) / sizeof(capacities[0])))
+                {
+                    fprintf(stderr, "Too many capacities\n");
+                    return EXIT_FAILURE;
+                }
+                capacities[num_capacities++] = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                lookups = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c capacity] [-n lookups]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (num_capacities == 0)
+    {
+        for (i = 0; i < (int)(sizeof(default_capacities) / sizeof(default_capacities[0])); i++)
+        {
+            capacities[num_capacities++] = default_capacities[i];
+        }
+    }
+
+    srand(1);
+    printf("ns per lookup, indexed against the walk over the entries\n");
+    printf("%-10s %-12s %10s %12s %10s\n", "capacity", "lookup", "indexed", "walk", "speedup");
+    for (i = 0; i < num_capacities; i++)
+    {
+        /* The walks are linear in the capacity, fewer of them keep large capacities quick */
+        run_lookups = lookups > 0 ? lookups : 20000000 / (capacities[i] + 10);
+        if (run(capacities[i], run_lookups) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -12,14 +12,14 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/uaccess.h> // copy_{to,from}_user
-#include <linux/slab.h> // krealloc, kfree
-#include <linux/string.h> // memchr
+#include <linux/rcupdate.h> // rcu_read_lock
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
@@ -28,6 +28,16 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Ahmed Wefky");
 MODULE_LICENSE("Dual BSD/GPL");
 
+/* Number of writes kept at load time, AESDCHAR_IOCSCAPACITY changes it later */
+static uint max_writes = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_writes, uint, 0444);
+MODULE_PARM_DESC(max_writes, "Number of writes the device keeps, the oldest is dropped for a new one (default 10)");
+
+/* Bytes kept in all writes together at load time, AESDCHAR_IOCSMAXBYTES changes it later */
+static ulong max_bytes;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Bytes the device keeps in all writes together, the oldest are dropped for a new one (default 0, no limit)");
+
 struct aesd_dev aesd_device;
 
 int aesd_open(struct inode *inode, struct file *filp)
@@ -52,6 +62,35 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/*
+ * Find the write holding a file position and take a reference on it, without the device mutex.
+ * Writers change the circular buffer inside dev->seq, so the lookup is repeated until no change
+ * happened during it, and RCU keeps the write found from being freed until the reference is taken.
+ */
+static struct aesd_chunked_data *get_data_for_fpos(struct aesd_dev *dev, loff_t pos, size_t *entry_offset)
+{
+    struct aesd_buffer_entry *entry;
+    struct aesd_chunked_data *data;
+    unsigned int seq;
+
+    /* Only a capacity change moves the slots, the lookup must not see them while they move */
+    down_read(&dev->resize_lock);
+    rcu_read_lock();
+    do
+    {
+        do
+        {
+            seq = read_seqcount_begin(&dev->seq);
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, pos, entry_offset);
+            data = entry ? READ_ONCE(entry->chunks) : NULL;
+        } while (read_seqcount_retry(&dev->seq, seq));
+        /* If the write was evicted and released since, the position holds a later write now */
+    } while (data != NULL && !aesd_chunked_data_get(data));
+    rcu_read_unlock();
+    up_read(&dev->resize_lock);
+    return data;
+}
+
 /* Read data from the circular buffer managed by the device driver */
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
@@ -61,25 +100,26 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     /* A pointer to hold the device structure */
     struct aesd_dev *dev = filp->private_data;
     
-    /* A pointer to hold the buffer entry */
-    struct aesd_buffer_entry *entry;
+    /* The write holding the file position, referenced while it is copied */
+    struct aesd_chunked_data *entry;
     
     /* Byte offset within the entry */
     size_t entry_offset = 0;
     
     size_t bytes_to_read = 0;
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    /* Bytes copied so far, and the contiguous bytes of the current chunk */
+    size_t copied = 0;
+    size_t length;
+    const char *data;
 
-    /* Lock the device mutex preventing race conditions if a write operation tries to access the buffer while reading */
-    if (mutex_lock_interruptible(&dev->lock))
-    {
-        /* Return error if the lock acquisition is interrupted by a signal */
-        return -ERESTARTSYS;
-    }
+    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
 
-    /* Find the entry in the circular buffer based on the linear file position */
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
+    /*
+     * Find the entry in the circular buffer based on the linear file position.  Readers never take the
+     * device mutex, so they run in parallel and a writer only waits for them during a capacity change.
+     */
+    entry = get_data_for_fpos(dev, *f_pos, &entry_offset);
     if (entry)
     {
         /* The driver reads up to the end of a single entry per read call or the requested count whichever is smaller */
@@ -92,8 +132,22 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
             bytes_to_read = count;
         }
 
-        /* Copy data from the kernel buffer to user provided buffer */
-        if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_to_read))
+        /* Copy data from the chunks of the entry to user provided buffer, a chunk at a time */
+        while (copied < bytes_to_read)
+        {
+            data = aesd_chunked_data_at(entry, entry_offset + copied, &length);
+            if (length > bytes_to_read - copied)
+            {
+                length = bytes_to_read - copied;
+            }
+            if (copy_to_user(buf + copied, data, length))
+            {
+                break;
+            }
+            copied += length;
+        }
+
+        if (copied < bytes_to_read)
         {
             /* Return error if copy_to_user fails */
             retval = -EFAULT;
@@ -105,86 +159,170 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
             /* Return the number of bytes read */
             retval = bytes_to_read;
         }
+
+        /* A writer may have evicted the entry meanwhile, the last reference frees it */
+        aesd_chunked_data_put(&dev->pool, entry);
     }
 
-    mutex_unlock(&dev->lock);
     return retval;
 }
 
+/* Remove the oldest write, adding it to the list of writes to free once the device lock is dropped */
+static void evict_oldest(struct aesd_dev *dev, struct aesd_chunked_data **released)
+{
+    struct aesd_buffer_entry *oldest = aesd_circular_buffer_get_entry(&dev->buffer, 0, NULL);
+
+    oldest->chunks->next = *released;
+    *released = oldest->chunks;
+    aesd_circular_buffer_remove_oldest(&dev->buffer);
+}
+
 /* Write data to the circular buffer managed by the device driver */
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = -ENOMEM;
+    ssize_t retval;
 
     /* A pointer to hold the device structure */
     struct aesd_dev *dev = filp->private_data;
 
-    /* A pointer to the reallocated buffer */
-    const char *new_buffptr;
+    /* Chunks for the new bytes, taken before locking so no allocation happens with the lock held */
+    struct aesd_chunk_list spare = { NULL, 0 };
+
+    /* A table for the partial write, also allocated before locking, and the ones it replaced */
+    struct aesd_chunked_data *table = NULL;
+    struct aesd_chunked_data *old_tables = NULL;
+    struct aesd_chunked_data *retired;
 
-    /* A pointer to the entry to be freed if the circular buffer is full */
-    const char *entry_to_free = NULL;
+    /* Writes evicted for the new one, freed once the lock is dropped */
+    struct aesd_chunked_data *released = NULL;
+
+    struct aesd_buffer_entry entry;
+    size_t chunks, capacity, head_size;
+    bool newline;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-    
-    /* Lock the device mutex preventing race conditions if a read operation tries to access the buffer while writing */
-    if (mutex_lock_interruptible(&dev->lock))
+
+    if (count == 0)
     {
-        /* Return error if the lock acquisition is interrupted by a signal */
-        return -ERESTARTSYS;
+        return 0;
     }
 
-    /* Reallocate memory for the add_entry buffer to accommodate the new data */
-    new_buffptr = krealloc(dev->add_entry.buffptr, dev->add_entry.size + count, GFP_KERNEL);
-    if (!new_buffptr)
+    /* Most writes start a new entry, which holds up to a chunk of them in the head after its table */
+    if (READ_ONCE(dev->pending) == NULL)
     {
-        /* Return error if krealloc fails */
-        mutex_unlock(&dev->lock);
-        return -ENOMEM;
+        table = aesd_chunked_data_alloc(aesd_chunks_for(count), count);
     }
 
-    /* Update the add_entry buffer pointer */
-    dev->add_entry.buffptr = new_buffptr;
-
-    /* Copy data from user provided buffer to the add_entry buffer */
-    if (copy_from_user((char *)dev->add_entry.buffptr + dev->add_entry.size, buf, count))
+    /*
+     * Lock the device mutex.  If the partial write needs a larger table or more chunks than were
+     * allocated, unlock to allocate them and try again, so no allocation is made with the lock held.
+     */
+    for (;;)
     {
-        /* Return error if copy_from_user fails */
-        retval = -EFAULT;
+        if (mutex_lock_interruptible(&dev->lock))
+        {
+            /* Return error if the lock acquisition is interrupted by a signal */
+            retval = -ERESTARTSYS;
+            goto out;
+        }
+        if (dev->pending == NULL && table != NULL)
+        {
+            dev->pending = table;
+            table = NULL;
+        }
+        chunks = 0;
+        capacity = 0;
+        head_size = 0;
+        if (dev->pending == NULL)
+        {
+            capacity = aesd_chunks_for(count);
+            head_size = count;
+        }
+        else
+        {
+            chunks = aesd_chunked_data_chunks_needed(dev->pending, count);
+            if (dev->pending->count + chunks > dev->pending->capacity)
+            {
+                if (table != NULL && table->capacity >= dev->pending->count + chunks)
+                {
+                    /* Only the chunk pointers move, the bytes written so far are not copied */
+                    dev->pending = aesd_chunked_data_grow(table, dev->pending, &retired);
+                    table = NULL;
+                    if (retired != NULL)
+                    {
+                        retired->next = old_tables;
+                        old_tables = retired;
+                    }
+                }
+                else
+                {
+                    capacity = max_t(size_t, dev->pending->count + chunks, dev->pending->capacity * 2);
+                }
+            }
+            if (capacity == 0 && spare.count >= chunks)
+            {
+                break;
+            }
+        }
         mutex_unlock(&dev->lock);
-        return retval;
-    }
-
-
-    dev->add_entry.size += count;
-    retval = count;
 
-    /* Check if the written data contains a newline character */
-    /* The driver buffers data until a newline character is received */
-    if (memchr(dev->add_entry.buffptr + dev->add_entry.size - count, '\n', count))
-    {
-        /* If the circular buffer is full, free the oldest entry after adding the new one */
-        if (dev->buffer.full)
+        if (capacity != 0)
         {
-            entry_to_free = dev->buffer.entry[dev->buffer.in_offs].buffptr;
+            aesd_chunked_data_free(table);
+            table = aesd_chunked_data_alloc(capacity, head_size);
+            if (table == NULL)
+            {
+                retval = -ENOMEM;
+                goto out;
+            }
         }
+        if (aesd_chunk_pool_reserve(&dev->pool, &spare, chunks) != 0)
+        {
+            retval = -ENOMEM;
+            goto out;
+        }
+    }
 
-        /* Add the new entry to the circular buffer */
-        aesd_circular_buffer_add_entry(&dev->buffer, &dev->add_entry);
+    /* Copy data from user provided buffer after the bytes of the partial write */
+    retval = aesd_chunked_data_append(dev->pending, &spare, buf, count, &newline);
+    if (retval == 0)
+    {
+        retval = count;
 
-        /* If an entry is to be freed, free it */
-        if (entry_to_free)
+        /* The driver buffers data until a newline character is received */
+        if (newline)
         {
-            kfree(entry_to_free);
-        }
+            /* Readers looking up a position during the change retry */
+            write_seqcount_begin(&dev->seq);
+
+            /* Drop the oldest entries while the buffer is full or the new one would exceed its byte budget */
+            while (aesd_circular_buffer_must_evict(&dev->buffer, dev->pending->size))
+            {
+                evict_oldest(dev, &released);
+            }
+
+            /* Add the new entry to the circular buffer, which now has room for it */
+            entry.buffptr = NULL;
+            entry.size = dev->pending->size;
+            entry.chunks = dev->pending;
+            aesd_circular_buffer_add_entry(&dev->buffer, &entry);
 
-        /* Reset the add_entry for the next write operation */
-        dev->add_entry.buffptr = NULL;
-        dev->add_entry.size = 0;
+            write_seqcount_end(&dev->seq);
+
+            /* The next write starts a new entry */
+            dev->pending = NULL;
+        }
     }
 
     mutex_unlock(&dev->lock);
+
+out:
+    /* Give back what was reserved but not used and release the evicted writes, without the lock */
+    aesd_chunk_pool_release(&dev->pool, &spare);
+    aesd_chunked_data_free(table);
+    aesd_chunked_data_free(old_tables);
+    aesd_chunked_data_release(&dev->pool, released);
     return retval;
 }
 
@@ -192,30 +330,18 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
     struct aesd_dev *dev = filp->private_data;
-    loff_t new_pos;
-    loff_t size = 0;
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
+    unsigned int seq;
+    size_t size;
 
-    /* Lock the device mutex preventing race conditions while seeking */
-    if (mutex_lock_interruptible(&dev->lock))
+    /* Read the total size the circular buffer keeps without the device mutex, as readers do */
+    do
     {
-        /* Return error if the lock acquisition is interrupted by a signal */
-        return -ERESTARTSYS;
-    }
-
-    /* Calculate the total size of data in the circular buffer */
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index)
-    {
-        size += entry->size;
-    }
-
-    /* Use the fixed_size_llseek helper to perform the seek operation */
-    new_pos = fixed_size_llseek(filp, offset, whence, size);
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_circular_buffer_size(&dev->buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
 
-    /* Unlock the device mutex */
-    mutex_unlock(&dev->lock);
-    return new_pos;
+    /* Use the fixed_size_llseek helper with that size */
+    return fixed_size_llseek(filp, offset, whence, size);
 }
 
 /* Handle ioctl commands for the aesdchar driver */
@@ -224,10 +350,13 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     int retval = 0;
     struct aesd_seekto seekto;
     struct aesd_dev *dev = filp->private_data;
-    uint8_t entry_count;
-    uint8_t i;
-    uint8_t index;
-    loff_t offset = 0;
+    struct aesd_buffer_entry *entry;
+    size_t entry_start, entry_size;
+    uint32_t capacity;
+    uint64_t budget;
+    struct aesd_chunked_data *released = NULL;
+    struct aesd_circular_buffer_slots slots;
+    unsigned int seq;
 
     /* Validate the ioctl command */
     if ((_IOC_TYPE(cmd) != AESD_IOC_MAGIC) || (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR))
@@ -246,61 +375,109 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             else
             {
-                /* Lock the device mutex preventing race conditions while seeking */
-                if (mutex_lock_interruptible(&dev->lock))
-                {
-                    /* Return error if the lock acquisition is interrupted by a signal */
-                    return -ERESTARTSYS;
-                }
-
-                /* Determine the number of valid entries in the circular buffer */
-                if (dev->buffer.full)
+                /* Look the entry up without the device mutex, as readers do */
+                down_read(&dev->resize_lock);
+                do
                 {
-                    /* All entries are valid */
-                    entry_count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-                }
-                else if (dev->buffer.in_offs >= dev->buffer.out_offs)
-                {
-                    /* Entries from out_offs to in_offs are valid */
-                    entry_count = dev->buffer.in_offs - dev->buffer.out_offs;
-                }
-                else
+                    seq = read_seqcount_begin(&dev->seq);
+                    /* The circular buffer knows where each entry starts, no need to walk the ones before it */
+                    entry = aesd_circular_buffer_get_entry(&dev->buffer, seekto.write_cmd, &entry_start);
+                    entry_size = entry ? READ_ONCE(entry->size) : 0;
+                } while (read_seqcount_retry(&dev->seq, seq));
+                up_read(&dev->resize_lock);
+
+                /* Validate the requested write_cmd and write_cmd_offset */
+                if (entry == NULL || seekto.write_cmd_offset >= entry_size)
                 {
-                    /* Entries from out_offs to end and from beginning to in_offs are valid */
-                    entry_count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + dev->buffer.in_offs - dev->buffer.out_offs;
-                }
-
-                /* Validate the requested write_cmd */
-                if (seekto.write_cmd >= entry_count)
-                {
-                    /* Invalid write_cmd */
                     retval = -EINVAL;
                 }
                 else
                 {
-                    index = dev->buffer.out_offs;
-                    /* Calculate the byte offset corresponding to the requested write_cmd and write_cmd_offset */
-                    for (i = 0; i < seekto.write_cmd; i++)
-                    {
-                        offset += dev->buffer.entry[index].size;
-                        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-                    }
-
-                    /* Validate the requested write_cmd_offset */
-                    if (seekto.write_cmd_offset >= dev->buffer.entry[index].size)
-                    {
-                        retval = -EINVAL;
-                    }
-                    else
-                    {
-                        offset += seekto.write_cmd_offset;
-                        filp->f_pos = offset;
-                        retval = 0;
-                    }
+                    filp->f_pos = entry_start + seekto.write_cmd_offset;
+                    retval = 0;
                 }
-                mutex_unlock(&dev->lock);
             }
             break;
+        case AESDCHAR_IOCSCAPACITY:
+            /* Copy the new capacity from user space and validate it */
+            if (get_user(capacity, (const uint32_t __user *)arg))
+            {
+                return -EFAULT;
+            }
+            if (capacity == 0 || capacity > AESD_CIRCULAR_BUFFER_MAX_CAPACITY)
+            {
+                return -EINVAL;
+            }
+            /* Allocate the new slots first, so running out of memory leaves the writes and the capacity as they were */
+            if (aesd_circular_buffer_prepare_capacity(&slots, capacity) != 0)
+            {
+                return -ENOMEM;
+            }
+            /* Lock the device mutex against other writers */
+            if (mutex_lock_interruptible(&dev->lock))
+            {
+                aesd_circular_buffer_release_slots(&slots);
+                return -ERESTARTSYS;
+            }
+            /* The writes that no longer fit are dropped, oldest first, like those a new write overwrites */
+            write_seqcount_begin(&dev->seq);
+            while (aesd_circular_buffer_entry_count(&dev->buffer) > capacity)
+            {
+                evict_oldest(dev, &released);
+            }
+            write_seqcount_end(&dev->seq);
+            /* Readers must not see the slots while they move, which cannot fail anymore */
+            down_write(&dev->resize_lock);
+            aesd_circular_buffer_commit_capacity(&dev->buffer, &slots);
+            up_write(&dev->resize_lock);
+            mutex_unlock(&dev->lock);
+            aesd_chunked_data_release(&dev->pool, released);
+            break;
+        case AESDCHAR_IOCGCAPACITY:
+            /* Copy the capacity to user space */
+            if (mutex_lock_interruptible(&dev->lock))
+            {
+                return -ERESTARTSYS;
+            }
+            capacity = dev->buffer.capacity;
+            mutex_unlock(&dev->lock);
+            retval = put_user(capacity, (uint32_t __user *)arg) ? -EFAULT : 0;
+            break;
+        case AESDCHAR_IOCSMAXBYTES:
+            /* Copy the new byte budget from user space, 64 bit get_user is not available on every target */
+            if (copy_from_user(&budget, (const void __user *)arg, sizeof(budget)))
+            {
+                return -EFAULT;
+            }
+            if (budget > SIZE_MAX)
+            {
+                return -EINVAL;
+            }
+            if (mutex_lock_interruptible(&dev->lock))
+            {
+                return -ERESTARTSYS;
+            }
+            aesd_circular_buffer_set_max_bytes(&dev->buffer, budget);
+            /* The writes that no longer fit are dropped, oldest first */
+            write_seqcount_begin(&dev->seq);
+            while (budget != 0 && aesd_circular_buffer_size(&dev->buffer) > budget)
+            {
+                evict_oldest(dev, &released);
+            }
+            write_seqcount_end(&dev->seq);
+            mutex_unlock(&dev->lock);
+            aesd_chunked_data_release(&dev->pool, released);
+            break;
+        case AESDCHAR_IOCGMAXBYTES:
+            /* Copy the byte budget to user space */
+            if (mutex_lock_interruptible(&dev->lock))
+            {
+                return -ERESTARTSYS;
+            }
+            budget = dev->buffer.max_bytes;
+            mutex_unlock(&dev->lock);
+            retval = copy_to_user((void __user *)arg, &budget, sizeof(budget)) ? -EFAULT : 0;
+            break;
         default:
             retval = -ENOTTY;
             break;
@@ -349,15 +526,39 @@ int aesd_init_module(void)
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    /* Initialize the AESD device mutex */
+    /* Initialize the AESD device mutex, the sequence count readers check for changes and the lock against resizes */
     mutex_init(&aesd_device.lock);
-    /* Initialize the AESD circular buffer */
+    seqcount_mutex_init(&aesd_device.seq, &aesd_device.lock);
+    init_rwsem(&aesd_device.resize_lock);
+    /* Initialize the AESD circular buffer, keeping as many writes as asked at load time */
     aesd_circular_buffer_init(&aesd_device.buffer);
+    if (max_writes == 0 || max_writes > AESD_CIRCULAR_BUFFER_MAX_CAPACITY)
+    {
+        printk(KERN_WARNING "max_writes must be from 1 to %u\n", AESD_CIRCULAR_BUFFER_MAX_CAPACITY);
+        unregister_chrdev_region(dev, 1);
+        return -EINVAL;
+    }
+    if (aesd_circular_buffer_set_capacity(&aesd_device.buffer, max_writes) != 0)
+    {
+        unregister_chrdev_region(dev, 1);
+        return -ENOMEM;
+    }
+    aesd_circular_buffer_set_max_bytes(&aesd_device.buffer, max_bytes);
+    /* Create the cache the chunks of the writes come from */
+    result = aesd_chunk_pool_init(&aesd_device.pool);
+    if (result)
+    {
+        aesd_circular_buffer_free(&aesd_device.buffer);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result )
     {
+        aesd_chunk_pool_destroy(&aesd_device.pool);
+        aesd_circular_buffer_free(&aesd_device.buffer);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -368,18 +569,25 @@ void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
     struct aesd_buffer_entry *entry;
-    uint8_t index;
+    uint32_t index;
+
+    /* Free the partial write if a write started but was not completed, along with the others */
+    struct aesd_chunked_data *released = aesd_device.pending;
 
     cdev_del(&aesd_device.cdev);
 
     /* Free all allocated buffer entries in the circular buffer */
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index)
     {
-        kfree(entry->buffptr);
+        if (entry->chunks)
+        {
+            entry->chunks->next = released;
+            released = entry->chunks;
+        }
     }
-
-    /* Free the partial write buffer if a write started but was not completed */
-    kfree(aesd_device.add_entry.buffptr);
+    aesd_chunked_data_release(&aesd_device.pool, released);
+    aesd_circular_buffer_free(&aesd_device.buffer);
+    aesd_chunk_pool_destroy(&aesd_device.pool);
 
     /* Destroy the device mutex */
     mutex_destroy(&aesd_device.lock);
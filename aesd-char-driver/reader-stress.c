@@ -0,0 +1,562 @@
+/**
+ * @file reader-stress.c
+ * @brief Multi-reader stress test of the aesdchar device
+ *
+ * Many reader threads tail the device while a writer adds lines of random lengths in random
+ * pieces, optionally with a thread changing the capacity meanwhile.  Every line is made of one
+ * letter and ends with a newline, so each slice a read returns must be one letter repeated,
+ * possibly followed by the newline as its last byte; bytes of another line or of freed memory
+ * show up as a mix.  Reads restart at position 0 once they reach the end.
+ *
+ * With -d the test runs against the device node, through read, write and ioctl.  Without it,
+ * the read and write paths of the driver are replayed in this process over the same circular
+ * buffer and chunk pool code, with a mutex, a sequence count and a reader-writer lock standing
+ * in for the kernel ones and reclaim after reader quiescent states standing in for RCU, so the
+ * lockless lookups can be checked under AddressSanitizer without loading the module.
+ *
+ * Usage: reader-stress [-d device] [-r readers] [-s seconds] [-c] [-m max_bytes]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-chunk-pool.h"
+#include "aesd_ioctl.h"
+
+#define MAX_READERS 64
+
+/* Bytes asked for by each read */
+#define READ_SIZE 8192
+
+/* Lines written between two reclaims of the released writes in process */
+#define RECLAIM_INTERVAL 64
+
+struct reader
+{
+    pthread_t thread;
+    int id;
+    /* Odd while the reader looks up an entry, so reclaim waits for it to change */
+    unsigned long generation;
+    unsigned long reads;
+    unsigned long bytes;
+};
+
+static const char *device_path;
+static volatile int stop;
+static int failed;
+static struct reader readers[MAX_READERS];
+static int num_readers = 8;
+
+/* The in process device, mirroring struct aesd_dev */
+static struct
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_chunk_pool pool;
+    struct aesd_chunked_data *pending;
+    pthread_mutex_t lock;
+    unsigned int seq;
+    pthread_rwlock_t resize_lock;
+} dev;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s\n", what);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+    stop = 1;
+}
+
+static unsigned int seq_begin(void)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&dev.seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        sched_yield();
+    }
+    return seq;
+}
+
+static int seq_retry(unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&dev.seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void seq_write_begin(void)
+{
+    __atomic_store_n(&dev.seq, dev.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(void)
+{
+    __atomic_store_n(&dev.seq, dev.seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until every reader looking up an entry has finished, standing in for an RCU grace period */
+static void synchronize_readers(void)
+{
+    unsigned long generation[MAX_READERS];
+    int i;
+
+    for (i = 0; i < num_readers; i++)
+    {
+        generation[i] = __atomic_load_n(&readers[i].generation, __ATOMIC_SEQ_CST);
+    }
+    for (i = 0; i < num_readers; i++)
+    {
+        while ((generation[i] & 1) && __atomic_load_n(&readers[i].generation, __ATOMIC_SEQ_CST) == generation[i])
+        {
+            sched_yield();
+        }
+    }
+}
+
+/* Remove the oldest write as the driver's evict_oldest does, called inside a sequence count write */
+static void evict_oldest(struct aesd_chunked_data **released)
+{
+    struct aesd_buffer_entry *oldest = aesd_circular_buffer_get_entry(&dev.buffer, 0, NULL);
+
+    oldest->chunks->next = *released;
+    *released = oldest->chunks;
+    aesd_circular_buffer_remove_oldest(&dev.buffer);
+}
+
+/* The driver's aesd_read, returns the bytes read into buf or 0 at the end */
+static size_t local_read(struct reader *reader, size_t *pos, char *buf, size_t count)
+{
+    struct aesd_buffer_entry *entry;
+    struct aesd_chunked_data *data;
+    size_t entry_offset = 0;
+    size_t copied = 0;
+    size_t bytes_to_read, length;
+    const char *chunk;
+    unsigned int seq;
+
+    pthread_rwlock_rdlock(&dev.resize_lock);
+    __atomic_add_fetch(&reader->generation, 1, __ATOMIC_SEQ_CST);
+    do
+    {
+        do
+        {
+            seq = seq_begin();
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev.buffer, *pos, &entry_offset);
+            data = entry ? __atomic_load_n(&entry->chunks, __ATOMIC_RELAXED) : NULL;
+        } while (seq_retry(seq));
+    } while (data != NULL && !aesd_chunked_data_get(data));
+    __atomic_add_fetch(&reader->generation, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&dev.resize_lock);
+
+    if (data == NULL)
+    {
+        return 0;
+    }
+    bytes_to_read = data->size - entry_offset;
+    if (bytes_to_read > count)
+    {
+        bytes_to_read = count;
+    }
+    while (copied < bytes_to_read)
+    {
+        chunk = aesd_chunked_data_at(data, entry_offset + copied, &length);
+        if (length > bytes_to_read - copied)
+        {
+            length = bytes_to_read - copied;
+        }
+        memcpy(buf + copied, chunk, length);
+        copied += length;
+    }
+    aesd_chunked_data_put(&dev.pool, data);
+    *pos += bytes_to_read;
+    return bytes_to_read;
+}
+
+/* The driver's aesd_write, with the allocations made under the mutex for brevity */
+static void local_write(const char *buf, size_t count)
+{
+    struct aesd_chunk_list spare = { NULL, 0 };
+    struct aesd_chunked_data *retired = NULL;
+    struct aesd_chunked_data *released = NULL;
+    struct aesd_chunked_data *table;
+    struct aesd_buffer_entry entry;
+    size_t chunks, capacity;
+    bool newline;
+
+    pthread_mutex_lock(&dev.lock);
+    if (dev.pending == NULL)
+    {
+        dev.pending = aesd_chunked_data_alloc(aesd_chunks_for(count), count);
+    }
+    chunks = aesd_chunked_data_chunks_needed(dev.pending, count);
+    if (dev.pending->count + chunks > dev.pending->capacity)
+    {
+        capacity = dev.pending->count + chunks;
+        if (capacity < dev.pending->capacity * 2)
+        {
+            capacity = dev.pending->capacity * 2;
+        }
+        table = aesd_chunked_data_alloc(capacity, 0);
+        if (table == NULL)
+        {
+            fail("out of memory");
+            pthread_mutex_unlock(&dev.lock);
+            return;
+        }
+        dev.pending = aesd_chunked_data_grow(table, dev.pending, &retired);
+    }
+    if (aesd_chunk_pool_reserve(&dev.pool, &spare, chunks) != 0 ||
+        aesd_chunked_data_append(dev.pending, &spare, buf, count, &newline) != 0)
+    {
+        fail("append failed");
+    }
+    else if (newline)
+    {
+        seq_write_begin();
+        while (aesd_circular_buffer_must_evict(&dev.buffer, dev.pending->size))
+        {
+            evict_oldest(&released);
+        }
+        entry.buffptr = NULL;
+        entry.size = dev.pending->size;
+        entry.chunks = dev.pending;
+        aesd_circular_buffer_add_entry(&dev.buffer, &entry);
+        seq_write_end();
+        dev.pending = NULL;
+    }
+    pthread_mutex_unlock(&dev.lock);
+
+    aesd_chunk_pool_release(&dev.pool, &spare);
+    aesd_chunked_data_free(retired);
+    aesd_chunked_data_release(&dev.pool, released);
+}
+
+/* The driver's AESDCHAR_IOCSCAPACITY */
+static void local_set_capacity(uint32_t capacity)
+{
+    struct aesd_chunked_data *released = NULL;
+
+    pthread_mutex_lock(&dev.lock);
+    seq_write_begin();
+    while (aesd_circular_buffer_entry_count(&dev.buffer) > capacity)
+    {
+        evict_oldest(&released);
+    }
+    seq_write_end();
+    pthread_rwlock_wrlock(&dev.resize_lock);
+    if (aesd_circular_buffer_set_capacity(&dev.buffer, capacity) != 0)
+    {
+        fail("capacity change failed");
+    }
+    pthread_rwlock_unlock(&dev.resize_lock);
+    pthread_mutex_unlock(&dev.lock);
+    aesd_chunked_data_release(&dev.pool, released);
+}
+
+/* Check a slice a read returned: one letter repeated, possibly ended by the newline of its line */
+static int check_slice(const char *buf, size_t length)
+{
+    size_t i;
+
+    if (length == 1 && buf[0] == '\n')
+    {
+        return 0;
+    }
+    if (buf[0] < 'a' || buf[0] > 'z')
+    {
+        return -1;
+    }
+    for (i = 1; i < length; i++)
+    {
+        if (buf[i] != buf[0] && !(buf[i] == '\n' && i == length - 1))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *reader_main(void *arg)
+{
+    struct reader *reader = arg;
+    char buf[READ_SIZE];
+    size_t pos = 0;
+    ssize_t length;
+    int fd = -1;
+
+    if (device_path != NULL)
+    {
+        fd = open(device_path, O_RDONLY);
+        if (fd < 0)
+        {
+            perror(device_path);
+            fail("reader could not open the device");
+            return NULL;
+        }
+    }
+    while (!stop)
+    {
+        if (fd >= 0)
+        {
+            length = read(fd, buf, sizeof(buf));
+            if (length < 0)
+            {
+                perror("read");
+                fail("read failed");
+                break;
+            }
+        }
+        else
+        {
+            length = local_read(reader, &pos, buf, sizeof(buf));
+        }
+        if (length == 0)
+        {
+            /* Tail the device again from its start */
+            if (fd >= 0)
+            {
+                lseek(fd, 0, SEEK_SET);
+            }
+            pos = 0;
+            continue;
+        }
+        if (check_slice(buf, length) != 0)
+        {
+            fprintf(stderr, "reader %d: slice of %zd bytes mixes lines: %.40s\n", reader->id, length, buf);
+            fail("torn read");
+            break;
+        }
+        reader->reads++;
+        reader->bytes += length;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return NULL;
+}
+
+static void *resizer_main(void *arg)
+{
+    unsigned int seed = 2;
+    uint32_t capacity;
+    int fd = -1;
+
+    (void)arg;
+    if (device_path != NULL)
+    {
+        fd = open(device_path, O_RDWR);
+        if (fd < 0)
+        {
+            perror(device_path);
+            fail("resizer could not open the device");
+            return NULL;
+        }
+    }
+    while (!stop)
+    {
+        capacity = 1 + rand_r(&seed) % 100;
+        if (fd >= 0)
+        {
+            if (ioctl(fd, AESDCHAR_IOCSCAPACITY, &capacity) != 0)
+            {
+                perror("AESDCHAR_IOCSCAPACITY");
+                fail("capacity change failed");
+            }
+        }
+        else
+        {
+            local_set_capacity(capacity);
+        }
+        usleep(1000);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Write lines of random lengths in random pieces until stopped, returns the number of lines */
+static unsigned long write_lines(void)
+{
+    static char line[3 * AESD_CHUNK_SIZE + 256];
+    unsigned int seed = 1;
+    unsigned long lines = 0;
+    size_t length, offset, piece;
+    ssize_t written;
+    int fd = -1;
+
+    if (device_path != NULL)
+    {
+        fd = open(device_path, O_WRONLY);
+        if (fd < 0)
+        {
+            perror(device_path);
+            fail("writer could not open the device");
+            return 0;
+        }
+    }
+    while (!stop)
+    {
+        /* Mostly short lines, some spanning several chunks */
+        length = rand_r(&seed) % 4 == 0 ? 1 + rand_r(&seed) % sizeof(line) : 1 + rand_r(&seed) % 200u;
+        memset(line, 'a' + lines % 26, length - 1);
+        line[length - 1] = '\n';
+        for (offset = 0; offset < length && !stop; offset += piece)
+        {
+            piece = 1 + rand_r(&seed) % (length - offset);
+            if (fd >= 0)
+            {
+                written = write(fd, line + offset, piece);
+                if (written <= 0)
+                {
+                    perror("write");
+                    fail("write failed");
+                    break;
+                }
+                piece = written;
+            }
+            else
+            {
+                local_write(line + offset, piece);
+            }
+        }
+        lines++;
+        if (fd < 0 && lines % RECLAIM_INTERVAL == 0)
+        {
+            synchronize_readers();
+            aesd_chunk_pool_reclaim(&dev.pool);
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return lines;
+}
+
+static void *timer_main(void *arg)
+{
+    sleep(*(int *)arg);
+    stop = 1;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct aesd_chunked_data *released = NULL;
+    struct aesd_buffer_entry *entry;
+    pthread_t timer, resizer;
+    unsigned long lines, reads = 0, bytes = 0;
+    size_t max_bytes = 0;
+    int seconds = 3;
+    int resize = 0;
+    uint32_t index;
+    int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:r:s:cm:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                device_path = optarg;
+                break;
+            case 'r':
+                num_readers = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            case 'c':
+                resize = 1;
+                break;
+            case 'm':
+                max_bytes = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d device] [-r readers] [-s seconds] [-c] [-m max_bytes]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (num_readers < 1 || num_readers > MAX_READERS)
+    {
+        fprintf(stderr, "From 1 to %d readers\n", MAX_READERS);
+        return EXIT_FAILURE;
+    }
+
+    if (device_path == NULL)
+    {
+        aesd_circular_buffer_init(&dev.buffer);
+        aesd_circular_buffer_set_max_bytes(&dev.buffer, max_bytes);
+        aesd_chunk_pool_init(&dev.pool);
+        pthread_mutex_init(&dev.lock, NULL);
+        pthread_rwlock_init(&dev.resize_lock, NULL);
+    }
+    else if (max_bytes != 0)
+    {
+        fprintf(stderr, "-m only applies in process, load the module with max_bytes instead\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < num_readers; i++)
+    {
+        readers[i].id = i;
+        pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]);
+    }
+    if (resize)
+    {
+        pthread_create(&resizer, NULL, resizer_main, NULL);
+    }
+    pthread_create(&timer, NULL, timer_main, &seconds);
+    lines = write_lines();
+    pthread_join(timer, NULL);
+    if (resize)
+    {
+        pthread_join(resizer, NULL);
+    }
+    for (i = 0; i < num_readers; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        bytes += readers[i].bytes;
+    }
+
+    if (device_path == NULL)
+    {
+        /* As the driver's cleanup, then every chunk must be back */
+        if (dev.pending != NULL)
+        {
+            released = dev.pending;
+        }
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev.buffer, index)
+        {
+            if (entry->chunks != NULL)
+            {
+                entry->chunks->next = released;
+                released = entry->chunks;
+            }
+        }
+        aesd_chunked_data_release(&dev.pool, released);
+        aesd_circular_buffer_free(&dev.buffer);
+        aesd_chunk_pool_destroy(&dev.pool);
+        if (dev.pool.outstanding != 0)
+        {
+            fprintf(stderr, "%ld chunks not given back to the pool\n", dev.pool.outstanding);
+            failed = 1;
+        }
+    }
+
+    printf("%d readers, %d s: %lu lines written, %lu reads of %.1f MB, %.0f reads/s per reader\n",
+           num_readers, seconds, lines, reads, bytes / 1e6, (double)reads / seconds / num_readers);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,281 @@
+/**
+ * @file accept-bench.c
+ * @brief Connections accepted per second by aesdsocket as its per-core event loops scale
+ *
+ * Starts the server once for each number of event loops from 1 to N (-A 1 ... -A N), with the
+ * metrics endpoint enabled, and has a set of client threads open connections as fast as they
+ * can.  Every client connects and closes right away with a reset, so neither side piles up
+ * TIME_WAIT sockets; the server still accepts, registers and closes each connection.  The
+ * accept rate is read from the server's own connections_accepted_total counter, so clients
+ * that only made it into the listen backlog do not count.
+ *
+ * The clients run on the same machine and compete with the server for its cores; give them
+ * enough threads (-c) to keep N loops busy, or pin the server and the clients apart with
+ * taskset.  Build the server with the reactor in data file mode:
+ *
+ *     make CFLAGS="-O2 -DUSE_AESD_CHAR_DEVICE=0" aesdsocket bench
+ *
+ * Usage: accept-bench [-b server] [-n max loops] [-c client threads] [-d seconds]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SERVER_PORT 9000
+#define METRICS_PORT "9101"
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define ACCEPTED_METRIC "aesdsocket_connections_accepted_total "
+/* Time for the loops to settle before the measured interval starts */
+#define WARMUP_US 300000
+
+/* Work and results of one client thread */
+typedef struct
+{
+    pthread_t thread;
+    unsigned long connections;
+    unsigned long failures;
+} client_t;
+
+static atomic_int clients_stop;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_port(int port)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Connect and reset as fast as possible until told to stop */
+static void *client_thread(void *arg)
+{
+    client_t *client = arg;
+    struct linger reset = { 1, 0 };
+    int fd;
+
+    while (!atomic_load_explicit(&clients_stop, memory_order_relaxed))
+    {
+        fd = connect_port(SERVER_PORT);
+        if (fd == -1)
+        {
+            client->failures++;
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(fd);
+        client->connections++;
+    }
+    return NULL;
+}
+
+/* Read the accepted connection counter from the metrics endpoint, returns -1 on failure */
+static long long read_accepted(void)
+{
+    static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    char response[16384];
+    size_t len = 0;
+    ssize_t n;
+    char *line;
+    int fd;
+
+    fd = connect_port(atoi(METRICS_PORT));
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != (ssize_t)sizeof(request) - 1)
+    {
+        close(fd);
+        return -1;
+    }
+    while (len < sizeof(response) - 1 && (n = recv(fd, response + len, sizeof(response) - 1 - len, 0)) > 0)
+    {
+        len += n;
+    }
+    close(fd);
+    response[len] = '\0';
+    line = strstr(response, "\n" ACCEPTED_METRIC);
+    if (line == NULL)
+    {
+        return -1;
+    }
+    return strtoll(line + strlen("\n" ACCEPTED_METRIC), NULL, 10);
+}
+
+/* Start the server with the given arguments and wait until its metrics answer */
+static pid_t start_server(char *const argv[])
+{
+    pid_t pid;
+    int i;
+
+    unlink(DATA_FILE);
+    pid = fork();
+    if (pid == 0)
+    {
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    for (i = 0; i < 50; i++)
+    {
+        usleep(100000);
+        if (read_accepted() >= 0)
+        {
+            return pid;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/* Measure one number of event loops, returns the accept rate or a negative value on failure */
+static double run_loops(const char *server, int loops, int num_clients, double duration)
+{
+    client_t *clients = calloc(num_clients, sizeof(client_t));
+    char loops_arg[16];
+    char *argv[] = { (char *)server, "-A", loops_arg, "-m", METRICS_PORT, "-L", "warning", NULL };
+    long long before;
+    long long after;
+    double start;
+    double elapsed;
+    pid_t pid;
+    int i;
+
+    if (clients == NULL)
+    {
+        return -1;
+    }
+    snprintf(loops_arg, sizeof(loops_arg), "%d", loops);
+    pid = start_server(argv);
+    if (pid == -1)
+    {
+        fprintf(stderr, "%d loops: server did not start\n", loops);
+        free(clients);
+        return -1;
+    }
+
+    atomic_store(&clients_stop, 0);
+    for (i = 0; i < num_clients; i++)
+    {
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+    }
+    usleep(WARMUP_US);
+    before = read_accepted();
+    start = now_seconds();
+    usleep(duration * 1e6);
+    after = read_accepted();
+    elapsed = now_seconds() - start;
+    atomic_store(&clients_stop, 1);
+    for (i = 0; i < num_clients; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free(clients);
+    if (before < 0 || after < 0)
+    {
+        fprintf(stderr, "%d loops: could not read the metrics\n", loops);
+        return -1;
+    }
+    return (after - before) / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    char *server = "./aesdsocket";
+    int max_loops = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_clients = 0;
+    double duration = 3;
+    double baseline = 0;
+    double rate;
+    int loops;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:c:d:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                server = optarg;
+                break;
+            case 'n':
+                max_loops = atoi(optarg);
+                break;
+            case 'c':
+                num_clients = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b server] [-n max loops] [-c client threads] [-d seconds]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (num_clients <= 0)
+    {
+        /* Opening a connection costs the client about as much as accepting it costs the server */
+        num_clients = 2 * max_loops;
+    }
+    if (max_loops <= 0 || duration <= 0)
+    {
+        fprintf(stderr, "Need at least one event loop and a positive duration\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d client threads, %.1f s per run\n", num_clients, duration);
+    printf("%-6s %14s %8s\n", "loops", "accepted/s", "speedup");
+    for (loops = 1; loops <= max_loops; loops++)
+    {
+        rate = run_loops(server, loops, num_clients, duration);
+        if (rate < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        if (loops == 1)
+        {
+            baseline = rate;
+        }
+        printf("%-6d %14.0f %7.2fx\n", loops, rate, baseline > 0 ? rate / baseline : 0);
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+/**
+ * @file aesd-append-log.c
+ * @brief Append-only data file of aesdsocket with a cached committed length
+ *
+ * A writer reserves its byte range by advancing the reserved length, writes the data at the
+ * reserved offset and then publishes the committed length with release semantics.  Ranges
+ * are committed in reservation order, so the committed length only ever covers data that is
+ * fully written.  Readers load the length with acquire semantics and may then read any byte
+ * below it from the shared descriptor without locking, since committed data never changes.
+ *
+ * A range whose write fails is not committed.  Its bytes are skipped instead: the ranges
+ * reserved after it are written that many bytes lower, and a writer that wrote its data before
+ * an earlier range failed writes it again over the hole when its turn comes, so readers never
+ * see a hole and a failed write does not hold back the writers that follow it.
+ *
+ * With group commit enabled, concurrent appends join a batch.  The first writer of a batch
+ * waits up to the batch latency for others, then writes every packet of the batch with one
+ * pwritev(2) and reports the outcome to each writer, which returns only once its own data is
+ * committed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "aesd-append-log.h"
+#include "aesd-metrics.h"
+
+/**
+ * Opens the data file at @param path for @param log, creating it if needed.
+ * Data already in the file is considered committed.  Group commit starts disabled.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_append_log_open(struct aesd_append_log *log, const char *path)
+{
+    pthread_condattr_t attr;
+    struct stat st;
+
+    /* No O_APPEND, Linux would ignore the offset of every pwrite */
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(log->fd, &st) == -1)
+    {
+        close(log->fd);
+        log->fd = -1;
+        return -1;
+    }
+    atomic_init(&log->reserved, st.st_size);
+    atomic_init(&log->length, st.st_size);
+    atomic_init(&log->skipped, 0);
+    log->committed = st.st_size;
+    pthread_mutex_init(&log->commit_lock, NULL);
+    pthread_cond_init(&log->commit_turn, NULL);
+
+    log->max_batch = 1;
+    log->max_batch_latency_us = 0;
+    log->batch_count = 0;
+    pthread_mutex_init(&log->batch_lock, NULL);
+    /* Batch deadlines must not move with the wall clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->batch_full, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&log->batch_done, NULL);
+    return 0;
+}
+
+/**
+ * Closes the descriptor of @param log.  No reader or writer may access the log anymore.
+ * Data of failed writes past the committed length is cut off, so it is not taken for
+ * committed data when the file is opened again.
+ */
+void aesd_append_log_close(struct aesd_append_log *log)
+{
+    if (log->fd != -1)
+    {
+        if (atomic_load_explicit(&log->skipped, memory_order_relaxed) != 0 &&
+            ftruncate(log->fd, atomic_load_explicit(&log->length, memory_order_relaxed)) == -1)
+        {
+            /* Best effort, the committed data is intact either way */
+        }
+        close(log->fd);
+        log->fd = -1;
+        pthread_cond_destroy(&log->commit_turn);
+        pthread_mutex_destroy(&log->commit_lock);
+        pthread_cond_destroy(&log->batch_done);
+        pthread_cond_destroy(&log->batch_full);
+        pthread_mutex_destroy(&log->batch_lock);
+    }
+}
+
+/**
+ * Enables group commit on @param log: up to @param max_batch concurrent appends are written
+ * together, and the first of them waits at most @param max_batch_latency_us for the others.
+ * A batch size of 1 writes every append on its own.  Must be called before any append.
+ */
+void aesd_append_log_set_batching(struct aesd_append_log *log, size_t max_batch, long max_batch_latency_us)
+{
+    if (max_batch < 1)
+    {
+        max_batch = 1;
+    }
+    if (max_batch > AESD_APPEND_LOG_MAX_BATCH)
+    {
+        max_batch = AESD_APPEND_LOG_MAX_BATCH;
+    }
+    log->max_batch = max_batch;
+    log->max_batch_latency_us = max_batch_latency_us > 0 ? max_batch_latency_us : 0;
+}
+
+/**
+ * Writes @param total bytes described by @param iov at @param position of the file.
+ * @return 0 on success, otherwise the errno value of the failed write
+ */
+static int aesd_append_log_write(struct aesd_append_log *log, const struct iovec *iov, int iovcnt,
+                                 size_t position, size_t total)
+{
+    struct iovec pending[AESD_APPEND_LOG_MAX_BATCH];
+    struct iovec *cur = pending;
+    size_t written = 0;
+    ssize_t rc;
+
+    memcpy(pending, iov, iovcnt * sizeof(*iov));
+    while (written < total)
+    {
+        rc = pwritev(log->fd, cur, iovcnt, position + written);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        written += rc;
+        /* Skip what a short write already covered */
+        while (iovcnt > 0 && (size_t)rc >= cur->iov_len)
+        {
+            rc -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            cur->iov_base = (char *)cur->iov_base + rc;
+            cur->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes @param total bytes described by @param iov for the range reserved at @param offset
+ * and commits it once the ranges reserved before it are.  If the write fails the range is
+ * skipped rather than committed, so the writers that follow are neither held back nor leave
+ * a hole for readers.
+ * @return 0 on success, otherwise the errno value of the failed write
+ */
+static int aesd_append_log_commit(struct aesd_append_log *log, const struct iovec *iov, int iovcnt,
+                                  size_t offset, size_t total)
+{
+    size_t skipped = atomic_load_explicit(&log->skipped, memory_order_acquire);
+    size_t written_skipped;
+    uint64_t wait_start;
+    int status;
+
+    /* Written below the data of every range reserved later, whatever fails meanwhile */
+    status = aesd_append_log_write(log, iov, iovcnt, offset - skipped, total);
+
+    /* Wait for the writers that reserved earlier ranges, they are inside the same few syscalls */
+    aesd_metrics_lock(&log->commit_lock);
+    if (log->committed != offset)
+    {
+        wait_start = aesd_metrics_clock();
+        while (log->committed != offset)
+        {
+            pthread_cond_wait(&log->commit_turn, &log->commit_lock);
+        }
+        aesd_metrics_lock_waited(wait_start);
+    }
+
+    /* An earlier range failed since the data was written, move it down over the hole */
+    written_skipped = skipped;
+    skipped = atomic_load_explicit(&log->skipped, memory_order_relaxed);
+    if (status == 0 && skipped != written_skipped)
+    {
+        status = aesd_append_log_write(log, iov, iovcnt, offset - skipped, total);
+    }
+    if (status == 0)
+    {
+        atomic_store_explicit(&log->length, offset - skipped + total, memory_order_release);
+    }
+    else
+    {
+        atomic_store_explicit(&log->skipped, skipped + total, memory_order_release);
+    }
+    log->committed = offset + total;
+    pthread_cond_broadcast(&log->commit_turn);
+    pthread_mutex_unlock(&log->commit_lock);
+    return status;
+}
+
+/**
+ * Appends the @param iovcnt buffers of @param iov to @param log as one contiguous range with
+ * a single write, without waiting for other writers.  At most AESD_APPEND_LOG_MAX_BATCH buffers.
+ * @return 0 on success, -1 with errno set if the data could not be written
+ */
+int aesd_append_log_appendv(struct aesd_append_log *log, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    size_t offset;
+    int status;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    offset = atomic_fetch_add_explicit(&log->reserved, total, memory_order_relaxed);
+    status = aesd_append_log_commit(log, iov, iovcnt, offset, total);
+    if (status != 0)
+    {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends @param len bytes from @param data to @param log, safe to call from several threads.
+ * With group commit enabled the data may be written together with that of concurrent callers,
+ * the call returns once it is committed.
+ * @return 0 on success, -1 with errno set if the data could not be written
+ */
+int aesd_append_log_append(struct aesd_append_log *log, const char *data, size_t len)
+{
+    struct iovec iov[AESD_APPEND_LOG_MAX_BATCH];
+    int *status_of[AESD_APPEND_LOG_MAX_BATCH];
+    struct timespec deadline;
+    int status = EINPROGRESS;
+    size_t count;
+    size_t total = 0;
+    size_t offset;
+    size_t i;
+
+    if (log->max_batch == 1)
+    {
+        iov[0].iov_base = (char *)data;
+        iov[0].iov_len = len;
+        return aesd_append_log_appendv(log, iov, 1);
+    }
+
+    aesd_metrics_lock(&log->batch_lock);
+    /* The leader of a full batch has yet to close it, join the next one once it does */
+    while (log->batch_count == log->max_batch)
+    {
+        pthread_cond_wait(&log->batch_done, &log->batch_lock);
+    }
+    i = log->batch_count++;
+    log->batch_iov[i].iov_base = (char *)data;
+    log->batch_iov[i].iov_len = len;
+    log->batch_status[i] = &status;
+
+    if (i > 0)
+    {
+        /* Follower, the leader of the batch writes our data and reports back */
+        if (log->batch_count == log->max_batch)
+        {
+            pthread_cond_signal(&log->batch_full);
+        }
+        while (status == EINPROGRESS)
+        {
+            pthread_cond_wait(&log->batch_done, &log->batch_lock);
+        }
+        pthread_mutex_unlock(&log->batch_lock);
+        if (status != 0)
+        {
+            errno = status;
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Leader, give concurrent writers a chance to join */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += log->max_batch_latency_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (log->batch_count < log->max_batch)
+    {
+        if (pthread_cond_timedwait(&log->batch_full, &log->batch_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    /* Close the batch, the next writer leads a new one while we write this one */
+    count = log->batch_count;
+    memcpy(iov, log->batch_iov, count * sizeof(iov[0]));
+    memcpy(status_of, log->batch_status, count * sizeof(status_of[0]));
+    log->batch_count = 0;
+    pthread_cond_broadcast(&log->batch_done);
+    for (i = 0; i < count; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    /* Reserve under the lock so batches commit in the order they were closed */
+    offset = atomic_fetch_add_explicit(&log->reserved, total, memory_order_relaxed);
+    pthread_mutex_unlock(&log->batch_lock);
+
+    status = aesd_append_log_commit(log, iov, count, offset, total);
+
+    aesd_metrics_lock(&log->batch_lock);
+    for (i = 1; i < count; i++)
+    {
+        *status_of[i] = status;
+    }
+    pthread_cond_broadcast(&log->batch_done);
+    pthread_mutex_unlock(&log->batch_lock);
+
+    if (status != 0)
+    {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return the number of bytes readers may access in @param log
+ */
+size_t aesd_append_log_length(struct aesd_append_log *log)
+{
+    return atomic_load_explicit(&log->length, memory_order_acquire);
+}
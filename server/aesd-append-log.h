@@ -0,0 +1,84 @@
+/*
+ * aesd-append-log.h
+ *
+ * @brief Append-only data file of aesdsocket with a cached committed length.
+ *
+ * Readers never reopen or stat the file: they read the committed length and stream the
+ * file contents below it from the shared descriptor, typically with sendfile(2), so the
+ * page cache is the only in-memory copy of the data.  Writers reserve their range with an
+ * atomic add and write it with a single pwritev(2), so readers never take a lock.
+ * Concurrent appends may optionally be grouped into one write (group commit).
+ */
+
+#ifndef AESD_APPEND_LOG_H
+#define AESD_APPEND_LOG_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/**
+ * Upper bound on the number of appends grouped into one write
+ */
+#define AESD_APPEND_LOG_MAX_BATCH 64
+
+struct aesd_append_log
+{
+    /**
+     * Descriptor of the data file, shared by readers and writers through positional I/O
+     */
+    int fd;
+    /**
+     * Number of bytes handed out to writers, the next append is reserved here
+     */
+    _Atomic size_t reserved;
+    /**
+     * Number of bytes committed to the file, readers may access everything below this length
+     */
+    _Atomic size_t length;
+    /**
+     * Bytes of the reserved ranges whose write failed.  They are left out of the file, so a range
+     * reserved at offset is written at offset - skipped.  Only grows, changed by the writer whose
+     * turn it is to commit.
+     */
+    _Atomic size_t skipped;
+    /**
+     * Ordered commit state, protected by commit_lock.  Ranges are committed in reservation order,
+     * committed is the end of the last range whose turn has passed, and writers of later ranges
+     * wait on commit_turn.
+     */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_turn;
+    size_t committed;
+    /**
+     * Group commit settings, appends are written one by one while max_batch is 1
+     */
+    size_t max_batch;
+    long max_batch_latency_us;
+    /**
+     * Group commit state, protected by batch_lock.  The first writer of a batch is its leader,
+     * it waits for followers and writes the whole batch while they wait for their status.
+     * Writers finding the batch full wait on batch_done until its leader closes it.
+     */
+    pthread_mutex_t batch_lock;
+    pthread_cond_t batch_full;
+    pthread_cond_t batch_done;
+    struct iovec batch_iov[AESD_APPEND_LOG_MAX_BATCH];
+    int *batch_status[AESD_APPEND_LOG_MAX_BATCH];
+    size_t batch_count;
+};
+
+extern int aesd_append_log_open(struct aesd_append_log *log, const char *path);
+
+extern void aesd_append_log_close(struct aesd_append_log *log);
+
+extern void aesd_append_log_set_batching(struct aesd_append_log *log, size_t max_batch, long max_batch_latency_us);
+
+extern int aesd_append_log_append(struct aesd_append_log *log, const char *data, size_t len);
+
+extern int aesd_append_log_appendv(struct aesd_append_log *log, const struct iovec *iov, int iovcnt);
+
+extern size_t aesd_append_log_length(struct aesd_append_log *log);
+
+#endif /* AESD_APPEND_LOG_H */
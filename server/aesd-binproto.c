@@ -0,0 +1,30 @@
+/**
+ * @file aesd-binproto.c
+ * @brief Negotiation and payload encoding of the binary protocol of aesdsocket
+ */
+
+#include "aesd-binproto.h"
+
+/**
+ * @return 1 if the text packet of @param packet_length bytes at @param packet asks for the
+ * binary protocol, "AESDSOCKET_BINARY:1" followed by the newline, and 0 otherwise
+ */
+int aesd_bin_parse_negotiate(const char *packet, size_t packet_length)
+{
+    return packet_length == AESD_BINARY_PREFIX_LEN + 2 &&
+           memcmp(packet, AESD_BINARY_PREFIX, AESD_BINARY_PREFIX_LEN) == 0 &&
+           packet[AESD_BINARY_PREFIX_LEN] == '1' && packet[AESD_BINARY_PREFIX_LEN + 1] == '\n';
+}
+
+/**
+ * Encodes @param stats into the AESD_BIN_STATS_SIZE bytes at @param p
+ */
+void aesd_bin_encode_stats(char *p, const struct aesd_bin_stats *stats)
+{
+    aesd_bin_put_u64(p, stats->stored_bytes);
+    aesd_bin_put_u64(p + 8, stats->connections_open);
+    aesd_bin_put_u64(p + 16, stats->connections_accepted);
+    aesd_bin_put_u64(p + 24, stats->packets);
+    aesd_bin_put_u64(p + 32, stats->bytes_received);
+    aesd_bin_put_u64(p + 40, stats->bytes_sent);
+}
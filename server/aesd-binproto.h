@@ -0,0 +1,152 @@
+/*
+ * aesd-binproto.h
+ *
+ * @brief Binary length-prefixed protocol of aesdsocket.
+ *
+ * A client opts in by sending the text packet "AESDSOCKET_BINARY:1\n", which the server
+ * acknowledges with a binary response; everything after it is framed in binary.  Each frame
+ * is a fixed header followed by its payload, so the server takes a frame off the receive
+ * buffer by reading its length rather than searching the bytes, and payloads may hold any
+ * byte including newlines.  Every request gets exactly one response, in order.
+ *
+ * All integers are in network byte order.  Header of requests and responses:
+ *
+ *     offset 0  u8  opcode, echoed in the response
+ *     offset 1  u8  status, 0 in requests
+ *     offset 2  u16 reserved, 0
+ *     offset 4  u32 payload length
+ *
+ * Requests and the payload of their successful responses:
+ *
+ *     APPEND      data to store             -> empty
+ *     SEEK_READ   u32 command, u32 offset   -> stored data from that position, as the ioctl
+ *     READ_RANGE  u64 offset, u64 length    -> at most length stored bytes from offset
+ *     STATS       empty                     -> struct aesd_bin_stats, AESD_BIN_STATS_SIZE bytes
+ *
+ * With the char device the driver still stores what ends with a newline as one entry.
+ */
+
+#ifndef AESD_BINPROTO_H
+#define AESD_BINPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define AESD_BINARY_PREFIX "AESDSOCKET_BINARY:"
+#define AESD_BINARY_PREFIX_LEN (sizeof(AESD_BINARY_PREFIX) - 1)
+
+/**
+ * Protocol version carried by the response to the negotiation, a u32 payload
+ */
+#define AESD_BIN_VERSION 1
+
+#define AESD_BIN_HEADER_SIZE 8
+#define AESD_BIN_SEEK_READ_SIZE 8
+#define AESD_BIN_READ_RANGE_SIZE 16
+
+enum aesd_bin_opcode
+{
+    /**
+     * Only in the response to the negotiation packet
+     */
+    AESD_BIN_OP_NEGOTIATE = 0,
+    AESD_BIN_OP_APPEND = 1,
+    AESD_BIN_OP_SEEK_READ = 2,
+    AESD_BIN_OP_READ_RANGE = 3,
+    AESD_BIN_OP_STATS = 4
+};
+
+enum aesd_bin_status
+{
+    AESD_BIN_OK = 0,
+    /**
+     * Unknown opcode or a payload of the wrong size
+     */
+    AESD_BIN_BAD_REQUEST = 1,
+    /**
+     * Not offered by this build, such as SEEK_READ without the char device
+     */
+    AESD_BIN_UNSUPPORTED = 2,
+    /**
+     * The position asked for is past the stored data
+     */
+    AESD_BIN_OUT_OF_RANGE = 3,
+    AESD_BIN_IO_ERROR = 4
+};
+
+struct aesd_bin_header
+{
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t length;
+};
+
+/**
+ * Payload of a STATS response, each field a u64 in this order
+ */
+struct aesd_bin_stats
+{
+    uint64_t stored_bytes;
+    uint64_t connections_open;
+    uint64_t connections_accepted;
+    uint64_t packets;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+};
+#define AESD_BIN_STATS_SIZE (6 * 8)
+
+static inline uint32_t aesd_bin_get_u32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static inline void aesd_bin_put_u32(char *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint64_t aesd_bin_get_u64(const char *p)
+{
+    return (uint64_t)aesd_bin_get_u32(p) << 32 | aesd_bin_get_u32(p + 4);
+}
+
+static inline void aesd_bin_put_u64(char *p, uint64_t v)
+{
+    aesd_bin_put_u32(p, v >> 32);
+    aesd_bin_put_u32(p + 4, (uint32_t)v);
+}
+
+/**
+ * Decodes the header at @param p, which must hold AESD_BIN_HEADER_SIZE bytes, into @param header
+ */
+static inline void aesd_bin_decode_header(const char *p, struct aesd_bin_header *header)
+{
+    header->opcode = (uint8_t)p[0];
+    header->status = (uint8_t)p[1];
+    header->length = aesd_bin_get_u32(p + 4);
+}
+
+/**
+ * Encodes a header with @param opcode, @param status and @param length into the
+ * AESD_BIN_HEADER_SIZE bytes at @param p
+ */
+static inline void aesd_bin_encode_header(char *p, uint8_t opcode, uint8_t status, uint32_t length)
+{
+    p[0] = (char)opcode;
+    p[1] = (char)status;
+    p[2] = 0;
+    p[3] = 0;
+    aesd_bin_put_u32(p + 4, length);
+}
+
+extern int aesd_bin_parse_negotiate(const char *packet, size_t packet_length);
+
+extern void aesd_bin_encode_stats(char *p, const struct aesd_bin_stats *stats);
+
+#endif /* AESD_BINPROTO_H */
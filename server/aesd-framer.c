@@ -0,0 +1,253 @@
+/**
+ * @file aesd-framer.c
+ * @brief Packet framing primitives of aesdsocket: newline search and command parsing
+ *
+ * aesd_find_newline starts out pointing at a resolver, which checks the CPU once, installs
+ * the best implementation and forwards the first call to it.  Later calls go straight to the
+ * chosen implementation through the pointer.  The vector versions compare a full register
+ * against '\n' and turn the result into a bit mask, so each 16 or 32 byte block costs a load,
+ * a compare and a test; the unaligned tail is handled byte by byte.
+ */
+
+#include <limits.h>
+#include <string.h>
+#ifdef __GNUC__
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#endif
+
+#include "aesd-framer.h"
+
+static const char *aesd_find_newline_resolve(const char *data, size_t len);
+
+aesd_find_newline_fn aesd_find_newline = aesd_find_newline_resolve;
+
+/* Name of the implementation installed by the resolver */
+static const char *impl_name = "memchr";
+
+/**
+ * Portable newline search, the C library's memchr()
+ */
+const char *aesd_find_newline_memchr(const char *data, size_t len)
+{
+    return memchr(data, '\n', len);
+}
+
+#ifdef AESD_FRAMER_X86
+/**
+ * Newline search over 16 byte SSE2 blocks, four per iteration while enough data is left
+ */
+__attribute__((target("sse2")))
+const char *aesd_find_newline_sse2(const char *data, size_t len)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    __m128i b0, b1, b2, b3;
+    unsigned int mask;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), newline);
+        b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 16)), newline);
+        b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 32)), newline);
+        b3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 48)), newline);
+        /* One test for all four blocks, the common case is no newline at all */
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(b0, b1), _mm_or_si128(b2, b3))) != 0)
+        {
+            mask = _mm_movemask_epi8(b0) | _mm_movemask_epi8(b1) << 16;
+            if (mask != 0)
+            {
+                return data + i + __builtin_ctz(mask);
+            }
+            mask = _mm_movemask_epi8(b2) | _mm_movemask_epi8(b3) << 16;
+            return data + i + 32 + __builtin_ctz(mask);
+        }
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), newline));
+        if (mask != 0)
+        {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == '\n')
+        {
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Newline search over 32 byte AVX2 blocks, two per iteration while enough data is left
+ */
+__attribute__((target("avx2")))
+const char *aesd_find_newline_avx2(const char *data, size_t len)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i lo, hi;
+    unsigned int mask;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), newline);
+        hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 32)), newline);
+        /* One test for both halves, the common case is no newline at all */
+        if (!_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi)))
+        {
+            mask = _mm256_movemask_epi8(lo);
+            if (mask != 0)
+            {
+                return data + i + __builtin_ctz(mask);
+            }
+            return data + i + 32 + __builtin_ctz((unsigned int)_mm256_movemask_epi8(hi));
+        }
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), newline));
+        if (mask != 0)
+        {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == '\n')
+        {
+            return data + i;
+        }
+    }
+    return NULL;
+}
+#endif
+
+/* Install the widest implementation this CPU supports, then search with it */
+static const char *aesd_find_newline_resolve(const char *data, size_t len)
+{
+    aesd_find_newline_fn fn = aesd_find_newline_memchr;
+
+#ifdef AESD_FRAMER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        fn = aesd_find_newline_avx2;
+        impl_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        fn = aesd_find_newline_sse2;
+        impl_name = "sse2";
+    }
+#endif
+    /* Every thread resolves to the same function, so the unsynchronized store is harmless */
+    aesd_find_newline = fn;
+    return fn(data, len);
+}
+
+/**
+ * @return the name of the newline search in use, resolving it if needed
+ */
+const char *aesd_framer_impl_name(void)
+{
+    if (aesd_find_newline == aesd_find_newline_resolve)
+    {
+        aesd_find_newline_resolve("", 0);
+    }
+    return impl_name;
+}
+
+/* Parse the decimal number at *pos, before end, advancing *pos past it. Returns 1 on success. */
+static int parse_uint(const char **pos, const char *end, unsigned int *value)
+{
+    const char *p = *pos;
+    unsigned long long v = 0;
+
+    if (p == end || (unsigned char)(*p - '0') > 9)
+    {
+        return 0;
+    }
+    while (p < end && (unsigned char)(*p - '0') <= 9)
+    {
+        v = v * 10 + (*p - '0');
+        if (v > UINT_MAX)
+        {
+            return 0;
+        }
+        p++;
+    }
+    *value = v;
+    *pos = p;
+    return 1;
+}
+
+/**
+ * Parses an "AESDCHAR_IOCSEEKTO:X,Y" command in the @param packet_length bytes at @param packet,
+ * which need not be NUL terminated.
+ * @return 1 and fills @param seekto if the packet is a seek command, 0 otherwise
+ */
+int aesd_parse_seekto(const char *packet, size_t packet_length, struct aesd_seekto *seekto)
+{
+    const char *end = packet + packet_length;
+    const char *pos = packet + AESD_SEEKTO_PREFIX_LEN;
+    unsigned int cmd, offset;
+
+    if (packet_length < AESD_SEEKTO_PREFIX_LEN || memcmp(packet, AESD_SEEKTO_PREFIX, AESD_SEEKTO_PREFIX_LEN) != 0)
+    {
+        return 0;
+    }
+    if (!parse_uint(&pos, end, &cmd) || pos == end || *pos++ != ',' || !parse_uint(&pos, end, &offset))
+    {
+        return 0;
+    }
+    seekto->write_cmd = cmd;
+    seekto->write_cmd_offset = offset;
+    return 1;
+}
+
+/**
+ * Parses a "READ:X,Y" command in the @param packet_length bytes at @param packet, which must be the whole
+ * newline terminated packet, so data that merely starts like the command is still stored.
+ * @return 1 and fills @param first and @param count if the packet is a read command, 0 otherwise
+ */
+int aesd_parse_read(const char *packet, size_t packet_length, unsigned int *first, unsigned int *count)
+{
+    const char *end = packet + packet_length;
+    const char *pos = packet + AESD_READ_PREFIX_LEN;
+
+    if (packet_length < AESD_READ_PREFIX_LEN || memcmp(packet, AESD_READ_PREFIX, AESD_READ_PREFIX_LEN) != 0)
+    {
+        return 0;
+    }
+    if (!parse_uint(&pos, end, first) || pos == end || *pos++ != ',' || !parse_uint(&pos, end, count))
+    {
+        return 0;
+    }
+    return pos == end - 1 && *pos == '\n';
+}
+
+/**
+ * Parses a "TAIL:N" command in the @param packet_length bytes at @param packet, which must be the whole
+ * newline terminated packet.
+ * @return 1 and fills @param count if the packet is a tail command, 0 otherwise
+ */
+int aesd_parse_tail(const char *packet, size_t packet_length, unsigned int *count)
+{
+    const char *end = packet + packet_length;
+    const char *pos = packet + AESD_TAIL_PREFIX_LEN;
+
+    if (packet_length < AESD_TAIL_PREFIX_LEN || memcmp(packet, AESD_TAIL_PREFIX, AESD_TAIL_PREFIX_LEN) != 0)
+    {
+        return 0;
+    }
+    if (!parse_uint(&pos, end, count))
+    {
+        return 0;
+    }
+    return pos == end - 1 && *pos == '\n';
+}
@@ -0,0 +1,56 @@
+/*
+ * aesd-framer.h
+ *
+ * @brief Packet framing primitives of aesdsocket: newline search and command parsing.
+ *
+ * The newline search is picked at run time from the widest vector unit the CPU offers,
+ * falling back to the C library's memchr() on other architectures.  Command parsers work
+ * in place on packets that are not NUL terminated.
+ */
+
+#ifndef AESD_FRAMER_H
+#define AESD_FRAMER_H
+
+#include <stddef.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#define AESD_SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define AESD_SEEKTO_PREFIX_LEN (sizeof(AESD_SEEKTO_PREFIX) - 1)
+
+/* "READ:X,Y" asks for Y records starting with record X, "TAIL:N" for the last N records */
+#define AESD_READ_PREFIX "READ:"
+#define AESD_READ_PREFIX_LEN (sizeof(AESD_READ_PREFIX) - 1)
+#define AESD_TAIL_PREFIX "TAIL:"
+#define AESD_TAIL_PREFIX_LEN (sizeof(AESD_TAIL_PREFIX) - 1)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AESD_FRAMER_X86 1
+#endif
+
+/**
+ * Returns the first newline in the @param len bytes at @param data, or NULL if there is none
+ */
+typedef const char *(*aesd_find_newline_fn)(const char *data, size_t len);
+
+/**
+ * Newline search of this CPU, resolved on first use
+ */
+extern aesd_find_newline_fn aesd_find_newline;
+
+extern const char *aesd_find_newline_memchr(const char *data, size_t len);
+
+#ifdef AESD_FRAMER_X86
+extern const char *aesd_find_newline_sse2(const char *data, size_t len);
+
+extern const char *aesd_find_newline_avx2(const char *data, size_t len);
+#endif
+
+extern const char *aesd_framer_impl_name(void);
+
+extern int aesd_parse_seekto(const char *packet, size_t packet_length, struct aesd_seekto *seekto);
+
+extern int aesd_parse_read(const char *packet, size_t packet_length, unsigned int *first, unsigned int *count);
+
+extern int aesd_parse_tail(const char *packet, size_t packet_length, unsigned int *count);
+
+#endif /* AESD_FRAMER_H */
@@ -0,0 +1,417 @@
+/**
+ * @file aesd-log.c
+ * @brief Asynchronous, rate-limited logging of aesdsocket
+ *
+ * The ring is a bounded queue with a sequence number per slot: a producer claims the slot at
+ * the enqueue position with compare-and-swap once its sequence says the consumer released it,
+ * fills it and publishes it by advancing the sequence.  A full ring drops the message instead
+ * of waiting, so logging never blocks a serving thread.
+ *
+ * The drain thread sleeps on an eventfd.  Before sleeping it raises a flag and checks the ring
+ * once more; a producer that sees the flag takes it down and writes the eventfd, so a burst of
+ * messages costs one wakeup and the drain thread writes the whole burst in one pass.  Drops are
+ * reported at most once per DRAIN_INTERVAL_MS: with a report pending the drain thread sleeps
+ * until it is due, and without one it sleeps until woken, so an idle server never wakes it.
+ *
+ * Rate limits use a fixed one second window per message type, kept in a single word holding
+ * the window's second and the messages counted in it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+
+/* Least time between two reports of dropped messages */
+#define DRAIN_INTERVAL_MS 1000
+
+#define DRAIN_SLEEPING 1
+#define DRAIN_WAITING 2
+
+struct log_entry
+{
+    _Atomic size_t seq;
+    int type;
+    int priority;
+    char msg[AESD_LOG_MSG_SIZE];
+};
+
+/* Per message type settings and counts */
+struct log_limit
+{
+    const char *name;
+    /* Messages per second */
+    uint32_t rate;
+    /* Second of the current window in the high half, messages counted in it in the low half */
+    _Atomic uint64_t window;
+    _Atomic uint64_t suppressed;
+};
+
+/**
+ * Least severe priority that is logged
+ */
+int aesd_log_level = LOG_INFO;
+
+static struct log_entry ring[AESD_LOG_RING_SIZE];
+static _Atomic size_t enqueue_pos;
+/* Only touched by the drain thread */
+static size_t dequeue_pos;
+static _Atomic uint64_t ring_full_drops;
+
+static struct log_limit limits[AESD_LOG_TYPE_COUNT] =
+{
+    [AESD_LOG_ACCEPT] = { "accept", 100, 0, 0 },
+    [AESD_LOG_CLOSE] = { "close", 100, 0, 0 },
+    [AESD_LOG_IO_ERROR] = { "I/O error", 20, 0, 0 },
+    [AESD_LOG_ALLOC_ERROR] = { "allocation failure", 20, 0, 0 },
+    [AESD_LOG_SERVER] = { "server", 20, 0, 0 },
+};
+
+static atomic_int running;
+static atomic_int stopping;
+/* DRAIN_SLEEPING while the drain thread waits for messages, DRAIN_WAITING while it waits for a report */
+static atomic_int drain_sleeping;
+static int wake_fd = -1;
+static pthread_t drain_thread;
+
+/**
+ * @return the syslog priority named by @param name, a name like "warning" or a number from
+ * 0 to 7, or -1 if there is no such priority
+ */
+int aesd_log_parse_level(const char *name)
+{
+    static const char *const names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+    char *end;
+    long level;
+    size_t i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcasecmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    level = strtol(name, &end, 10);
+    if (*end != '\0' || end == name || level < LOG_EMERG || level > LOG_DEBUG)
+    {
+        return -1;
+    }
+    return level;
+}
+
+/* Count a message against the budget of its type, returns 1 if it may be logged */
+static int log_allowed(struct log_limit *limit)
+{
+    struct timespec ts;
+    uint64_t second;
+    uint64_t window;
+    uint64_t next;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    second = ts.tv_sec;
+    window = atomic_load_explicit(&limit->window, memory_order_relaxed);
+    do
+    {
+        if (window >> 32 != second)
+        {
+            next = second << 32 | 1;
+        }
+        else if ((window & 0xffffffff) >= limit->rate)
+        {
+            atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+            return 0;
+        }
+        else
+        {
+            next = window + 1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&limit->window, &window, next, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return 1;
+}
+
+/* Wake the drain thread up if it sleeps, or only if it sleeps without a timeout when @param dropped */
+static void drain_wake(int dropped)
+{
+    int expected = DRAIN_SLEEPING;
+
+    /* Pairs with the fence of the drain thread, one of both sees the other's store */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (dropped)
+    {
+        if (atomic_load_explicit(&drain_sleeping, memory_order_relaxed) != DRAIN_SLEEPING ||
+            !atomic_compare_exchange_strong_explicit(&drain_sleeping, &expected, 0, memory_order_relaxed,
+                                                     memory_order_relaxed))
+        {
+            return;
+        }
+    }
+    else if (!atomic_load_explicit(&drain_sleeping, memory_order_relaxed) ||
+             !atomic_exchange_explicit(&drain_sleeping, 0, memory_order_relaxed))
+    {
+        return;
+    }
+    eventfd_write(wake_fd, 1);
+}
+
+/* Claim the next free slot of the ring, returns NULL if the ring is full */
+static struct log_entry *ring_claim(size_t *pos_out)
+{
+    struct log_entry *entry;
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    intptr_t diff;
+
+    for (;;)
+    {
+        entry = &ring[pos & (AESD_LOG_RING_SIZE - 1)];
+        diff = (intptr_t)atomic_load_explicit(&entry->seq, memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                *pos_out = pos;
+                return entry;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* The consumer has not released this slot yet, a full lap behind */
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Logs a message of @param type at syslog @param priority, formatted from @param format.
+ * Never blocks once the drain thread runs; the message may be dropped by the rate limit of
+ * its type or because the ring is full.
+ */
+void aesd_log(enum aesd_log_type type, int priority, const char *format, ...)
+{
+    struct log_entry *entry;
+    va_list ap;
+    size_t pos;
+
+    if (priority > aesd_log_level)
+    {
+        return;
+    }
+    if (!atomic_load_explicit(&running, memory_order_acquire))
+    {
+        va_start(ap, format);
+        vsyslog(priority, format, ap);
+        va_end(ap);
+        return;
+    }
+    if (!log_allowed(&limits[type]))
+    {
+        aesd_metrics_add(AESD_METRIC_LOG_DROPPED, 1);
+        drain_wake(1);
+        return;
+    }
+    entry = ring_claim(&pos);
+    if (entry == NULL)
+    {
+        atomic_fetch_add_explicit(&ring_full_drops, 1, memory_order_relaxed);
+        aesd_metrics_add(AESD_METRIC_LOG_DROPPED, 1);
+        drain_wake(1);
+        return;
+    }
+
+    entry->type = type;
+    entry->priority = priority;
+    va_start(ap, format);
+    vsnprintf(entry->msg, sizeof(entry->msg), format, ap);
+    va_end(ap);
+    atomic_store_explicit(&entry->seq, pos + 1, memory_order_release);
+    drain_wake(0);
+}
+
+/* Write every published entry to syslog, returns the number written */
+static size_t ring_drain(void)
+{
+    struct log_entry *entry;
+    size_t drained = 0;
+
+    for (;;)
+    {
+        entry = &ring[dequeue_pos & (AESD_LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&entry->seq, memory_order_acquire) != dequeue_pos + 1)
+        {
+            return drained;
+        }
+        syslog(entry->priority, "%s", entry->msg);
+        /* Hand the slot back to producers for the next lap */
+        atomic_store_explicit(&entry->seq, dequeue_pos + AESD_LOG_RING_SIZE, memory_order_release);
+        dequeue_pos++;
+        drained++;
+    }
+}
+
+/* Returns 1 if messages were dropped since the last report */
+static int drops_pending(void)
+{
+    int i;
+
+    for (i = 0; i < AESD_LOG_TYPE_COUNT; i++)
+    {
+        if (atomic_load_explicit(&limits[i].suppressed, memory_order_relaxed) > 0)
+        {
+            return 1;
+        }
+    }
+    return atomic_load_explicit(&ring_full_drops, memory_order_relaxed) > 0;
+}
+
+/* Report the messages dropped since the last report */
+static void report_drops(void)
+{
+    uint64_t count;
+    int i;
+
+    for (i = 0; i < AESD_LOG_TYPE_COUNT; i++)
+    {
+        count = atomic_exchange_explicit(&limits[i].suppressed, 0, memory_order_relaxed);
+        if (count > 0)
+        {
+            syslog(LOG_WARNING, "Suppressed %llu %s messages over %u per second", (unsigned long long)count,
+                   limits[i].name, limits[i].rate);
+        }
+    }
+    count = atomic_exchange_explicit(&ring_full_drops, 0, memory_order_relaxed);
+    if (count > 0)
+    {
+        syslog(LOG_WARNING, "Dropped %llu log messages, the log ring was full", (unsigned long long)count);
+    }
+}
+
+/* Milliseconds of the monotonic clock */
+static int64_t drain_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Drain thread, writes queued messages to syslog until stopped and the ring is empty */
+static void *drain_thread_fn(void *arg)
+{
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+    int64_t next_report = 0;
+    int64_t now;
+    eventfd_t count;
+    int timeout;
+
+    (void)arg;
+    for (;;)
+    {
+        ring_drain();
+        now = drain_clock_ms();
+        if (now >= next_report && drops_pending())
+        {
+            report_drops();
+            next_report = now + DRAIN_INTERVAL_MS;
+        }
+        if (atomic_load_explicit(&stopping, memory_order_acquire))
+        {
+            /* Producers may have published between the drain and the check */
+            ring_drain();
+            report_drops();
+            break;
+        }
+
+        /* Drops seen after the fence wake the thread only if it would not wake up for them anyway */
+        atomic_store_explicit(&drain_sleeping, DRAIN_SLEEPING, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        timeout = -1;
+        if (drops_pending())
+        {
+            atomic_store_explicit(&drain_sleeping, DRAIN_WAITING, memory_order_relaxed);
+            timeout = next_report > now ? next_report - now : 0;
+        }
+        if (ring_drain() > 0)
+        {
+            atomic_store_explicit(&drain_sleeping, 0, memory_order_relaxed);
+            continue;
+        }
+        if (poll(&pfd, 1, timeout) > 0)
+        {
+            eventfd_read(wake_fd, &count);
+        }
+        atomic_store_explicit(&drain_sleeping, 0, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the drain thread, messages are queued from then on.  The caller should block the
+ * signals meant for the serving threads first, the drain thread inherits its signal mask.
+ * @return 0 on success, -1 with errno set if messages keep going to syslog directly
+ */
+int aesd_log_start(void)
+{
+    size_t i;
+    int err;
+
+    for (i = 0; i < AESD_LOG_RING_SIZE; i++)
+    {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_init(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    atomic_store(&stopping, 0);
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1)
+    {
+        return -1;
+    }
+    err = pthread_create(&drain_thread, NULL, drain_thread_fn, NULL);
+    if (err != 0)
+    {
+        close(wake_fd);
+        wake_fd = -1;
+        errno = err;
+        return -1;
+    }
+    atomic_store_explicit(&running, 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Writes out every queued message and stops the drain thread.  The serving threads must have
+ * stopped logging; later messages go to syslog directly.
+ */
+void aesd_log_stop(void)
+{
+    if (!atomic_load(&running))
+    {
+        return;
+    }
+    atomic_store_explicit(&running, 0, memory_order_release);
+    atomic_store_explicit(&stopping, 1, memory_order_release);
+    eventfd_write(wake_fd, 1);
+    pthread_join(drain_thread, NULL);
+    close(wake_fd);
+    wake_fd = -1;
+}
@@ -0,0 +1,64 @@
+/*
+ * aesd-log.h
+ *
+ * @brief Asynchronous, rate-limited logging of aesdsocket.
+ *
+ * Serving threads format their message into a slot of a lock-free ring and return; a
+ * background thread drains the ring to syslog.  Each message type has a budget of messages
+ * per second, messages beyond it and messages that find the ring full are dropped and
+ * counted, and the drain thread reports the counts instead.  Until the drain thread runs,
+ * and after it stops, messages go to syslog directly.
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <syslog.h>
+
+/**
+ * Slots of the ring, a power of two
+ */
+#define AESD_LOG_RING_SIZE 1024
+
+/**
+ * Longest message kept, longer ones are truncated
+ */
+#define AESD_LOG_MSG_SIZE 240
+
+enum aesd_log_type
+{
+    AESD_LOG_ACCEPT,
+    AESD_LOG_CLOSE,
+    /**
+     * Failed reads, writes, sends and ioctls on behalf of a client
+     */
+    AESD_LOG_IO_ERROR,
+    AESD_LOG_ALLOC_ERROR,
+    /**
+     * Everything else, failures of the server itself
+     */
+    AESD_LOG_SERVER,
+    AESD_LOG_TYPE_COUNT
+};
+
+extern int aesd_log_level;
+
+extern int aesd_log_parse_level(const char *name);
+
+/**
+ * @return nonzero if messages at @param priority are logged, so callers can skip preparing
+ * arguments that only go into messages
+ */
+static inline int aesd_log_enabled(int priority)
+{
+    return priority <= aesd_log_level;
+}
+
+extern int aesd_log_start(void);
+
+extern void aesd_log_stop(void);
+
+extern void aesd_log(enum aesd_log_type type, int priority, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* AESD_LOG_H */
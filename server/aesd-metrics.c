@@ -0,0 +1,458 @@
+/**
+ * @file aesd-metrics.c
+ * @brief Runtime counters and stage latency histograms of aesdsocket
+ *
+ * A thread registers its shard by pushing it on a singly linked list with compare-and-swap.
+ * Shards are never removed, so the counts of threads that have exited stay in the totals
+ * and a reader can walk the list without synchronizing with writers beyond the acquire load
+ * of its head.  Readers sum the shards with relaxed loads; a scrape that races with updates
+ * may be off by the packets in flight, never by more.
+ *
+ * The admin endpoint is a thread of its own that answers every connection with one HTTP
+ * response holding the current metrics, so Prometheus, curl or a plain nc can read them.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesd-metrics.h"
+
+int aesd_metrics_timing;
+
+__thread struct aesd_metrics_shard *aesd_metrics_local;
+
+/* Head of the list of registered shards */
+static struct aesd_metrics_shard *_Atomic shards;
+
+/* Used by threads whose shard could not be allocated, its counts are shared and not reported */
+static struct aesd_metrics_shard overflow_shard;
+
+static const char *const stage_names[AESD_STAGE_COUNT] = { "frame", "append", "reply" };
+
+/* Admin endpoint */
+static int admin_fd = -1;
+static int admin_stop_fd = -1;
+static pthread_t admin_thread;
+static char admin_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/**
+ * Allocates and registers the shard of the calling thread.
+ * @return the shard, which the thread keeps for its lifetime
+ */
+struct aesd_metrics_shard *aesd_metrics_register(void)
+{
+    struct aesd_metrics_shard *shard = aligned_alloc(AESD_METRICS_CACHE_LINE, sizeof(*shard));
+    struct aesd_metrics_shard *head;
+
+    if (shard == NULL)
+    {
+        aesd_metrics_local = &overflow_shard;
+        return aesd_metrics_local;
+    }
+    memset(shard, 0, sizeof(*shard));
+    head = atomic_load_explicit(&shards, memory_order_relaxed);
+    do
+    {
+        shard->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&shards, &head, shard, memory_order_release, memory_order_relaxed));
+    aesd_metrics_local = shard;
+    return shard;
+}
+
+/**
+ * Records that a packet spent from @param start_ns to @param end_ns in @param stage.
+ * Nothing is recorded if the start is unknown, which is the case while timing is disabled.
+ */
+void aesd_metrics_stage(enum aesd_stage stage, uint64_t start_ns, uint64_t end_ns)
+{
+    struct aesd_metrics_shard *shard;
+    uint64_t us;
+    int bucket;
+
+    if (start_ns == 0 || end_ns < start_ns)
+    {
+        return;
+    }
+    us = (end_ns - start_ns) / 1000;
+    /* The bucket whose upper bound 2^bucket us is the first to hold the value */
+    bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > AESD_METRICS_BUCKETS - 1)
+    {
+        bucket = AESD_METRICS_BUCKETS - 1;
+    }
+    shard = aesd_metrics_shard();
+    atomic_store_explicit(&shard->stage_buckets[stage][bucket],
+                          atomic_load_explicit(&shard->stage_buckets[stage][bucket], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&shard->stage_sum_ns[stage],
+                          atomic_load_explicit(&shard->stage_sum_ns[stage], memory_order_relaxed) + end_ns - start_ns,
+                          memory_order_relaxed);
+}
+
+/**
+ * @return the monotonic time in nanoseconds, whether or not stage timing is enabled
+ */
+uint64_t aesd_metrics_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Accounts a wait for another thread that started at @param start_ns and ends now
+ */
+void aesd_metrics_lock_waited(uint64_t start_ns)
+{
+    aesd_metrics_add(AESD_METRIC_LOCK_WAIT_NS, aesd_metrics_clock() - start_ns);
+    aesd_metrics_add(AESD_METRIC_LOCK_CONTENDED, 1);
+}
+
+/**
+ * Locks @param mutex, timing the wait only if another thread holds it
+ */
+void aesd_metrics_lock(pthread_mutex_t *mutex)
+{
+    uint64_t start_ns;
+
+    if (pthread_mutex_trylock(mutex) == 0)
+    {
+        return;
+    }
+    start_ns = aesd_metrics_clock();
+    pthread_mutex_lock(mutex);
+    aesd_metrics_lock_waited(start_ns);
+}
+
+/**
+ * @return the counter @param metric summed over every registered shard
+ */
+uint64_t aesd_metrics_total(enum aesd_metric metric)
+{
+    struct aesd_metrics_shard *shard;
+    uint64_t total = 0;
+
+    for (shard = atomic_load_explicit(&shards, memory_order_acquire); shard != NULL; shard = shard->next)
+    {
+        total += atomic_load_explicit(&shard->counters[metric], memory_order_relaxed);
+    }
+    return total;
+}
+
+/**
+ * Writes a one line summary of the counters to @param buf of @param size bytes, for logs
+ */
+void aesd_metrics_summary(char *buf, size_t size)
+{
+    uint64_t accepted = aesd_metrics_total(AESD_METRIC_CONNECTIONS_ACCEPTED);
+    uint64_t closed = aesd_metrics_total(AESD_METRIC_CONNECTIONS_CLOSED);
+
+    snprintf(buf, size, "connections %llu open %llu rejected %llu timed out %llu, packets %llu, "
+             "bytes received %llu sent %llu resent %llu, lock waits %llu, log messages dropped %llu",
+             (unsigned long long)accepted, (unsigned long long)(accepted - closed),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_CONNECTIONS_REJECTED),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_CONNECTIONS_TIMED_OUT),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_PACKETS),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_BYTES_RECEIVED),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_BYTES_SENT),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_BYTES_RESENT),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_LOCK_CONTENDED),
+             (unsigned long long)aesd_metrics_total(AESD_METRIC_LOG_DROPPED));
+}
+
+static void format_counter(FILE *out, const char *name, const char *type, const char *help, uint64_t value)
+{
+    fprintf(out, "# HELP aesdsocket_%s %s\n# TYPE aesdsocket_%s %s\naesdsocket_%s %llu\n",
+            name, help, name, type, name, (unsigned long long)value);
+}
+
+/**
+ * Renders the current metrics in the Prometheus text exposition format.
+ * @param len receives the length of the text.
+ * @return the text, to be released with free(), or NULL if memory is exhausted
+ */
+char *aesd_metrics_format(size_t *len)
+{
+    struct aesd_metrics_shard *shard;
+    uint64_t buckets[AESD_METRICS_BUCKETS];
+    uint64_t accepted = aesd_metrics_total(AESD_METRIC_CONNECTIONS_ACCEPTED);
+    uint64_t closed = aesd_metrics_total(AESD_METRIC_CONNECTIONS_CLOSED);
+    uint64_t sum_ns;
+    uint64_t cumulative;
+    char *text = NULL;
+    FILE *out;
+    int stage;
+    int i;
+
+    out = open_memstream(&text, len);
+    if (out == NULL)
+    {
+        return NULL;
+    }
+
+    format_counter(out, "connections_accepted_total", "counter", "Client connections accepted.", accepted);
+    format_counter(out, "connections_open", "gauge", "Client connections currently open.",
+                   accepted > closed ? accepted - closed : 0);
+    format_counter(out, "connections_rejected_total", "counter", "Client connections turned away at the connection limit.",
+                   aesd_metrics_total(AESD_METRIC_CONNECTIONS_REJECTED));
+    format_counter(out, "connections_timed_out_total", "counter", "Client connections closed by the idle or read timeout.",
+                   aesd_metrics_total(AESD_METRIC_CONNECTIONS_TIMED_OUT));
+    format_counter(out, "packets_oversized_total", "counter", "Client connections closed for a packet over the size limit.",
+                   aesd_metrics_total(AESD_METRIC_PACKETS_OVERSIZED));
+    format_counter(out, "packets_total", "counter", "Newline terminated packets received.",
+                   aesd_metrics_total(AESD_METRIC_PACKETS));
+    format_counter(out, "received_bytes_total", "counter", "Bytes received from clients.",
+                   aesd_metrics_total(AESD_METRIC_BYTES_RECEIVED));
+    format_counter(out, "sent_bytes_total", "counter", "Reply bytes sent to clients.",
+                   aesd_metrics_total(AESD_METRIC_BYTES_SENT));
+    format_counter(out, "resent_bytes_total", "counter", "Reply bytes the client already received with an earlier reply.",
+                   aesd_metrics_total(AESD_METRIC_BYTES_RESENT));
+    format_counter(out, "lock_contended_total", "counter", "Waits for a lock or a writer held by another thread.",
+                   aesd_metrics_total(AESD_METRIC_LOCK_CONTENDED));
+    format_counter(out, "log_dropped_total", "counter", "Log messages dropped by a rate limit or a full log ring.",
+                   aesd_metrics_total(AESD_METRIC_LOG_DROPPED));
+    fprintf(out, "# HELP aesdsocket_lock_wait_seconds_total Time spent waiting for other threads.\n"
+                 "# TYPE aesdsocket_lock_wait_seconds_total counter\n"
+                 "aesdsocket_lock_wait_seconds_total %.9f\n", aesd_metrics_total(AESD_METRIC_LOCK_WAIT_NS) / 1e9);
+
+    fprintf(out, "# HELP aesdsocket_stage_seconds Time packets spend in each stage, recorded while metrics are served.\n"
+                 "# TYPE aesdsocket_stage_seconds histogram\n");
+    for (stage = 0; stage < AESD_STAGE_COUNT; stage++)
+    {
+        memset(buckets, 0, sizeof(buckets));
+        sum_ns = 0;
+        for (shard = atomic_load_explicit(&shards, memory_order_acquire); shard != NULL; shard = shard->next)
+        {
+            for (i = 0; i < AESD_METRICS_BUCKETS; i++)
+            {
+                buckets[i] += atomic_load_explicit(&shard->stage_buckets[stage][i], memory_order_relaxed);
+            }
+            sum_ns += atomic_load_explicit(&shard->stage_sum_ns[stage], memory_order_relaxed);
+        }
+        cumulative = 0;
+        for (i = 0; i < AESD_METRICS_BUCKETS - 1; i++)
+        {
+            cumulative += buckets[i];
+            fprintf(out, "aesdsocket_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stage_names[stage], (double)(1ull << i) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += buckets[AESD_METRICS_BUCKETS - 1];
+        fprintf(out, "aesdsocket_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                     "aesdsocket_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                     "aesdsocket_stage_seconds_count{stage=\"%s\"} %llu\n",
+                stage_names[stage], (unsigned long long)cumulative, stage_names[stage], sum_ns / 1e9,
+                stage_names[stage], (unsigned long long)cumulative);
+    }
+
+    if (fclose(out) != 0)
+    {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/* Answer one admin connection with the metrics and close it */
+static void admin_respond(int fd)
+{
+    struct timeval timeout = { 1, 0 };
+    char request[1024];
+    char header[128];
+    size_t len;
+    char *text;
+    int header_len;
+
+    /* Whatever the request, the answer is the same; a client that says nothing still gets it */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (recv(fd, request, sizeof(request), 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        return;
+    }
+    text = aesd_metrics_format(&len);
+    if (text == NULL)
+    {
+        syslog(LOG_ERR, "metrics: malloc failed");
+        return;
+    }
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+    if (send(fd, header, header_len, MSG_NOSIGNAL | MSG_MORE) == header_len)
+    {
+        send(fd, text, len, MSG_NOSIGNAL);
+    }
+    free(text);
+}
+
+/* Admin thread, serves scrapes one at a time until stopped */
+static void *admin_thread_fn(void *arg)
+{
+    struct pollfd fds[2];
+    int client_fd;
+
+    (void)arg;
+    fds[0].fd = admin_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = admin_stop_fd;
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "metrics: poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0)
+        {
+            break;
+        }
+        client_fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            continue;
+        }
+        admin_respond(client_fd);
+        close(client_fd);
+    }
+    return NULL;
+}
+
+/* Bind the admin socket to a port on the loopback interface or to a Unix socket path */
+static int admin_bind(const char *address)
+{
+    struct sockaddr_in in_addr;
+    struct sockaddr_un un_addr;
+    char *end;
+    long port;
+    int opt = 1;
+    int fd;
+
+    if (strchr(address, '/') != NULL)
+    {
+        if (strlen(address) >= sizeof(un_addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&un_addr, 0, sizeof(un_addr));
+        un_addr.sun_family = AF_UNIX;
+        strcpy(un_addr.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        /* A socket left by an earlier run would make bind fail */
+        unlink(address);
+        if (bind(fd, (struct sockaddr *)&un_addr, sizeof(un_addr)) == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        strcpy(admin_path, address);
+        return fd;
+    }
+
+    port = strtol(address, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&in_addr, 0, sizeof(in_addr));
+    in_addr.sin_family = AF_INET;
+    in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in_addr.sin_port = htons(port);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr *)&in_addr, sizeof(in_addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Serves the metrics on @param address, a TCP port on 127.0.0.1 or, if it contains a slash,
+ * the path of a Unix socket, and enables stage timing.  The caller should block the signals
+ * meant for the serving threads first, the admin thread inherits its signal mask.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_metrics_server_start(const char *address)
+{
+    int err;
+
+    admin_fd = admin_bind(address);
+    if (admin_fd == -1)
+    {
+        return -1;
+    }
+    /* The stop eventfd is made last: once it is set, aesd_metrics_server_stop expects a thread to join */
+    if (listen(admin_fd, 16) == -1 || (admin_stop_fd = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        err = errno;
+        aesd_metrics_server_stop();
+        errno = err;
+        return -1;
+    }
+    err = pthread_create(&admin_thread, NULL, admin_thread_fn, NULL);
+    if (err != 0)
+    {
+        close(admin_stop_fd);
+        admin_stop_fd = -1;
+        aesd_metrics_server_stop();
+        errno = err;
+        return -1;
+    }
+    aesd_metrics_timing = 1;
+    return 0;
+}
+
+/**
+ * Stops the admin endpoint, if it runs, and removes its Unix socket
+ */
+void aesd_metrics_server_stop(void)
+{
+    uint64_t one = 1;
+
+    if (admin_stop_fd != -1)
+    {
+        if (write(admin_stop_fd, &one, sizeof(one)) == sizeof(one))
+        {
+            pthread_join(admin_thread, NULL);
+        }
+        close(admin_stop_fd);
+        admin_stop_fd = -1;
+    }
+    if (admin_fd != -1)
+    {
+        close(admin_fd);
+        admin_fd = -1;
+    }
+    if (admin_path[0] != '\0')
+    {
+        unlink(admin_path);
+        admin_path[0] = '\0';
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * aesd-metrics.h
+ *
+ * @brief Runtime counters and stage latency histograms of aesdsocket.
+ *
+ * Every thread that updates a metric owns a shard of them, aligned to its own cache lines,
+ * so the hot path only ever writes memory no other thread writes.  Shards are registered
+ * once per thread on a lock-free list and summed up by whoever reads the metrics, which is
+ * the admin endpoint serving them in the Prometheus text format.
+ */
+
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define AESD_METRICS_CACHE_LINE 64
+
+/**
+ * Histogram buckets, powers of two from 1us to 2^(AESD_METRICS_BUCKETS - 2)us and one for the rest
+ */
+#define AESD_METRICS_BUCKETS 22
+
+enum aesd_metric
+{
+    AESD_METRIC_CONNECTIONS_ACCEPTED,
+    AESD_METRIC_CONNECTIONS_CLOSED,
+    /**
+     * Clients turned away because the connection limit was reached
+     */
+    AESD_METRIC_CONNECTIONS_REJECTED,
+    /**
+     * Clients closed by the idle or read timeout
+     */
+    AESD_METRIC_CONNECTIONS_TIMED_OUT,
+    /**
+     * Clients closed for sending a packet over the size limit
+     */
+    AESD_METRIC_PACKETS_OVERSIZED,
+    AESD_METRIC_PACKETS,
+    AESD_METRIC_BYTES_RECEIVED,
+    AESD_METRIC_BYTES_SENT,
+    /**
+     * Reply bytes the client already received with an earlier reply
+     */
+    AESD_METRIC_BYTES_RESENT,
+    AESD_METRIC_LOCK_WAIT_NS,
+    AESD_METRIC_LOCK_CONTENDED,
+    /**
+     * Log messages dropped by a rate limit or because the log ring was full
+     */
+    AESD_METRIC_LOG_DROPPED,
+    AESD_METRIC_COUNT
+};
+
+/**
+ * Stages of a packet: the last receive to framing, framing to the data being written,
+ * and written to the reply being sent
+ */
+enum aesd_stage
+{
+    AESD_STAGE_FRAME,
+    AESD_STAGE_APPEND,
+    AESD_STAGE_REPLY,
+    AESD_STAGE_COUNT
+};
+
+struct aesd_metrics_shard
+{
+    /**
+     * Only the owning thread writes, readers may see a slightly stale value
+     */
+    _Atomic uint64_t counters[AESD_METRIC_COUNT];
+    _Atomic uint64_t stage_buckets[AESD_STAGE_COUNT][AESD_METRICS_BUCKETS];
+    _Atomic uint64_t stage_sum_ns[AESD_STAGE_COUNT];
+    struct aesd_metrics_shard *next;
+} __attribute__((aligned(AESD_METRICS_CACHE_LINE)));
+
+/**
+ * Nonzero once stage latencies are measured, which costs a clock read per stage
+ */
+extern int aesd_metrics_timing;
+
+extern __thread struct aesd_metrics_shard *aesd_metrics_local;
+
+extern struct aesd_metrics_shard *aesd_metrics_register(void);
+
+/**
+ * @return the shard of the calling thread, registering it on first use
+ */
+static inline struct aesd_metrics_shard *aesd_metrics_shard(void)
+{
+    struct aesd_metrics_shard *shard = aesd_metrics_local;
+
+    return shard != NULL ? shard : aesd_metrics_register();
+}
+
+/**
+ * Adds @param value to the counter @param metric of the calling thread
+ */
+static inline void aesd_metrics_add(enum aesd_metric metric, uint64_t value)
+{
+    _Atomic uint64_t *counter = &aesd_metrics_shard()->counters[metric];
+
+    /* Single writer, a plain load and store is enough and avoids a locked instruction */
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/**
+ * @return the monotonic time in nanoseconds if stage timing is enabled, 0 otherwise
+ */
+static inline uint64_t aesd_metrics_now(void)
+{
+    struct timespec ts;
+
+    if (!aesd_metrics_timing)
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+extern void aesd_metrics_stage(enum aesd_stage stage, uint64_t start_ns, uint64_t end_ns);
+
+extern void aesd_metrics_lock(pthread_mutex_t *mutex);
+
+extern uint64_t aesd_metrics_clock(void);
+
+extern void aesd_metrics_lock_waited(uint64_t start_ns);
+
+extern uint64_t aesd_metrics_total(enum aesd_metric metric);
+
+extern char *aesd_metrics_format(size_t *len);
+
+extern void aesd_metrics_summary(char *buf, size_t size);
+
+extern int aesd_metrics_server_start(const char *address);
+
+extern void aesd_metrics_server_stop(void);
+
+#endif /* AESD_METRICS_H */
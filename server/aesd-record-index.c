@@ -0,0 +1,164 @@
+/**
+ * @file aesd-record-index.c
+ * @brief Index over the record boundaries of the aesdsocket data file
+ *
+ * Committed data never changes, so the index only ever grows at its end: a lookup reads the
+ * bytes between the scanned length and the committed length in chunks, records the end of
+ * every newline it finds and moves the scanned length forward.  A record still being written
+ * is never seen, since only committed bytes are searched and packets are committed whole.
+ * The array of record ends doubles when full, so extending it is amortized O(1) per record.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "aesd-framer.h"
+#include "aesd-record-index.h"
+
+/* Bytes of the data file read per search step */
+#define SCAN_CHUNK_SIZE 16384
+
+/* Initial number of record ends the index has room for */
+#define INITIAL_CAPACITY 256
+
+/**
+ * Initializes @param index as empty, its first lookup indexes the whole data file
+ */
+void aesd_record_index_init(struct aesd_record_index *index)
+{
+    pthread_mutex_init(&index->lock, NULL);
+    index->ends = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->scanned = 0;
+}
+
+/**
+ * Releases the memory of @param index, which may not be used anymore
+ */
+void aesd_record_index_free(struct aesd_record_index *index)
+{
+    free(index->ends);
+    index->ends = NULL;
+    pthread_mutex_destroy(&index->lock);
+}
+
+/* Append the end offset of a record, returns 0 on success and -1 if memory is exhausted */
+static int index_push(struct aesd_record_index *index, size_t end)
+{
+    size_t capacity;
+    size_t *ends;
+
+    if (index->count == index->capacity)
+    {
+        capacity = index->capacity == 0 ? INITIAL_CAPACITY : index->capacity * 2;
+        ends = realloc(index->ends, capacity * sizeof(*ends));
+        if (ends == NULL)
+        {
+            return -1;
+        }
+        index->ends = ends;
+        index->capacity = capacity;
+    }
+    index->ends[index->count++] = end;
+    return 0;
+}
+
+/* Search the bytes of fd committed since the last update, below length. Called with the lock held. */
+static int index_update(struct aesd_record_index *index, int fd, size_t length)
+{
+    char chunk[SCAN_CHUNK_SIZE];
+    const char *pos, *newline;
+    ssize_t bytes_read;
+    size_t chunk_count;
+    size_t left;
+
+    while (index->scanned < length)
+    {
+        left = length - index->scanned;
+        bytes_read = pread(fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk), index->scanned);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0)
+        {
+            if (bytes_read == 0)
+            {
+                errno = EIO;
+            }
+            return -1;
+        }
+        pos = chunk;
+        chunk_count = index->count;
+        while ((newline = aesd_find_newline(pos, chunk + bytes_read - pos)) != NULL)
+        {
+            if (index_push(index, index->scanned + (newline - chunk) + 1) != 0)
+            {
+                /* The next lookup searches the chunk again from its first byte */
+                index->count = chunk_count;
+                return -1;
+            }
+            pos = newline + 1;
+        }
+        index->scanned += bytes_read;
+    }
+    return 0;
+}
+
+/* Byte range of count records from first, clamped to the records indexed. Called with the lock held. */
+static void index_locate(const struct aesd_record_index *index, size_t first, size_t count, size_t *start, size_t *end)
+{
+    if (first > index->count)
+    {
+        first = index->count;
+    }
+    if (count > index->count - first)
+    {
+        count = index->count - first;
+    }
+    *start = first == 0 ? 0 : index->ends[first - 1];
+    *end = count == 0 ? *start : index->ends[first + count - 1];
+}
+
+/**
+ * Looks up @param count records of @param index starting with record @param first, after indexing
+ * the data file @param fd up to its committed @param length.  Records past the last complete one
+ * are left out, so the range is empty if @param first is past it.
+ * @return 0 and the byte range in @param start and @param end, or -1 with errno set on failure
+ */
+int aesd_record_index_range(struct aesd_record_index *index, int fd, size_t length,
+                            size_t first, size_t count, size_t *start, size_t *end)
+{
+    int rc;
+
+    pthread_mutex_lock(&index->lock);
+    rc = index_update(index, fd, length);
+    if (rc == 0)
+    {
+        index_locate(index, first, count, start, end);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return rc;
+}
+
+/**
+ * Looks up the last @param count complete records of @param index, or all of them if there are fewer,
+ * after indexing the data file @param fd up to its committed @param length.
+ * @return 0 and the byte range in @param start and @param end, or -1 with errno set on failure
+ */
+int aesd_record_index_tail(struct aesd_record_index *index, int fd, size_t length,
+                           size_t count, size_t *start, size_t *end)
+{
+    int rc;
+
+    pthread_mutex_lock(&index->lock);
+    rc = index_update(index, fd, length);
+    if (rc == 0)
+    {
+        index_locate(index, index->count > count ? index->count - count : 0, count, start, end);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return rc;
+}
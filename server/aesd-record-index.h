@@ -0,0 +1,47 @@
+/*
+ * aesd-record-index.h
+ *
+ * @brief Index over the record boundaries of the aesdsocket data file.
+ *
+ * A record is a newline terminated packet as stored in the data file.  The index keeps the
+ * end offset of every complete record, so a slice of records maps to a byte range of the
+ * file with two array lookups and replies stream just that range.  It is brought up to date
+ * lazily: each lookup first searches only the bytes committed since the previous one, so
+ * clients polling a large history pay for what is new rather than for all of it.
+ */
+
+#ifndef AESD_RECORD_INDEX_H
+#define AESD_RECORD_INDEX_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct aesd_record_index
+{
+    /**
+     * Serializes lookups, which may extend the index
+     */
+    pthread_mutex_t lock;
+    /**
+     * End offset of every complete record, one past its newline, in file order
+     */
+    size_t *ends;
+    size_t count;
+    size_t capacity;
+    /**
+     * Bytes of the data file searched for record ends so far
+     */
+    size_t scanned;
+};
+
+extern void aesd_record_index_init(struct aesd_record_index *index);
+
+extern void aesd_record_index_free(struct aesd_record_index *index);
+
+extern int aesd_record_index_range(struct aesd_record_index *index, int fd, size_t length,
+                                   size_t first, size_t count, size_t *start, size_t *end);
+
+extern int aesd_record_index_tail(struct aesd_record_index *index, int fd, size_t length,
+                                  size_t count, size_t *start, size_t *end);
+
+#endif /* AESD_RECORD_INDEX_H */
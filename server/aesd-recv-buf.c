@@ -0,0 +1,189 @@
+/**
+ * @file aesd-recv-buf.c
+ * @brief Per-connection receive buffer of aesdsocket
+ *
+ * The pending bytes are data[start, end).  Consuming a packet only advances start, and the
+ * buffer resets to empty for free once everything has been consumed, which is the common
+ * case of a client that waits for each reply.  When more space is needed the pending bytes
+ * are moved to the front only if that frees at least as much as they occupy, otherwise the
+ * capacity doubles; every byte is therefore moved a bounded number of times on average.
+ * The scan cursor stops at the newline it finds, so asking again for the same packet before
+ * consuming it costs nothing, and it moves along with the data when the buffer compacts.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-binproto.h"
+#include "aesd-framer.h"
+#include "aesd-recv-buf.h"
+
+/**
+ * Initializes @param buf as empty, nothing is allocated until the first receive
+ */
+void aesd_recv_buf_init(struct aesd_recv_buf *buf)
+{
+    buf->data = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->scan = 0;
+    buf->size = 0;
+}
+
+/**
+ * Releases the memory of @param buf, which is left empty
+ */
+void aesd_recv_buf_free(struct aesd_recv_buf *buf)
+{
+    free(buf->data);
+    aesd_recv_buf_init(buf);
+}
+
+/**
+ * Makes room for at least @param min_space more bytes at the end of @param buf.
+ * @param space receives the number of bytes that may be written at the returned pointer.
+ * @return where the next received bytes go, or NULL if memory is exhausted
+ */
+char *aesd_recv_buf_reserve(struct aesd_recv_buf *buf, size_t min_space, size_t *space)
+{
+    size_t pending = buf->end - buf->start;
+    size_t new_size;
+    char *new_data;
+
+    if (buf->size - buf->end < min_space)
+    {
+        if (buf->start >= pending && buf->size - pending >= min_space)
+        {
+            /* The consumed prefix outweighs what is left, reclaim it */
+            memmove(buf->data, buf->data + buf->start, pending);
+        }
+        else
+        {
+            new_size = buf->size < AESD_RECV_BUF_MIN_SIZE ? AESD_RECV_BUF_MIN_SIZE : buf->size;
+            while (new_size - pending < min_space)
+            {
+                new_size *= 2;
+            }
+            if (buf->start > 0)
+            {
+                /* Copy only the pending bytes instead of letting realloc copy the whole buffer */
+                new_data = malloc(new_size);
+                if (new_data == NULL)
+                {
+                    return NULL;
+                }
+                memcpy(new_data, buf->data + buf->start, pending);
+                free(buf->data);
+            }
+            else
+            {
+                new_data = realloc(buf->data, new_size);
+                if (new_data == NULL)
+                {
+                    return NULL;
+                }
+            }
+            buf->data = new_data;
+            buf->size = new_size;
+        }
+        buf->scan -= buf->start;
+        buf->start = 0;
+        buf->end = pending;
+    }
+
+    *space = buf->size - buf->end;
+    return buf->data + buf->end;
+}
+
+/**
+ * Adds @param len bytes written at the pointer returned by aesd_recv_buf_reserve() to @param buf
+ */
+void aesd_recv_buf_commit(struct aesd_recv_buf *buf, size_t len)
+{
+    buf->end += len;
+}
+
+/**
+ * Copies @param len bytes from @param data to the end of @param buf.
+ * @return 0 on success, -1 if memory is exhausted
+ */
+int aesd_recv_buf_append(struct aesd_recv_buf *buf, const char *data, size_t len)
+{
+    size_t space;
+    char *dst = aesd_recv_buf_reserve(buf, len, &space);
+
+    if (dst == NULL)
+    {
+        return -1;
+    }
+    memcpy(dst, data, len);
+    aesd_recv_buf_commit(buf, len);
+    return 0;
+}
+
+/**
+ * @return the first newline terminated packet of @param buf, or NULL if none is complete.
+ * @param packet_length receives its length including the newline.  The packet stays valid
+ * until it is consumed or more space is reserved.
+ */
+const char *aesd_recv_buf_next_packet(struct aesd_recv_buf *buf, size_t *packet_length)
+{
+    const char *packet = buf->data + buf->start;
+    const char *newline_ptr;
+
+    if (buf->scan == buf->end)
+    {
+        return NULL;
+    }
+    /* Only search the bytes received since the last search */
+    newline_ptr = aesd_find_newline(buf->data + buf->scan, buf->end - buf->scan);
+    if (newline_ptr == NULL)
+    {
+        buf->scan = buf->end;
+        return NULL;
+    }
+    buf->scan = newline_ptr - buf->data;
+    *packet_length = newline_ptr - packet + 1;
+    return packet;
+}
+
+/**
+ * @return the first binary protocol frame of @param buf, or NULL if none is complete.
+ * @param frame_length receives its length including the header.  The frame is found from
+ * its header alone, without looking at the payload, and stays valid like a packet.
+ */
+const char *aesd_recv_buf_next_frame(struct aesd_recv_buf *buf, size_t *frame_length)
+{
+    struct aesd_bin_header header;
+    size_t pending = buf->end - buf->start;
+
+    if (pending < AESD_BIN_HEADER_SIZE)
+    {
+        return NULL;
+    }
+    aesd_bin_decode_header(buf->data + buf->start, &header);
+    if (pending - AESD_BIN_HEADER_SIZE < header.length)
+    {
+        return NULL;
+    }
+    *frame_length = AESD_BIN_HEADER_SIZE + (size_t)header.length;
+    return buf->data + buf->start;
+}
+
+/**
+ * Drops the first @param len pending bytes of @param buf
+ */
+void aesd_recv_buf_consume(struct aesd_recv_buf *buf, size_t len)
+{
+    buf->start += len;
+    if (buf->start == buf->end)
+    {
+        buf->start = 0;
+        buf->end = 0;
+        buf->scan = 0;
+    }
+    else if (buf->scan < buf->start)
+    {
+        buf->scan = buf->start;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * aesd-recv-buf.h
+ *
+ * @brief Per-connection receive buffer of aesdsocket.
+ *
+ * Clients receive straight into the free space at the end of the buffer and packets are
+ * taken from the front by advancing a read cursor, so neither receiving nor consuming a
+ * packet copies the data that is still pending.  The buffer grows geometrically and only
+ * compacts when the consumed prefix is at least as large as what is left, which keeps the
+ * copying linear in the number of bytes received.  The buffer also remembers how far it has
+ * been searched for a newline, so a packet that arrives over many receives is scanned once.
+ * Frames of the binary protocol are taken off by the length in their header instead.
+ */
+
+#ifndef AESD_RECV_BUF_H
+#define AESD_RECV_BUF_H
+
+#include <stddef.h>
+
+/**
+ * Capacity of a buffer after its first allocation
+ */
+#define AESD_RECV_BUF_MIN_SIZE 4096
+
+struct aesd_recv_buf
+{
+    char *data;
+    /**
+     * Read cursor, the first byte not yet consumed
+     */
+    size_t start;
+    /**
+     * End of the received data, new data is appended here
+     */
+    size_t end;
+    /**
+     * Newline search cursor, data[start, scan) holds no newline
+     */
+    size_t scan;
+    size_t size;
+};
+
+extern void aesd_recv_buf_init(struct aesd_recv_buf *buf);
+
+extern void aesd_recv_buf_free(struct aesd_recv_buf *buf);
+
+extern char *aesd_recv_buf_reserve(struct aesd_recv_buf *buf, size_t min_space, size_t *space);
+
+extern void aesd_recv_buf_commit(struct aesd_recv_buf *buf, size_t len);
+
+extern int aesd_recv_buf_append(struct aesd_recv_buf *buf, const char *data, size_t len);
+
+extern const char *aesd_recv_buf_next_packet(struct aesd_recv_buf *buf, size_t *packet_length);
+
+extern const char *aesd_recv_buf_next_frame(struct aesd_recv_buf *buf, size_t *frame_length);
+
+extern void aesd_recv_buf_consume(struct aesd_recv_buf *buf, size_t len);
+
+#endif /* AESD_RECV_BUF_H */
@@ -0,0 +1,189 @@
+/**
+ * @file aesd-timer.c
+ * @brief Periodic jobs of aesdsocket, run by one scheduler thread
+ *
+ * The timers are periodic timerfds on CLOCK_MONOTONIC.  When the scheduler falls behind, for
+ * instance because a job ran long, the expirations it missed are coalesced and the job runs
+ * once rather than catching up.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "aesd-timer.h"
+
+struct timer_job
+{
+    aesd_timer_fn fn;
+    void *arg;
+    struct timespec interval;
+    int fd;
+};
+
+static struct timer_job jobs[AESD_TIMER_MAX_JOBS];
+static int job_count;
+static int epoll_fd = -1;
+static int stop_fd = -1;
+static pthread_t scheduler_thread;
+
+/**
+ * Registers a job that runs @param fn with @param arg every @param interval_ms milliseconds,
+ * the first time one interval after the scheduler starts.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_timer_add(unsigned int interval_ms, aesd_timer_fn fn, void *arg)
+{
+    struct timer_job *job;
+
+    if (job_count == AESD_TIMER_MAX_JOBS || interval_ms == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    job = &jobs[job_count];
+    job->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (job->fd == -1)
+    {
+        return -1;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->interval.tv_sec = interval_ms / 1000;
+    job->interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    job_count++;
+    return 0;
+}
+
+/* Scheduler thread, runs the jobs whose timers expired until told to stop */
+static void *scheduler_thread_fn(void *arg)
+{
+    struct epoll_event events[AESD_TIMER_MAX_JOBS + 1];
+    struct timer_job *job;
+    uint64_t expirations;
+    int nfds;
+    int i;
+
+    (void)arg;
+    for (;;)
+    {
+        nfds = epoll_wait(epoll_fd, events, AESD_TIMER_MAX_JOBS + 1, -1);
+        if (nfds == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "timer: epoll_wait failed: %s", strerror(errno));
+            return NULL;
+        }
+        for (i = 0; i < nfds; i++)
+        {
+            job = events[i].data.ptr;
+            if (job == NULL)
+            {
+                return NULL;
+            }
+            /* Reading resets the expiration count, missed periods run the job only once */
+            if (read(job->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                job->fn(job->arg);
+            }
+        }
+    }
+}
+
+/**
+ * Arms the registered timers and starts the scheduler thread, which inherits the signal mask
+ * of the caller.  Without jobs no thread is started at all.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_timer_start(void)
+{
+    struct epoll_event ev;
+    struct itimerspec spec;
+    int err;
+    int i;
+
+    if (job_count == 0)
+    {
+        return 0;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (epoll_fd == -1 || stop_fd == -1)
+    {
+        goto fail;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) == -1)
+    {
+        goto fail;
+    }
+    for (i = 0; i < job_count; i++)
+    {
+        ev.data.ptr = &jobs[i];
+        /* First expiration one period from now */
+        spec.it_interval = jobs[i].interval;
+        spec.it_value = jobs[i].interval;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, jobs[i].fd, &ev) == -1 ||
+            timerfd_settime(jobs[i].fd, 0, &spec, NULL) == -1)
+        {
+            goto fail;
+        }
+    }
+    err = pthread_create(&scheduler_thread, NULL, scheduler_thread_fn, NULL);
+    if (err != 0)
+    {
+        errno = err;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    if (stop_fd != -1)
+    {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+    aesd_timer_stop();
+    errno = err;
+    return -1;
+}
+
+/**
+ * Stops the scheduler, waiting for a job in progress, and releases every job
+ */
+void aesd_timer_stop(void)
+{
+    int i;
+
+    if (stop_fd != -1)
+    {
+        if (eventfd_write(stop_fd, 1) == 0)
+        {
+            pthread_join(scheduler_thread, NULL);
+        }
+        close(stop_fd);
+        stop_fd = -1;
+    }
+    if (epoll_fd != -1)
+    {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    for (i = 0; i < job_count; i++)
+    {
+        close(jobs[i].fd);
+    }
+    job_count = 0;
+}
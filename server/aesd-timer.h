@@ -0,0 +1,27 @@
+/*
+ * aesd-timer.h
+ *
+ * @brief Periodic jobs of aesdsocket, run by one scheduler thread.
+ *
+ * Each job has a timerfd and the scheduler sleeps in epoll until one of them expires or it is
+ * told to stop through an eventfd, so it never wakes up between timers.  Jobs are registered
+ * before the scheduler starts and run on the scheduler thread, one at a time.
+ */
+
+#ifndef AESD_TIMER_H
+#define AESD_TIMER_H
+
+/**
+ * Most jobs that can be registered
+ */
+#define AESD_TIMER_MAX_JOBS 8
+
+typedef void (*aesd_timer_fn)(void *arg);
+
+extern int aesd_timer_add(unsigned int interval_ms, aesd_timer_fn fn, void *arg);
+
+extern int aesd_timer_start(void);
+
+extern void aesd_timer_stop(void);
+
+#endif /* AESD_TIMER_H */
@@ -0,0 +1,279 @@
+/**
+ * @file aesd-uring.c
+ * @brief Minimal io_uring ring for aesdsocket, built on the raw system calls
+ *
+ * The submission queue is filled in order, so the index array is set up once as the identity
+ * and only the tail moves.  Entries are handed to the kernel by aesd_uring_submit_and_wait(),
+ * which also waits for completions with the given signal mask in place, like epoll_pwait().
+ * Without SQPOLL the kernel consumes every submitted entry inside io_uring_enter(), so the
+ * number of pending entries is simply the distance between the local tail and the shared head.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "aesd-uring.h"
+
+/* Shared ring indexes are read and written with the ordering the kernel documents */
+#define ring_load_acquire(p) atomic_load_explicit((_Atomic unsigned *)(p), memory_order_acquire)
+#define ring_store_release(p, v) atomic_store_explicit((_Atomic unsigned *)(p), (v), memory_order_release)
+
+/**
+ * Sets up @param ring with room for @param entries submissions.
+ * @return 0 on success, -1 with errno set on failure, ENOSYS if the kernel lacks io_uring
+ */
+int aesd_uring_init(struct aesd_uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        /* Both rings live in one mapping */
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        aesd_uring_exit(ring);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size != 0)
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            aesd_uring_exit(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        aesd_uring_exit(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    /* Entries are always used in ring order */
+    for (i = 0; i < params.sq_entries; i++)
+    {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+/**
+ * Releases @param ring and its provided buffers.  Pending requests are cancelled by the kernel.
+ */
+void aesd_uring_exit(struct aesd_uring *ring)
+{
+    if (ring->buf_ring != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        ring->buf_ring = NULL;
+    }
+    free(ring->bufs);
+    ring->bufs = NULL;
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    ring->cq_ring = NULL;
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        ring->sq_ring = NULL;
+    }
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+/**
+ * Makes room for @param count submission entries of @param ring, submitting the pending entries
+ * first if fewer are free.  Call it before the first entry of a linked chain, so that the flush
+ * of a full queue cannot hand the kernel only part of the chain.
+ * @return 0 if @param count entries are free, -1 if they could not be freed
+ */
+int aesd_uring_reserve(struct aesd_uring *ring, unsigned count)
+{
+    if (ring->sq_entries - (ring->sq_local_tail - ring_load_acquire(ring->sq_head)) >= count)
+    {
+        return 0;
+    }
+    aesd_uring_submit_and_wait(ring, 0, NULL);
+    return ring->sq_entries - (ring->sq_local_tail - ring_load_acquire(ring->sq_head)) >= count ? 0 : -1;
+}
+
+/**
+ * @return a zeroed submission entry of @param ring, submitting pending entries first if the
+ * queue is full, or NULL if no entry could be freed
+ */
+struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (aesd_uring_reserve(ring, 1) != 0)
+    {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Hands the prepared entries of @param ring to the kernel and waits until at least
+ * @param wait_nr completions are available, with @param sigmask in place while waiting.
+ * @return the number of entries submitted, -1 with errno set on failure (EINTR on a signal)
+ */
+int aesd_uring_submit_and_wait(struct aesd_uring *ring, unsigned wait_nr, const sigset_t *sigmask)
+{
+    unsigned to_submit;
+    int rc;
+
+    ring_store_release(ring->sq_tail, ring->sq_local_tail);
+    to_submit = ring->sq_local_tail - ring_load_acquire(ring->sq_head);
+    if (to_submit == 0 && wait_nr == 0)
+    {
+        return 0;
+    }
+    rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                 wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, sigmask, _NSIG / 8);
+    return rc < 0 ? -1 : rc;
+}
+
+/**
+ * @return the oldest unconsumed completion of @param ring, or NULL if there is none
+ */
+struct io_uring_cqe *aesd_uring_peek_cqe(struct aesd_uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == ring_load_acquire(ring->cq_tail))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Marks the completion returned by aesd_uring_peek_cqe() as consumed
+ */
+void aesd_uring_cqe_seen(struct aesd_uring *ring)
+{
+    ring_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+/**
+ * Registers @param count receive buffers of @param size bytes as buffer group @param group of
+ * @param ring.  @param count must be a power of two.
+ * @return 0 on success, -1 with errno set on failure, EINVAL if the kernel lacks buffer rings
+ */
+int aesd_uring_setup_buffers(struct aesd_uring *ring, unsigned short group, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->bufs = malloc((size_t)count * size);
+    if (ring->bufs == NULL)
+    {
+        return -1;
+    }
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_group = group;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        aesd_uring_recycle_buffer(ring, i);
+    }
+    return 0;
+}
+
+/**
+ * @return the memory of provided buffer @param bid of @param ring
+ */
+char *aesd_uring_buffer(struct aesd_uring *ring, unsigned short bid)
+{
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+/**
+ * Gives provided buffer @param bid back to the kernel once its data has been consumed
+ */
+void aesd_uring_recycle_buffer(struct aesd_uring *ring, unsigned short bid)
+{
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+
+    buf->addr = (unsigned long)aesd_uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    atomic_store_explicit((_Atomic unsigned short *)&ring->buf_ring->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,80 @@
+/*
+ * aesd-uring.h
+ *
+ * @brief Minimal io_uring ring for aesdsocket, built on the raw system calls.
+ *
+ * Covers what the io_uring engine needs and nothing more: one submission and completion
+ * queue pair and one ring of provided receive buffers.  No liburing dependency, so the
+ * server still builds against plain kernel headers.
+ */
+
+#ifndef AESD_URING_H
+#define AESD_URING_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+
+struct aesd_uring
+{
+    int fd;
+    /**
+     * Submission queue, shared with the kernel
+     */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    /**
+     * Tail including entries prepared but not yet handed to the kernel, and the queue size
+     */
+    unsigned sq_local_tail;
+    unsigned sq_entries;
+    /**
+     * Completion queue, shared with the kernel
+     */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /**
+     * Mappings to release on exit
+     */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /**
+     * Provided buffer ring, the kernel picks a buffer for each multishot receive
+     */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *bufs;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_group;
+};
+
+extern int aesd_uring_init(struct aesd_uring *ring, unsigned entries);
+
+extern void aesd_uring_exit(struct aesd_uring *ring);
+
+extern int aesd_uring_reserve(struct aesd_uring *ring, unsigned count);
+
+extern struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring *ring);
+
+extern int aesd_uring_submit_and_wait(struct aesd_uring *ring, unsigned wait_nr, const sigset_t *sigmask);
+
+extern struct io_uring_cqe *aesd_uring_peek_cqe(struct aesd_uring *ring);
+
+extern void aesd_uring_cqe_seen(struct aesd_uring *ring);
+
+extern int aesd_uring_setup_buffers(struct aesd_uring *ring, unsigned short group, unsigned count, unsigned size);
+
+extern char *aesd_uring_buffer(struct aesd_uring *ring, unsigned short bid);
+
+extern void aesd_uring_recycle_buffer(struct aesd_uring *ring, unsigned short bid);
+
+#endif /* AESD_URING_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,28 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <time.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesd-append-log.h"
+#include "aesd-binproto.h"
+#include "aesd-framer.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+#include "aesd-record-index.h"
+#include "aesd-recv-buf.h"
+#include "aesd-timer.h"
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
@@ -25,24 +43,338 @@
 #define AESD_DATA_FILE "/var/tmp/aesdsocketdata"
 #endif
 
-/* Thread data structure */
-typedef struct thread_data_s
+/* Serve clients from a single epoll event loop, or with one thread per connection when 0 */
+#ifndef USE_EPOLL_REACTOR
+#define USE_EPOLL_REACTOR 1
+#endif
+
+/* Build the io_uring engine, selected at run time with -u */
+#ifndef USE_IO_URING
+#define USE_IO_URING 1
+#endif
+
+#if USE_IO_URING == 1
+#include "aesd-uring.h"
+#endif
+
+/* "AESDSOCKET_DELTA:1" switches a client to replies holding only the data appended since its last reply */
+#define AESD_DELTA_PREFIX "AESDSOCKET_DELTA:"
+#define AESD_DELTA_PREFIX_LEN (sizeof(AESD_DELTA_PREFIX) - 1)
+
+/* "AESDSOCKET_ECHO:0" stops the replies to a client's data packets, "AESDSOCKET_ECHO:1" brings them back */
+#define AESD_ECHO_PREFIX "AESDSOCKET_ECHO:"
+#define AESD_ECHO_PREFIX_LEN (sizeof(AESD_ECHO_PREFIX) - 1)
+
+/* Size of the chunk used to copy a reply through user space */
+#define REPLY_BUF_SIZE 1024
+
+/* Least free space offered to each recv, the receive buffer grows when less is left */
+#define RECV_MIN_SPACE 1024
+
+/* Longest message of a SOCK_SEQPACKET client, longer ones would lose their tail and close the connection */
+#define LOCAL_MESSAGE_MAX 4096
+
+/*
+ * Worker threads of the threaded engine.  This is not a pool sized to the number of cores: each
+ * worker serves a client for its whole session, blocking on it between packets, so this is how
+ * many clients are served at once.  A pool of one worker per core would stall every further
+ * client behind a few idle ones, and a connection needs the reactor or the io_uring engine to be
+ * served without a thread of its own.
+ */
+#define WORKER_THREADS_DEFAULT 128
+
+/* Group commit defaults: packets written together, and how long the first of them may wait */
+#define BATCH_SIZE_DEFAULT 16
+#define BATCH_LATENCY_US_DEFAULT 200
+
+/* Period of the timestamp written to the data file */
+#define TIMESTAMP_INTERVAL_MS 10000
+
+#if USE_AESD_CHAR_DEVICE == 0
+/* How file-backed replies get from the data file to the socket, in order of preference */
+typedef enum
+{
+    REPLY_SENDFILE,     /* sendfile(2) straight from the page cache */
+    REPLY_SPLICE,       /* splice(2) through a pipe */
+    REPLY_COPY          /* pread(2) and send(2) through a buffer */
+} reply_method_t;
+#endif
+
+/* Source of the reply to a packet, streamed to the client until complete */
+typedef struct
+{
+    /* Staging buffer between the data source and the socket, when the reply is copied */
+    char *buf;
+    size_t len;
+    size_t off;
+#if USE_AESD_CHAR_DEVICE == 1
+    /* Descriptor of the device owned by the session, -1 if the whole reply is in buf, and where the next read starts */
+    int fd;
+    off_t offset;
+    /* Device offset the reply ends at, -1 to read until the device ends */
+    off_t end;
+#else
+    /* Next byte of the data file to move into the socket or the pipe */
+    off_t offset;
+    /* Committed length of the data file when the reply was started */
+    off_t end;
+    reply_method_t method;
+    /* Pipe of the splice method, -1 until needed */
+    int pipe_fd[2];
+    /* Bytes spliced into the pipe but not yet into the socket */
+    size_t pipe_len;
+#endif
+} reply_t;
+
+/* Address of a client, formatted only when a message about it is logged */
+typedef union
+{
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+    struct sockaddr_un un;
+} peer_addr_t;
+
+/* Per-client protocol state shared by both engines */
+typedef struct
+{
+    reply_t reply;
+    /* Packets are binary protocol frames once the client negotiated them, newline terminated text before */
+    int binary;
+    /* Text data packets are answered with the stored data, unless the client turned the echo off */
+    int echo;
+#if USE_AESD_CHAR_DEVICE == 1
+    /* Read side of the device, opened by the first reply and kept until the client leaves */
+    int dev_fd;
+#else
+    /* Replies only carry the data appended since the previous reply */
+    int delta_mode;
+    /* Data file offset the previous reply to a data packet ended at */
+    off_t replied;
+#endif
+    /* Stage timing: when data last arrived, and when the packet in progress entered its current stage */
+    uint64_t recv_ns;
+    uint64_t stage_ns;
+    /* Monotonic second the client last sent or received data, kept while idle connections are reaped */
+    _Atomic time_t last_active;
+    /* Monotonic second the unfinished packet in the receive buffer was first seen, 0 if there is none */
+    _Atomic time_t partial_since;
+    /* Flags and least free space of each receive, SOCK_SEQPACKET clients need room for a whole message */
+    int recv_flags;
+    size_t recv_space;
+} session_t;
+
+#if USE_EPOLL_REACTOR == 1
+/* Maximum number of events handled per epoll_wait call */
+#define REACTOR_MAX_EVENTS 64
+/* Most connections accepted per pass, so a stream of new clients cannot starve the open ones */
+#define REACTOR_MAX_ACCEPTS 64
+
+/* Per-connection state machine of the epoll reactor */
+typedef enum
+{
+    CONN_STATE_RECV,    /* Reading until a complete packet is buffered */
+#if USE_AESD_CHAR_DEVICE == 0
+    CONN_STATE_COMMIT,  /* Buffered packet waits for the group commit of the event loop pass */
+#endif
+    CONN_STATE_SEND     /* Streaming the reply to the last packet */
+} conn_state_t;
+
+/* Connection data structure */
+typedef struct connection_s
+{
+    int client_fd;
+    conn_state_t state;
+    /* Event loop serving the connection */
+    struct reactor_s *reactor;
+    /* Received bytes not yet handled */
+    struct aesd_recv_buf rx;
+#if USE_AESD_CHAR_DEVICE == 0
+    /* Length of the packet at the front of rx while in CONN_STATE_COMMIT */
+    size_t commit_len;
+#endif
+    /* Protocol state, holds the reply in progress while in CONN_STATE_SEND */
+    session_t session;
+    peer_addr_t peer;
+    LIST_ENTRY(connection_s) entries;
+} connection_t;
+
+#if USE_AESD_CHAR_DEVICE == 0
+/* Data packets received during one event loop pass, written to the data file together */
+typedef struct
+{
+    connection_t *conns[AESD_APPEND_LOG_MAX_BATCH];
+    struct iovec iov[AESD_APPEND_LOG_MAX_BATCH];
+    size_t count;
+} commit_batch_t;
+#endif
+
+/* Event loop of the reactor, serving the clients of one listening socket */
+typedef struct reactor_s
+{
+    int epoll_fd;
+    int listen_fd;
+    /* CPU the loop is pinned to, -1 if it may run anywhere */
+    int cpu;
+    pthread_t thread;
+    LIST_HEAD(connection_list, connection_s) conns;
+#if USE_AESD_CHAR_DEVICE == 0
+    /* Packets waiting for the next group commit */
+    commit_batch_t commit_batch;
+#endif
+} reactor_t;
+#else
+/* Number of accepted clients that may wait for a free worker before accept stops */
+#define WORK_QUEUE_DEPTH 64
+
+/* Accepted client waiting for a worker */
+typedef struct
+{
+    int client_fd;
+    peer_addr_t peer;
+} work_item_t;
+
+/* Worker thread data structure */
+typedef struct
 {
     pthread_t thread_id;
+    /* Client currently being served, -1 when idle */
+    int client_fd;
+    /* Protocol state of that client */
+    session_t session;
+} worker_t;
+
+/* Bounded queue of accepted clients shared by the worker pool */
+typedef struct
+{
+    work_item_t items[WORK_QUEUE_DEPTH];
+    size_t head;
+    size_t count;
+    int shutdown;
+    /* Worker pool, for interrupting the clients it serves */
+    worker_t *workers;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} work_queue_t;
+#endif
+
+#if USE_IO_URING == 1
+/* Submission queue depth of the io_uring engine */
+#define URING_ENTRIES 256
+/* Provided receive buffers, the count must be a power of two */
+#define URING_RECV_BUFS 256
+/* Provided buffer size, a whole SOCK_SEQPACKET message fits in one */
+#define URING_RECV_BUF_SIZE LOCAL_MESSAGE_MAX
+#define URING_BUF_GROUP 0
+/* Part of a reply read from the data store and sent by one linked pair of requests */
+#define URING_CHUNK_SIZE 65536
+
+/* Request a completion belongs to, kept in the low bits of its user data */
+typedef enum
+{
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_WRITE,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_REAP,
+    /* Accept on the Unix domain socket */
+    URING_OP_ACCEPT_LOCAL
+} uring_op_t;
+#define URING_OP_MASK 7
+
+/* Connection state of the io_uring engine */
+typedef struct uring_conn_s
+{
     int client_fd;
-    struct sockaddr_in client_addr;
-    int thread_complete;
-    SLIST_ENTRY(thread_data_s) entries;
-} thread_data_t;
+    /* Received bytes not yet handled */
+    struct aesd_recv_buf rx;
+    /* Copy of the packet being written to the device, rx may move while the write is in flight */
+    char *packet;
+    size_t packet_size;
+    /* Reply chunk, read from the data store and sent from here */
+    char *chunk;
+    /* A reply is in flight, further packets wait in buf */
+    int replying;
+    /* The send in flight carries the last chunk of the reply */
+    int last_chunk;
+    /* The peer finished sending, the connection closes once the buffered packets are answered */
+    int eof;
+    /* The peer left or a request failed, the connection is freed once nothing is in flight */
+    int closing;
+    /* Requests submitted and not completed, a multishot receive counts until its final completion */
+    unsigned inflight;
+    session_t session;
+    peer_addr_t peer;
+    LIST_ENTRY(uring_conn_s) entries;
+} uring_conn_t;
+#endif
 
 /* Global variable to indicate if a signal was caught */
 volatile sig_atomic_t caught_signal = 0;
 
-/* Mutex for file synchronization */
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Address to listen on, NULL for every IPv6 and IPv4 address */
+const char *bind_address = NULL;
+const char *bind_port = "9000";
+/* Connections the kernel queues for accept */
+int listen_backlog = SOMAXCONN;
+/* Unix domain socket for clients on the same host, NULL for none, and its SOCK_STREAM or SOCK_SEQPACKET type */
+const char *local_path = NULL;
+int local_type = SOCK_STREAM;
+/* Listening Unix domain socket, -1 when there is none */
+int local_fd = -1;
+/* Absolute path the Unix domain socket was bound to, removed on exit */
+char local_bound_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* Seconds a connection may go without traffic before it is closed, 0 keeps idle connections */
+long idle_timeout = 0;
+/* Seconds a client may take to finish a packet once it started sending it, 0 for no limit */
+long read_timeout = 0;
+/* Longest unfinished packet buffered for a client before it is closed, 0 for no limit */
+size_t max_packet_size = 0;
+/* Clients served at once, further ones are turned away, 0 for no limit */
+long max_connections = 0;
+/* Clients currently admitted, including those waiting for a worker */
+atomic_long open_connections;
+/* Written by the reaper job to have an event loop close its expired connections, -1 when not reaping */
+int reap_fd = -1;
+
+#if USE_AESD_CHAR_DEVICE == 1
+/*
+ * Write side of the device, shared by all clients since the driver serializes writers.  Opened by the first
+ * packet rather than at startup, so the server may start before the driver is loaded.
+ */
+_Atomic int data_fd = -1;
+#else
+/* Data file opened once, replies are streamed from it without reopening */
+struct aesd_append_log data_log;
+/* Record boundaries of the data file, for the replies to READ and TAIL */
+struct aesd_record_index record_index;
+/* Preferred way to move file-backed replies into the socket, downgraded if the file system lacks support */
+reply_method_t reply_method = REPLY_SENDFILE;
+/* Most packets written to the data file at once */
+size_t batch_size = BATCH_SIZE_DEFAULT;
+#endif
+
+#if USE_EPOLL_REACTOR == 1
+/* Stops the event loops of the per-core mode, where signals only reach the main thread */
+int reactor_stop_fd = -1;
+#else
+/* Work queue feeding the worker pool */
+work_queue_t work_queue =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+#endif
 
-/* Linked list head */
-SLIST_HEAD(thread_list, thread_data_s) head;
+#if USE_IO_URING == 1
+/* Connections of the io_uring engine */
+LIST_HEAD(uring_conn_list, uring_conn_s) uring_conns;
+#endif
 
 /* Signal handler function */
 void signal_handler(int signo)
@@ -55,199 +387,2899 @@ void signal_handler(int signo)
     }
 }
 
-/* Timestamp thread function */
-#if USE_AESD_CHAR_DEVICE == 0
-void *timestamp_thread(void *arg)
+/*
+ * Create a stream socket listening on bind_address and bind_port.  Without an address it is one dual-stack socket
+ * for every IPv6 and IPv4 address, or an IPv4 one if the host lacks IPv6.  With reuseport set, further listeners
+ * may bind the same port and the kernel spreads connections over them.
+ * Returns the socket, or -1 after printing why it failed.
+ */
+static int open_listener(int reuseport)
 {
-    (void)arg;
-    time_t now;
-    struct tm tm_info;
-    char time_str[128];
-    FILE *fp;
-    int i;
-    
-    while (!caught_signal)
+    static const char *const any_addresses[] = { "::", "0.0.0.0" };
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    const char *address;
+    size_t addresses = bind_address != NULL ? 1 : sizeof(any_addresses) / sizeof(any_addresses[0]);
+    int server_fd;
+    int opt = 1;
+    int v6only = 0;
+    int err;
+    size_t i;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    for (i = 0; i < addresses; i++)
+    {
+        address = bind_address != NULL ? bind_address : any_addresses[i];
+        err = getaddrinfo(address, bind_port, &hints, &res);
+        if (err != 0)
+        {
+            fprintf(stderr, "%s port %s: %s\n", address, bind_port, gai_strerror(err));
+            return -1;
+        }
+        for (ai = res; ai != NULL; ai = ai->ai_next)
+        {
+            server_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (server_fd == -1)
+            {
+                /* Without IPv6 on the host the wildcard falls back to IPv4 quietly */
+                if (errno != EAFNOSUPPORT || bind_address != NULL)
+                {
+                    perror("socket");
+                }
+                continue;
+            }
+
+            /*
+             * SO_REUSEADDR allows restarting the server immediately.  IPv6 sockets also take IPv4 clients, as mapped
+             * addresses, whatever the system default for IPV6_V6ONLY.
+             */
+            if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+                (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) ||
+                (ai->ai_family == AF_INET6 &&
+                 setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1))
+            {
+                perror("setsockopt");
+            }
+            else if (bind(server_fd, ai->ai_addr, ai->ai_addrlen) == -1)
+            {
+                perror("bind");
+            }
+            /* Start listening for connections, the backlog absorbs bursts of clients connecting at once */
+            else if (listen(server_fd, listen_backlog) == -1)
+            {
+                perror("listen");
+            }
+            else
+            {
+                freeaddrinfo(res);
+                return server_fd;
+            }
+            close(server_fd);
+        }
+        freeaddrinfo(res);
+    }
+    return -1;
+}
+
+/*
+ * Create the Unix domain socket listening on local_path, replacing a socket left by an earlier run.  A relative path
+ * is made absolute first, so it can still be removed on exit after a daemon changed its directory.
+ * Returns the socket, or -1 after printing why it failed.
+ */
+static int open_local_listener(void)
+{
+    struct sockaddr_un addr;
+    size_t dir_len = 0;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (local_path[0] != '/')
     {
-        /* Wait 10 seconds, checking for signal every 100ms */
-        for (i = 0; i < 100; i++)
+        if (getcwd(addr.sun_path, sizeof(addr.sun_path) - 1) == NULL)
         {
-            if (caught_signal)
+            perror("getcwd");
+            return -1;
+        }
+        dir_len = strlen(addr.sun_path);
+        addr.sun_path[dir_len++] = '/';
+    }
+    if (dir_len + strlen(local_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: %s\n", local_path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    strcpy(addr.sun_path + dir_len, local_path);
+
+    fd = socket(AF_UNIX, local_type | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    /* A socket left by an earlier run would make bind fail */
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror(local_path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, listen_backlog) == -1)
+    {
+        perror("listen");
+        close(fd);
+        unlink(addr.sun_path);
+        return -1;
+    }
+    strcpy(local_bound_path, addr.sun_path);
+    return fd;
+}
+
+/* Close the Unix domain socket, if any, and remove it from the file system */
+static void close_local_listener(void)
+{
+    if (local_fd != -1)
+    {
+        close(local_fd);
+        unlink(local_bound_path);
+        local_fd = -1;
+    }
+}
+
+/* Format the address of a client into buf, IPv4 clients of a dual-stack socket in their IPv4 form */
+static const char *peer_format(const peer_addr_t *peer, char *buf, size_t len)
+{
+    buf[0] = '\0';
+    if (peer->sa.sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&peer->in6.sin6_addr))
+    {
+        inet_ntop(AF_INET, &peer->in6.sin6_addr.s6_addr[12], buf, len);
+    }
+    else if (peer->sa.sa_family == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &peer->in6.sin6_addr, buf, len);
+    }
+    else if (peer->sa.sa_family == AF_INET)
+    {
+        inet_ntop(AF_INET, &peer->in.sin_addr, buf, len);
+    }
+    else if (peer->sa.sa_family == AF_UNIX)
+    {
+        /* Clients rarely bind their end, the listening socket says more */
+        snprintf(buf, len, "local socket");
+    }
+    return buf;
+}
+
+/* Log that a client was "Accepted" or "Closed", formatting its address only if the message is logged */
+static void peer_log(enum aesd_log_type type, const char *event, const peer_addr_t *peer)
+{
+    char host[INET6_ADDRSTRLEN];
+
+    if (aesd_log_enabled(LOG_INFO))
+    {
+        aesd_log(type, LOG_INFO, "%s connection from %s", event, peer_format(peer, host, sizeof(host)));
+    }
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
+/*
+ * Write side of the device, opened on first use.  Returns -1 if it cannot be opened yet, the writes of the packet
+ * then fail like any other and the next packet tries again.
+ */
+static int device_write_fd(void)
+{
+    int fd = atomic_load_explicit(&data_fd, memory_order_acquire);
+    int expected = -1;
+
+    if (fd != -1)
+    {
+        return fd;
+    }
+    /* O_APPEND documents that every packet goes to the end */
+    fd = open(AESD_DATA_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd == -1)
+    {
+        aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "open failed");
+        return -1;
+    }
+    /* Threads of the engine may open it at the same time, the first descriptor published is kept */
+    if (!atomic_compare_exchange_strong_explicit(&data_fd, &expected, fd, memory_order_acq_rel, memory_order_acquire))
+    {
+        close(fd);
+        fd = expected;
+    }
+    return fd;
+}
+#endif
+
+/*
+ * Parse a "<prefix>N" packet that switches a session setting, such as "AESDSOCKET_DELTA:1".
+ * Returns 1 and sets value to N if the packet is exactly "<prefix>0\n" or "<prefix>1\n",
+ * 0 for anything else, which is stored as data.
+ */
+static int parse_switch(const char *packet, size_t packet_length, const char *prefix, size_t prefix_len, int *value)
+{
+    if (packet_length != prefix_len + 2 || memcmp(packet, prefix, prefix_len) != 0 ||
+        (packet[prefix_len] != '0' && packet[prefix_len] != '1') || packet[prefix_len + 1] != '\n')
+    {
+        return 0;
+    }
+    *value = packet[prefix_len] == '1';
+    return 1;
+}
+
+/* Append a complete packet to the data file, without any lock shared between clients */
+static void append_packet(const char *packet, size_t packet_length)
+{
+#if USE_AESD_CHAR_DEVICE == 1
+    /* The driver serializes writers, a single write keeps the packet in one piece */
+    if (write(device_write_fd(), packet, packet_length) != (ssize_t)packet_length)
+    {
+        aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "write failed");
+    }
+#else
+    if (aesd_append_log_append(&data_log, packet, packet_length) != 0)
+    {
+        aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "write failed");
+    }
+#endif
+}
+
+/* Second of the monotonic clock, precise enough for idle timeouts */
+static time_t monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/* Record traffic of the session, if idle connections are reaped */
+static void session_touch(session_t *session)
+{
+    if (idle_timeout > 0)
+    {
+        atomic_store_explicit(&session->last_active, monotonic_seconds(), memory_order_relaxed);
+    }
+}
+
+/* Returns 1 if, as of the second now, the session exceeded the idle timeout or the read timeout of a packet */
+static int session_expired(session_t *session, time_t now)
+{
+    time_t partial_since = atomic_load_explicit(&session->partial_since, memory_order_relaxed);
+
+    if (idle_timeout > 0 && now - atomic_load_explicit(&session->last_active, memory_order_relaxed) >= idle_timeout)
+    {
+        return 1;
+    }
+    return read_timeout > 0 && partial_since != 0 && now - partial_since >= read_timeout;
+}
+
+/*
+ * Check what is left in rx once it holds no complete packet: an unfinished packet starts the read timeout,
+ * and one over max_packet_size ends the connection.
+ * Returns 0 to keep the connection, -1 when it should be closed.
+ */
+static int session_partial(session_t *session, const struct aesd_recv_buf *rx)
+{
+    size_t pending = rx->end - rx->start;
+    struct aesd_bin_header header;
+
+    /* A binary frame announces its length, one over the limit is refused before it arrives */
+    if (session->binary && pending >= AESD_BIN_HEADER_SIZE)
+    {
+        aesd_bin_decode_header(rx->data + rx->start, &header);
+        pending = AESD_BIN_HEADER_SIZE + (size_t)header.length;
+    }
+    if (max_packet_size > 0 && pending > max_packet_size)
+    {
+        aesd_metrics_add(AESD_METRIC_PACKETS_OVERSIZED, 1);
+        aesd_log(AESD_LOG_IO_ERROR, LOG_WARNING, "Packet over %zu bytes, closing the connection", max_packet_size);
+        return -1;
+    }
+    if (read_timeout > 0 && pending > 0 && atomic_load_explicit(&session->partial_since, memory_order_relaxed) == 0)
+    {
+        atomic_store_explicit(&session->partial_since, monotonic_seconds(), memory_order_relaxed);
+    }
+    return 0;
+}
+
+/* Take the next complete packet of the session off rx: a binary frame, or a newline terminated text packet */
+static const char *session_next_packet(session_t *session, struct aesd_recv_buf *rx, size_t *packet_length)
+{
+    if (session->binary)
+    {
+        return aesd_recv_buf_next_frame(rx, packet_length);
+    }
+    return aesd_recv_buf_next_packet(rx, packet_length);
+}
+
+/* Data of a data packet: the whole text packet, or the payload of a binary APPEND frame */
+static const char *packet_data(const session_t *session, const char *packet, size_t *length)
+{
+    if (session->binary)
+    {
+        *length -= AESD_BIN_HEADER_SIZE;
+        return packet + AESD_BIN_HEADER_SIZE;
+    }
+    return packet;
+}
+
+/*
+ * Count a new client against max_connections, turning it away with a short error once the limit is reached.
+ * Returns 0 if the client is admitted, -1 if its descriptor was closed.
+ */
+static int connection_admit(int client_fd)
+{
+    static const char busy[] = "ERROR: too many connections\n";
+
+    if (max_connections > 0 && atomic_load_explicit(&open_connections, memory_order_relaxed) >= max_connections)
+    {
+        /* Best effort, a client that cannot take the message still sees the connection close */
+        send(client_fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(client_fd);
+        aesd_metrics_add(AESD_METRIC_CONNECTIONS_REJECTED, 1);
+        aesd_log(AESD_LOG_ACCEPT, LOG_WARNING, "Rejected a connection, %ld are open", max_connections);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&open_connections, 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Set up the receives of a client that connected through an address of the given family.  A SOCK_SEQPACKET
+ * receive drops whatever part of a message does not fit, so its clients get room for a whole message, and
+ * MSG_TRUNC makes the receive return the full length of a message that still did not fit.
+ */
+static void session_transport(session_t *session, sa_family_t family)
+{
+    if (family == AF_UNIX && local_type == SOCK_SEQPACKET)
+    {
+        session->recv_flags = MSG_TRUNC;
+        session->recv_space = LOCAL_MESSAGE_MAX;
+    }
+}
+
+/*
+ * Check a receive of received bytes into space bytes for a truncated SOCK_SEQPACKET message.
+ * Returns 0 to keep the connection, -1 when it should be closed.
+ */
+static int session_truncated(session_t *session, ssize_t received, size_t space)
+{
+    if ((session->recv_flags & MSG_TRUNC) && received > (ssize_t)space)
+    {
+        aesd_metrics_add(AESD_METRIC_PACKETS_OVERSIZED, 1);
+        aesd_log(AESD_LOG_IO_ERROR, LOG_WARNING, "Message over %zu bytes, closing the connection", space);
+        return -1;
+    }
+    return 0;
+}
+
+/* Give back the place of a client admitted by connection_admit */
+static void connection_release(void)
+{
+    atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+}
+
+/* Reset the protocol state of a new client */
+static void session_init(session_t *session)
+{
+    memset(session, 0, sizeof(*session));
+    session_touch(session);
+    session->recv_space = RECV_MIN_SPACE;
+    session->echo = 1;
+#if USE_AESD_CHAR_DEVICE == 1
+    session->dev_fd = -1;
+#else
+    session->reply.pipe_fd[0] = -1;
+    session->reply.pipe_fd[1] = -1;
+#endif
+}
+
+/* Release the resources of the reply in progress, if any */
+static void reply_close(reply_t *reply)
+{
+#if USE_AESD_CHAR_DEVICE == 0
+    if (reply->pipe_fd[0] != -1)
+    {
+        close(reply->pipe_fd[0]);
+        close(reply->pipe_fd[1]);
+        reply->pipe_fd[0] = -1;
+        reply->pipe_fd[1] = -1;
+    }
+    reply->pipe_len = 0;
+#endif
+    free(reply->buf);
+    reply->buf = NULL;
+    reply->len = 0;
+    reply->off = 0;
+}
+
+/* Release everything a client holds once it leaves */
+static void session_close(session_t *session)
+{
+    reply_close(&session->reply);
+#if USE_AESD_CHAR_DEVICE == 1
+    if (session->dev_fd != -1)
+    {
+        close(session->dev_fd);
+        session->dev_fd = -1;
+    }
+#endif
+}
+
+/* Account bytes received for the session */
+static void metrics_received(session_t *session, size_t bytes)
+{
+    aesd_metrics_add(AESD_METRIC_BYTES_RECEIVED, bytes);
+    session->recv_ns = aesd_metrics_now();
+}
+
+/* Account a packet taken off the receive buffer, it now waits to be written */
+static void metrics_framed(session_t *session)
+{
+    uint64_t now = aesd_metrics_now();
+
+    aesd_metrics_add(AESD_METRIC_PACKETS, 1);
+    aesd_metrics_stage(AESD_STAGE_FRAME, session->recv_ns, now);
+    session->stage_ns = now;
+}
+
+/* A packet was taken off the receive buffer, so none is unfinished for now */
+static void session_framed(session_t *session)
+{
+    metrics_framed(session);
+    if (read_timeout > 0)
+    {
+        atomic_store_explicit(&session->partial_since, 0, memory_order_relaxed);
+    }
+}
+
+/* Account the end of a stage of the session's packet in progress */
+static void metrics_stage_done(session_t *session, enum aesd_stage stage)
+{
+    uint64_t now = aesd_metrics_now();
+
+    aesd_metrics_stage(stage, session->stage_ns, now);
+    session->stage_ns = now;
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
+/* Open the session's read side of the device unless it is open already. Returns 0 on success. */
+static int session_open_device(session_t *session)
+{
+    if (session->dev_fd == -1)
+    {
+        session->dev_fd = open(AESD_DATA_FILE, O_RDONLY | O_CLOEXEC);
+        if (session->dev_fd == -1)
+        {
+            aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "open failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start a reply from the session's descriptor of the device, at the position set by the ioctl
+ * if seekto is not NULL and at the start otherwise. Returns 1 on success.
+ */
+static int reply_open(session_t *session, const struct aesd_seekto *seekto)
+{
+    reply_t *reply = &session->reply;
+
+    if (session_open_device(session) != 0)
+    {
+        return 0;
+    }
+    reply->fd = session->dev_fd;
+    reply->offset = 0;
+    reply->end = -1;
+    if (seekto != NULL)
+    {
+        /* The ioctl moves the file position, replies then read from there with pread */
+        if (ioctl(reply->fd, AESDCHAR_IOCSEEKTO, seekto) != 0)
+        {
+            aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "ioctl failed");
+            return 0;
+        }
+        reply->offset = lseek(reply->fd, 0, SEEK_CUR);
+        if (reply->offset == -1)
+        {
+            aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "lseek failed");
+            return 0;
+        }
+    }
+    reply->buf = malloc(REPLY_BUF_SIZE);
+    if (reply->buf == NULL)
+    {
+        aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "malloc failed");
+        reply_close(reply);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Copy the next part of the reply from the device to the socket.
+ * Returns the number of bytes sent, 0 once the reply is complete, or -1 with errno set.
+ */
+static ssize_t reply_transfer(reply_t *reply, int client_fd)
+{
+    ssize_t bytes_sent;
+    ssize_t bytes_read;
+    size_t length = REPLY_BUF_SIZE;
+
+    if (reply->off == reply->len)
+    {
+        if (reply->fd == -1 || reply->offset == reply->end)
+        {
+            return 0;
+        }
+        if (reply->end != -1 && reply->end - reply->offset < (off_t)length)
+        {
+            length = reply->end - reply->offset;
+        }
+        bytes_read = pread(reply->fd, reply->buf, length, reply->offset);
+        if (bytes_read == 0 && reply->end != -1)
+        {
+            /* The driver dropped entries, the device ends before the length the reply announced */
+            errno = EIO;
+            return -1;
+        }
+        if (bytes_read <= 0)
+        {
+            return bytes_read;
+        }
+        reply->offset += bytes_read;
+        reply->len = bytes_read;
+        reply->off = 0;
+    }
+
+    bytes_sent = send(client_fd, reply->buf + reply->off, reply->len - reply->off, MSG_NOSIGNAL);
+    if (bytes_sent > 0)
+    {
+        reply->off += bytes_sent;
+    }
+    return bytes_sent;
+}
+#else
+/*
+ * Move the next part of a file-backed reply to the socket with the reply's method.
+ * Returns the number of bytes sent, 0 once the reply is complete, or -1 with errno set.
+ */
+static ssize_t reply_transfer(reply_t *reply, int client_fd)
+{
+    ssize_t bytes_moved;
+    loff_t file_offset;
+
+    /* Buffered bytes go first: a binary response header, or the chunk being copied */
+    if (reply->off < reply->len)
+    {
+        bytes_moved = send(client_fd, reply->buf + reply->off, reply->len - reply->off,
+                           MSG_NOSIGNAL | (reply->offset < reply->end ? MSG_MORE : 0));
+        if (bytes_moved > 0)
+        {
+            reply->off += bytes_moved;
+        }
+        return bytes_moved;
+    }
+
+    switch (reply->method)
+    {
+        case REPLY_SENDFILE:
+            if (reply->offset == reply->end)
+            {
+                return 0;
+            }
+            /* sendfile advances reply->offset by the number of bytes sent */
+            return sendfile(client_fd, data_log.fd, &reply->offset, reply->end - reply->offset);
+
+        case REPLY_SPLICE:
+            if (reply->pipe_len == 0)
+            {
+                if (reply->offset == reply->end)
+                {
+                    return 0;
+                }
+                if (reply->pipe_fd[0] == -1 && pipe2(reply->pipe_fd, O_NONBLOCK | O_CLOEXEC) == -1)
+                {
+                    return -1;
+                }
+                /* The pipe is empty, so this fills it without waiting for the reader */
+                file_offset = reply->offset;
+                bytes_moved = splice(data_log.fd, &file_offset, reply->pipe_fd[1], NULL,
+                                     reply->end - reply->offset, SPLICE_F_MOVE);
+                if (bytes_moved <= 0)
+                {
+                    if (bytes_moved == 0)
+                    {
+                        errno = EIO;
+                    }
+                    return -1;
+                }
+                reply->offset = file_offset;
+                reply->pipe_len = bytes_moved;
+            }
+            bytes_moved = splice(reply->pipe_fd[0], NULL, client_fd, NULL, reply->pipe_len, SPLICE_F_MOVE);
+            if (bytes_moved > 0)
+            {
+                reply->pipe_len -= bytes_moved;
+            }
+            return bytes_moved;
+
+        default:
+            if (reply->off == reply->len)
+            {
+                if (reply->offset == reply->end)
+                {
+                    return 0;
+                }
+                if (reply->buf == NULL && (reply->buf = malloc(REPLY_BUF_SIZE)) == NULL)
+                {
+                    return -1;
+                }
+                bytes_moved = pread(data_log.fd, reply->buf,
+                                    reply->end - reply->offset < REPLY_BUF_SIZE ? reply->end - reply->offset : REPLY_BUF_SIZE,
+                                    reply->offset);
+                if (bytes_moved <= 0)
+                {
+                    if (bytes_moved == 0)
+                    {
+                        errno = EIO;
+                    }
+                    return -1;
+                }
+                reply->offset += bytes_moved;
+                reply->len = bytes_moved;
+                reply->off = 0;
+            }
+            bytes_moved = send(client_fd, reply->buf + reply->off, reply->len - reply->off, MSG_NOSIGNAL);
+            if (bytes_moved > 0)
+            {
+                reply->off += bytes_moved;
+            }
+            return bytes_moved;
+    }
+}
+#endif
+
+/*
+ * Start a binary response in the reply buffer: its header announcing length payload bytes, of which the first
+ * buffered are to be written by the caller at the returned address.  The reply holds nothing else until the caller
+ * adds a part of the data file.  Returns NULL if memory is exhausted.
+ */
+static char *reply_header(reply_t *reply, uint8_t opcode, uint8_t status, size_t length, size_t buffered)
+{
+    size_t size = AESD_BIN_HEADER_SIZE + buffered;
+
+    free(reply->buf);
+    /* Copied file replies reuse the buffer for their chunks */
+    reply->buf = malloc(size < REPLY_BUF_SIZE ? REPLY_BUF_SIZE : size);
+    if (reply->buf == NULL)
+    {
+        aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "malloc failed");
+        return NULL;
+    }
+    aesd_bin_encode_header(reply->buf, opcode, status, length);
+    reply->len = size;
+    reply->off = 0;
+#if USE_AESD_CHAR_DEVICE == 1
+    reply->fd = -1;
+    reply->offset = 0;
+    reply->end = -1;
+#else
+    reply->offset = 0;
+    reply->end = 0;
+    reply->method = reply_method;
+#endif
+    return reply->buf + AESD_BIN_HEADER_SIZE;
+}
+
+/* Start a binary response without payload. Returns 1 if there is a reply to send. */
+static int reply_status(session_t *session, uint8_t opcode, uint8_t status)
+{
+    return reply_header(&session->reply, opcode, status, 0, 0) != NULL;
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
+/*
+ * Start a binary response with at most length bytes of the device from offset, or from the position the ioctl sets
+ * if seekto is not NULL.  The header announces the length up to where the device ended when the response started,
+ * and the data is streamed through the reply buffer like a record slice, so its size does not matter.  If the driver
+ * drops entries until the device ends before that, the transfer fails rather than send a short body.
+ * Returns 1 if there is a reply to send.
+ */
+static int reply_device_range(session_t *session, uint8_t opcode, const struct aesd_seekto *seekto,
+                              uint64_t offset, uint64_t length)
+{
+    reply_t *reply = &session->reply;
+    off_t end;
+
+    if (session_open_device(session) != 0)
+    {
+        return reply_status(session, opcode, AESD_BIN_IO_ERROR);
+    }
+    if (seekto != NULL)
+    {
+        if (ioctl(session->dev_fd, AESDCHAR_IOCSEEKTO, seekto) != 0)
+        {
+            return reply_status(session, opcode, errno == EINVAL ? AESD_BIN_OUT_OF_RANGE : AESD_BIN_IO_ERROR);
+        }
+        offset = lseek(session->dev_fd, 0, SEEK_CUR);
+    }
+    end = lseek(session->dev_fd, 0, SEEK_END);
+    if (end == -1 || (off_t)offset == -1)
+    {
+        return reply_status(session, opcode, AESD_BIN_IO_ERROR);
+    }
+    if (offset > (uint64_t)end)
+    {
+        return reply_status(session, opcode, AESD_BIN_OUT_OF_RANGE);
+    }
+    if (length > (uint64_t)end - offset)
+    {
+        length = end - offset;
+    }
+
+    if (reply_header(reply, opcode, AESD_BIN_OK, length, 0) == NULL)
+    {
+        return 0;
+    }
+    reply->fd = session->dev_fd;
+    reply->offset = offset;
+    reply->end = offset + length;
+    return 1;
+}
+
+/* Device offset record index starts at, found with the ioctl. Returns -1 if there is no such record. */
+static off_t device_record_start(session_t *session, size_t index)
+{
+    struct aesd_seekto seekto;
+
+    if (index > UINT32_MAX)
+    {
+        return -1;
+    }
+    seekto.write_cmd = index;
+    seekto.write_cmd_offset = 0;
+    if (ioctl(session->dev_fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
+    {
+        return -1;
+    }
+    return lseek(session->dev_fd, 0, SEEK_CUR);
+}
+
+/*
+ * Number of records the device holds.  The driver's entry table is the record index: the ioctl succeeds for every
+ * record there is, so the count is found with a doubling search and then a binary search over the ioctl.
+ */
+static size_t device_record_count(session_t *session)
+{
+    /* The device holds at least low records and fewer than high */
+    size_t low = 0;
+    size_t high = 1;
+    size_t mid;
+
+    while (device_record_start(session, high - 1) != -1)
+    {
+        low = high;
+        high *= 2;
+    }
+    while (low + 1 < high)
+    {
+        mid = low + (high - low) / 2;
+        if (device_record_start(session, mid - 1) != -1)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Start a text reply with count records of the device from record first, or with its last count records if tail
+ * is set.  The slice is streamed through the reply buffer like a full reply, so its size does not matter.
+ * Returns 1 if there is a reply to send.
+ */
+static int reply_records(session_t *session, size_t first, size_t count, int tail)
+{
+    reply_t *reply = &session->reply;
+    off_t start, end;
+    size_t total;
+
+    if (session_open_device(session) != 0)
+    {
+        return 0;
+    }
+    if (tail)
+    {
+        total = device_record_count(session);
+        first = total > count ? total - count : 0;
+    }
+    start = device_record_start(session, first);
+    if (start == -1 || count == 0)
+    {
+        return 0;
+    }
+    /* The slice ends where the record after it starts, or with the device when it reaches the last record */
+    end = device_record_start(session, first + count);
+    if (end == -1)
+    {
+        end = lseek(session->dev_fd, 0, SEEK_END);
+    }
+    if (end <= start)
+    {
+        return 0;
+    }
+
+    reply->buf = malloc(REPLY_BUF_SIZE);
+    if (reply->buf == NULL)
+    {
+        aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "malloc failed");
+        return 0;
+    }
+    reply->fd = session->dev_fd;
+    reply->offset = start;
+    reply->end = end;
+    reply->len = 0;
+    reply->off = 0;
+    return 1;
+}
+#else
+/*
+ * Start a text reply with count records of the data file from record first, or with its last count records if
+ * tail is set.  The record index maps them to a byte range, streamed like any file-backed reply.
+ * Returns 1 if there is a reply to send.
+ */
+static int reply_records(session_t *session, size_t first, size_t count, int tail)
+{
+    reply_t *reply = &session->reply;
+    size_t length = aesd_append_log_length(&data_log);
+    size_t start, end;
+    int rc;
+
+    if (tail)
+    {
+        rc = aesd_record_index_tail(&record_index, data_log.fd, length, count, &start, &end);
+    }
+    else
+    {
+        rc = aesd_record_index_range(&record_index, data_log.fd, length, first, count, &start, &end);
+    }
+    if (rc != 0)
+    {
+        aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "record index failed");
+        return 0;
+    }
+    if (start == end)
+    {
+        return 0;
+    }
+    reply->offset = start;
+    reply->end = end;
+    reply->method = reply_method;
+    return 1;
+}
+#endif
+
+/* Start a binary READ_RANGE response with at most length stored bytes from offset. Returns 1 if there is a reply. */
+static int reply_range(session_t *session, uint64_t offset, uint64_t length)
+{
+    /* Lengths of a response are 32 bits */
+    if (length > UINT32_MAX - AESD_BIN_HEADER_SIZE)
+    {
+        length = UINT32_MAX - AESD_BIN_HEADER_SIZE;
+    }
+#if USE_AESD_CHAR_DEVICE == 1
+    return reply_device_range(session, AESD_BIN_OP_READ_RANGE, NULL, offset, length);
+#else
+    reply_t *reply = &session->reply;
+    uint64_t end = aesd_append_log_length(&data_log);
+
+    if (offset > end)
+    {
+        return reply_status(session, AESD_BIN_OP_READ_RANGE, AESD_BIN_OUT_OF_RANGE);
+    }
+    if (length > end - offset)
+    {
+        length = end - offset;
+    }
+    if (reply_header(reply, AESD_BIN_OP_READ_RANGE, AESD_BIN_OK, length, 0) == NULL)
+    {
+        return 0;
+    }
+    /* The data goes straight from the data file after the header, like text replies */
+    reply->offset = offset;
+    reply->end = offset + length;
+    return 1;
+#endif
+}
+
+/* Start a binary STATS response. Returns 1 if there is a reply to send. */
+static int reply_stats(session_t *session)
+{
+    struct aesd_bin_stats stats;
+    char *payload;
+
+    memset(&stats, 0, sizeof(stats));
+#if USE_AESD_CHAR_DEVICE == 1
+    if (session_open_device(session) == 0)
+    {
+        off_t end = lseek(session->dev_fd, 0, SEEK_END);
+
+        stats.stored_bytes = end == -1 ? 0 : end;
+    }
+#else
+    stats.stored_bytes = aesd_append_log_length(&data_log);
+#endif
+    stats.connections_open = atomic_load_explicit(&open_connections, memory_order_relaxed);
+    stats.connections_accepted = aesd_metrics_total(AESD_METRIC_CONNECTIONS_ACCEPTED);
+    stats.packets = aesd_metrics_total(AESD_METRIC_PACKETS);
+    stats.bytes_received = aesd_metrics_total(AESD_METRIC_BYTES_RECEIVED);
+    stats.bytes_sent = aesd_metrics_total(AESD_METRIC_BYTES_SENT);
+
+    payload = reply_header(&session->reply, AESD_BIN_OP_STATS, AESD_BIN_OK, AESD_BIN_STATS_SIZE, AESD_BIN_STATS_SIZE);
+    if (payload == NULL)
+    {
+        return 0;
+    }
+    aesd_bin_encode_stats(payload, &stats);
+    return 1;
+}
+
+/*
+ * Handle a binary frame and prepare its response, every request gets one.
+ * Returns -1 if the frame is an APPEND, whose payload is data, otherwise 1 if there is a reply to send.
+ */
+static int handle_frame(session_t *session, const char *frame)
+{
+    struct aesd_bin_header header;
+    const char *payload = frame + AESD_BIN_HEADER_SIZE;
+#if USE_AESD_CHAR_DEVICE == 1
+    struct aesd_seekto seekto;
+#endif
+
+    aesd_bin_decode_header(frame, &header);
+    switch (header.opcode)
+    {
+        case AESD_BIN_OP_APPEND:
+            return -1;
+
+        case AESD_BIN_OP_SEEK_READ:
+            if (header.length != AESD_BIN_SEEK_READ_SIZE)
+            {
+                break;
+            }
+#if USE_AESD_CHAR_DEVICE == 1
+            seekto.write_cmd = aesd_bin_get_u32(payload);
+            seekto.write_cmd_offset = aesd_bin_get_u32(payload + 4);
+            return reply_device_range(session, AESD_BIN_OP_SEEK_READ, &seekto, 0, UINT32_MAX - AESD_BIN_HEADER_SIZE);
+#else
+            /* Seeking is only supported by the char device */
+            return reply_status(session, header.opcode, AESD_BIN_UNSUPPORTED);
+#endif
+
+        case AESD_BIN_OP_READ_RANGE:
+            if (header.length != AESD_BIN_READ_RANGE_SIZE)
+            {
+                break;
+            }
+            return reply_range(session, aesd_bin_get_u64(payload), aesd_bin_get_u64(payload + 8));
+
+        case AESD_BIN_OP_STATS:
+            if (header.length != 0)
+            {
+                break;
+            }
+            return reply_stats(session);
+
+        default:
+            break;
+    }
+    return reply_status(session, header.opcode, AESD_BIN_BAD_REQUEST);
+}
+
+/*
+ * Handle a packet that carries a command for the server rather than data.
+ * Returns -1 if the packet is data, otherwise 1 if there is a reply to send and 0 if not.
+ */
+static int handle_command(session_t *session, const char *packet, size_t packet_length)
+{
+    struct aesd_seekto seekto;
+    unsigned int first, count;
+    char *version;
+
+    if (session->binary)
+    {
+        return handle_frame(session, packet);
+    }
+    if (aesd_bin_parse_negotiate(packet, packet_length))
+    {
+        /* The acknowledgement is the first binary response, clients of older servers get a text reply instead */
+        session->binary = 1;
+        version = reply_header(&session->reply, AESD_BIN_OP_NEGOTIATE, AESD_BIN_OK, 4, 4);
+        if (version == NULL)
+        {
+            return 0;
+        }
+        aesd_bin_put_u32(version, AESD_BIN_VERSION);
+        return 1;
+    }
+    if (parse_switch(packet, packet_length, AESD_ECHO_PREFIX, AESD_ECHO_PREFIX_LEN, &session->echo))
+    {
+        return 0;
+    }
+    if (aesd_parse_read(packet, packet_length, &first, &count))
+    {
+        return reply_records(session, first, count, 0);
+    }
+    if (aesd_parse_tail(packet, packet_length, &count))
+    {
+        return reply_records(session, 0, count, 1);
+    }
+
+#if USE_AESD_CHAR_DEVICE == 1
+    if (aesd_parse_seekto(packet, packet_length, &seekto))
+    {
+        return reply_open(session, &seekto);
+    }
+#else
+    if (parse_switch(packet, packet_length, AESD_DELTA_PREFIX, AESD_DELTA_PREFIX_LEN, &session->delta_mode))
+    {
+        return 0;
+    }
+    if (aesd_parse_seekto(packet, packet_length, &seekto))
+    {
+        /* Seeking is only supported by the char device */
+        aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "ioctl failed");
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+/* Prepare the reply to a data packet once it is written. Returns 1 if there is a reply to send. */
+static int reply_start(session_t *session)
+{
+    if (session->binary)
+    {
+        return reply_status(session, AESD_BIN_OP_APPEND, AESD_BIN_OK);
+    }
+    if (!session->echo)
+    {
+        return 0;
+    }
+#if USE_AESD_CHAR_DEVICE == 1
+    return reply_open(session, NULL);
+#else
+    reply_t *reply = &session->reply;
+
+    /* The reply covers everything committed so far, which includes the packet */
+    reply->end = aesd_append_log_length(&data_log);
+    reply->offset = session->delta_mode ? session->replied : 0;
+    reply->method = reply_method;
+    if (reply->offset < session->replied)
+    {
+        aesd_metrics_add(AESD_METRIC_BYTES_RESENT, session->replied - reply->offset);
+    }
+    /* Only replies to data packets move the delta position, not those to READ or TAIL */
+    session->replied = reply->end;
+    return 1;
+#endif
+}
+
+/*
+ * Send the reply in progress until it is complete or the socket would block.
+ * Returns 1 when the reply is complete, 0 if the socket would block, -1 on error.
+ */
+static int reply_send(session_t *session, int client_fd)
+{
+    reply_t *reply = &session->reply;
+    ssize_t bytes_sent;
+
+    while ((bytes_sent = reply_transfer(reply, client_fd)) != 0)
+    {
+        if (bytes_sent > 0)
+        {
+            aesd_metrics_add(AESD_METRIC_BYTES_SENT, bytes_sent);
+            session_touch(session);
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+#if USE_AESD_CHAR_DEVICE == 0
+        /* The file system cannot splice, fall back to the next method for this and later replies */
+        if ((errno == EINVAL || errno == ENOSYS) && reply->method != REPLY_COPY && reply->pipe_len == 0)
+        {
+            reply->method++;
+            reply_method = reply->method;
+            continue;
+        }
+#endif
+        aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "send failed");
+        return -1;
+    }
+
+    reply_close(reply);
+    metrics_stage_done(session, AESD_STAGE_REPLY);
+    return 1;
+}
+
+#if USE_EPOLL_REACTOR == 1
+/* Set O_NONBLOCK on a file descriptor */
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Release a connection and everything it owns */
+static void connection_close(connection_t *conn)
+{
+    peer_log(AESD_LOG_CLOSE, "Closed", &conn->peer);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_CLOSED, 1);
+    connection_release();
+    LIST_REMOVE(conn, entries);
+    /* Closing the descriptor also removes it from the epoll set */
+    close(conn->client_fd);
+    session_close(&conn->session);
+    aesd_recv_buf_free(&conn->rx);
+    free(conn);
+}
+
+/*
+ * Handle the first buffered packet, if any, and prepare its reply.
+ * In file mode data packets stay buffered until the group commit of the event loop pass.
+ * Returns 1 if a packet was taken, 0 if no complete packet is buffered, and -1 if the unfinished one is over
+ * the size limit.
+ */
+static int connection_next_packet(connection_t *conn)
+{
+    size_t packet_length;
+    const char *packet = session_next_packet(&conn->session, &conn->rx, &packet_length);
+    const char *data;
+    size_t data_length;
+#if USE_AESD_CHAR_DEVICE == 0
+    commit_batch_t *commit_batch = &conn->reactor->commit_batch;
+#endif
+    int rc;
+
+    if (packet == NULL)
+    {
+        return session_partial(&conn->session, &conn->rx);
+    }
+    session_framed(&conn->session);
+
+    rc = handle_command(&conn->session, packet, packet_length);
+    if (rc < 0)
+    {
+        data_length = packet_length;
+        data = packet_data(&conn->session, packet, &data_length);
+#if USE_AESD_CHAR_DEVICE == 1
+        append_packet(data, data_length);
+        metrics_stage_done(&conn->session, AESD_STAGE_APPEND);
+        rc = reply_start(&conn->session);
+#else
+        commit_batch->conns[commit_batch->count] = conn;
+        commit_batch->iov[commit_batch->count].iov_base = (char *)data;
+        commit_batch->iov[commit_batch->count].iov_len = data_length;
+        commit_batch->count++;
+        conn->commit_len = packet_length;
+        conn->state = CONN_STATE_COMMIT;
+        return 1;
+#endif
+    }
+    if (rc)
+    {
+        conn->state = CONN_STATE_SEND;
+    }
+
+    aesd_recv_buf_consume(&conn->rx, packet_length);
+    return 1;
+}
+
+/*
+ * Drive the connection state machine until the socket would block.
+ * With edge-triggered notifications both directions must be drained before returning.
+ * Returns 0 to keep the connection, -1 when it should be closed.
+ */
+static int connection_progress(connection_t *conn)
+{
+    ssize_t bytes_received;
+    char *space;
+    size_t space_len;
+    int rc;
+
+    for (;;)
+    {
+#if USE_AESD_CHAR_DEVICE == 0
+        /* The buffer holds the packet being committed, nothing may be read until the commit */
+        if (conn->state == CONN_STATE_COMMIT)
+        {
+            return 0;
+        }
+#endif
+        if (conn->state == CONN_STATE_SEND)
+        {
+            rc = reply_send(&conn->session, conn->client_fd);
+            if (rc <= 0)
+            {
+                return rc;
+            }
+            conn->state = CONN_STATE_RECV;
+            continue;
+        }
+
+        /* Packets already buffered are answered in order before reading more */
+        rc = connection_next_packet(conn);
+        if (rc < 0)
+        {
+            return -1;
+        }
+        if (rc)
+        {
+            continue;
+        }
+
+        /* Receive straight into the buffer */
+        space = aesd_recv_buf_reserve(&conn->rx, conn->session.recv_space, &space_len);
+        if (space == NULL)
+        {
+            aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "realloc failed");
+            return -1;
+        }
+        bytes_received = recv(conn->client_fd, space, space_len, conn->session.recv_flags);
+        if (bytes_received == 0)
+        {
+            return -1;
+        }
+        if (bytes_received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (session_truncated(&conn->session, bytes_received, space_len) != 0)
+        {
+            return -1;
+        }
+        aesd_recv_buf_commit(&conn->rx, bytes_received);
+        metrics_received(&conn->session, bytes_received);
+        session_touch(&conn->session);
+    }
+}
+
+#if USE_AESD_CHAR_DEVICE == 0
+/*
+ * Write every packet of the batch with one write, then reply to each client.
+ * Replies may buffer further packets into the next batch, which is committed in turn.
+ */
+static void reactor_commit(reactor_t *reactor)
+{
+    commit_batch_t *commit_batch = &reactor->commit_batch;
+    connection_t *conns[AESD_APPEND_LOG_MAX_BATCH];
+    connection_t *conn;
+    size_t count;
+    size_t i;
+
+    /* Event loops of the per-core mode commit concurrently, the log orders their batches */
+    while (commit_batch->count > 0)
+    {
+        if (aesd_append_log_appendv(&data_log, commit_batch->iov, commit_batch->count) != 0)
+        {
+            aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "write failed");
+        }
+        count = commit_batch->count;
+        memcpy(conns, commit_batch->conns, count * sizeof(conns[0]));
+        commit_batch->count = 0;
+
+        for (i = 0; i < count; i++)
+        {
+            conn = conns[i];
+            metrics_stage_done(&conn->session, AESD_STAGE_APPEND);
+            aesd_recv_buf_consume(&conn->rx, conn->commit_len);
+            conn->state = reply_start(&conn->session) ? CONN_STATE_SEND : CONN_STATE_RECV;
+            if (connection_progress(conn) != 0)
+            {
+                connection_close(conn);
+            }
+        }
+    }
+}
+#endif
+
+/*
+ * Accept pending connections of listen_fd, the loop's own listener or the Unix domain socket, up to
+ * REACTOR_MAX_ACCEPTS, and register them with the epoll instance
+ */
+static void reactor_accept(reactor_t *reactor, int listen_fd)
+{
+    peer_addr_t client_addr;
+    socklen_t client_addr_len;
+    struct epoll_event ev;
+    connection_t *conn;
+    int client_fd;
+    int accepted;
+
+    for (accepted = 0; accepted < REACTOR_MAX_ACCEPTS; accepted++)
+    {
+        client_addr_len = sizeof(client_addr);
+        client_fd = accept4(listen_fd, &client_addr.sa, &client_addr_len,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("accept error");
+            }
+            return;
+        }
+        if (connection_admit(client_fd) != 0)
+        {
+            continue;
+        }
+
+        conn = calloc(1, sizeof(connection_t));
+        if (conn == NULL)
+        {
+            aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "malloc failed");
+            close(client_fd);
+            connection_release();
+            continue;
+        }
+        conn->client_fd = client_fd;
+        conn->state = CONN_STATE_RECV;
+        conn->reactor = reactor;
+        aesd_recv_buf_init(&conn->rx);
+        session_init(&conn->session);
+        session_transport(&conn->session, client_addr.sa.sa_family);
+        conn->peer = client_addr;
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1)
+        {
+            aesd_log(AESD_LOG_SERVER, LOG_ERR, "epoll_ctl failed");
+            close(client_fd);
+            free(conn);
+            connection_release();
+            continue;
+        }
+
+        LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+        aesd_metrics_add(AESD_METRIC_CONNECTIONS_ACCEPTED, 1);
+        peer_log(AESD_LOG_ACCEPT, "Accepted", &conn->peer);
+    }
+}
+
+/* Close every connection that exceeded the idle or the read timeout */
+static void reactor_reap(reactor_t *reactor)
+{
+    connection_t *conn;
+    connection_t *next;
+    time_t now = monotonic_seconds();
+
+    for (conn = LIST_FIRST(&reactor->conns); conn != NULL; conn = next)
+    {
+        next = LIST_NEXT(conn, entries);
+        if (session_expired(&conn->session, now))
+        {
+            aesd_metrics_add(AESD_METRIC_CONNECTIONS_TIMED_OUT, 1);
+            connection_close(conn);
+        }
+    }
+}
+
+/* Create the epoll instance of an event loop and register its listening socket and the server's eventfds */
+static int reactor_init(reactor_t *reactor, int listen_fd, int cpu)
+{
+    struct epoll_event ev;
+
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->listen_fd = listen_fd;
+    reactor->cpu = cpu;
+    LIST_INIT(&reactor->conns);
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if (set_nonblocking(listen_fd) == -1)
+    {
+        perror("fcntl");
+        close(reactor->epoll_fd);
+        return -1;
+    }
+
+    /* The listening socket is identified by a NULL data pointer, level-triggered so a bounded accept pass resumes */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        close(reactor->epoll_fd);
+        return -1;
+    }
+
+    /*
+     * The Unix domain socket is identified by a pointer to its descriptor.  Every loop of the per-core mode accepts
+     * from it, EPOLLEXCLUSIVE wakes one of them per connection rather than all.
+     */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &local_fd;
+    if (local_fd != -1 &&
+        (set_nonblocking(local_fd) == -1 || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, local_fd, &ev) == -1))
+    {
+        perror("epoll_ctl");
+        close(reactor->epoll_fd);
+        return -1;
+    }
+
+    /*
+     * The reaper job is identified by a pointer to its descriptor.  Nobody reads the eventfd, so it stays
+     * readable and every write of the job wakes each edge-triggered event loop once, whichever reacts first.
+     */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &reap_fd;
+    if (reap_fd != -1 && epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reap_fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        close(reactor->epoll_fd);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor_stop_fd;
+    if (reactor_stop_fd != -1 && epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor_stop_fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        close(reactor->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Run an event loop until a signal is caught or, in the per-core mode, until it is stopped */
+static void reactor_run(reactor_t *reactor, const sigset_t *wait_mask)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    connection_t *conn;
+    int stop = 0;
+    int reap;
+    int nfds;
+    int i;
+
+    while (!caught_signal && !stop)
+    {
+        /* Signals are only unblocked while waiting, so none is lost between the check and the wait */
+        nfds = epoll_pwait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, -1, wait_mask);
+        reap = 0;
+        if (nfds == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("epoll_wait");
+                break;
+            }
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++)
+        {
+            conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                reactor_accept(reactor, reactor->listen_fd);
+            }
+            else if ((void *)conn == &local_fd)
+            {
+                reactor_accept(reactor, local_fd);
+            }
+            else if ((void *)conn == &reap_fd)
+            {
+                reap = 1;
+            }
+            else if ((void *)conn == &reactor_stop_fd)
+            {
+                stop = 1;
+            }
+            else if (connection_progress(conn) != 0)
+            {
+                connection_close(conn);
+            }
+#if USE_AESD_CHAR_DEVICE == 0
+            if (reactor->commit_batch.count >= batch_size)
+            {
+                reactor_commit(reactor);
+            }
+#endif
+        }
+
+#if USE_AESD_CHAR_DEVICE == 0
+        /* Group commit, the batch never waits longer than one pass over the ready connections */
+        reactor_commit(reactor);
+#endif
+        /* Only after the commit, which may still refer to any connection */
+        if (reap)
+        {
+            reactor_reap(reactor);
+        }
+    }
+
+    /* Close all remaining connections */
+    while (!LIST_EMPTY(&reactor->conns))
+    {
+        connection_close(LIST_FIRST(&reactor->conns));
+    }
+    close(reactor->epoll_fd);
+}
+
+/* Every idle client holds a descriptor, allow as many as the hard limit permits */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Run the epoll event loop on the calling thread until a signal is caught */
+static int run_reactor(int server_fd, const sigset_t *wait_mask)
+{
+    reactor_t reactor;
+
+    raise_fd_limit();
+    if (reactor_init(&reactor, server_fd, -1) != 0)
+    {
+        return -1;
+    }
+    reactor_run(&reactor, wait_mask);
+    return 0;
+}
+
+/* Event loop thread of the per-core mode */
+static void *reactor_thread(void *arg)
+{
+    reactor_t *reactor = arg;
+    cpu_set_t cpus;
+
+    /* Pinned before serving, so the connections it allocates start out in memory local to its CPU */
+    CPU_ZERO(&cpus);
+    CPU_SET(reactor->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+        aesd_log(AESD_LOG_SERVER, LOG_WARNING, "Could not pin an event loop to CPU %d", reactor->cpu);
+    }
+    reactor_run(reactor, NULL);
+    return NULL;
+}
+
+/*
+ * Serve clients from one event loop per core until a signal is caught, each pinned to its core and accepting
+ * from a SO_REUSEPORT listener of its own, so the kernel spreads new connections over the loops.
+ * server_fd serves the first loop, the others open listeners of their own with open_listener.
+ * Returns -1 without serving if the loops cannot be set up.
+ */
+static int run_reactors(int server_fd, int count, const sigset_t *wait_mask)
+{
+    reactor_t *reactors;
+    cpu_set_t allowed;
+    int listen_fd;
+    int started = 0;
+    int cpu = 0;
+    int i;
+
+    /* One loop per CPU the process may run on, at most count of them */
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    if (count == 0 || count > CPU_COUNT(&allowed))
+    {
+        count = CPU_COUNT(&allowed);
+    }
+    reactors = calloc(count, sizeof(reactor_t));
+    reactor_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (reactors == NULL || reactor_stop_fd == -1)
+    {
+        perror("per-core event loops");
+        free(reactors);
+        return -1;
+    }
+    raise_fd_limit();
+
+    for (i = 0; i < count; i++)
+    {
+        while (!CPU_ISSET(cpu, &allowed))
+        {
+            cpu++;
+        }
+        listen_fd = i == 0 ? server_fd : open_listener(1);
+        if (listen_fd == -1 || reactor_init(&reactors[i], listen_fd, cpu) != 0)
+        {
+            if (listen_fd != -1 && listen_fd != server_fd)
+            {
+                close(listen_fd);
+            }
+            break;
+        }
+        cpu++;
+    }
+    count = i;
+
+    /* The loops inherit the blocked signals, they are stopped through reactor_stop_fd */
+    for (started = 0; started < count; started++)
+    {
+        if (pthread_create(&reactors[started].thread, NULL, reactor_thread, &reactors[started]) != 0)
+        {
+            aesd_log(AESD_LOG_SERVER, LOG_ERR, "pthread_create failed");
+            break;
+        }
+    }
+    if (started > 0)
+    {
+        aesd_log(AESD_LOG_SERVER, LOG_INFO, "Serving from %d event loops pinned to their cores", started);
+        while (!caught_signal)
+        {
+            sigsuspend(wait_mask);
+        }
+    }
+
+    eventfd_write(reactor_stop_fd, 1);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (i >= started)
+        {
+            close(reactors[i].epoll_fd);
+        }
+        if (reactors[i].listen_fd != server_fd)
+        {
+            close(reactors[i].listen_fd);
+        }
+    }
+    close(reactor_stop_fd);
+    reactor_stop_fd = -1;
+    free(reactors);
+    return started > 0 ? 0 : -1;
+}
+#else
+/*
+ * Handle one packet, writing data packets right away, and prepare the reply to it in session->reply.
+ * Returns 1 if there is a reply to send, 0 otherwise.
+ */
+static int handle_packet(session_t *session, const char *packet, size_t packet_length)
+{
+    int rc = handle_command(session, packet, packet_length);
+
+    if (rc >= 0)
+    {
+        return rc;
+    }
+    packet = packet_data(session, packet, &packet_length);
+    append_packet(packet, packet_length);
+    metrics_stage_done(session, AESD_STAGE_APPEND);
+    return reply_start(session);
+}
+
+/* Connection handling for one client, runs on a worker thread with the session set up */
+static void connection_handler(int client_fd, const peer_addr_t *peer, session_t *session)
+{
+    struct aesd_recv_buf rx;
+    ssize_t bytes_received;
+    char *space;
+    size_t space_len;
+    const char *packet;
+    size_t packet_length;
+    int rc = 0;
+
+    peer_log(AESD_LOG_ACCEPT, "Accepted", peer);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_ACCEPTED, 1);
+    aesd_recv_buf_init(&rx);
+    session_transport(session, peer->sa.sa_family);
+
+    while (rc >= 0)
+    {
+        /* Receive straight into the buffer */
+        space = aesd_recv_buf_reserve(&rx, session->recv_space, &space_len);
+        if (space == NULL)
+        {
+            aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "realloc failed");
+            break;
+        }
+        bytes_received = recv(client_fd, space, space_len, session->recv_flags);
+        if (bytes_received <= 0 || session_truncated(session, bytes_received, space_len) != 0)
+        {
+            break;
+        }
+        aesd_recv_buf_commit(&rx, bytes_received);
+        metrics_received(session, bytes_received);
+        session_touch(session);
+
+        while ((packet = session_next_packet(session, &rx, &packet_length)) != NULL)
+        {
+            session_framed(session);
+            /* The socket is blocking, so the reply is either sent completely or failed */
+            if (handle_packet(session, packet, packet_length))
+            {
+                rc = reply_send(session, client_fd);
+                if (rc < 0)
+                {
+                    reply_close(&session->reply);
+                    break;
+                }
+            }
+            aesd_recv_buf_consume(&rx, packet_length);
+        }
+        if (rc >= 0 && session_partial(session, &rx) != 0)
+        {
+            break;
+        }
+    }
+
+    aesd_recv_buf_free(&rx);
+    session_close(session);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_CLOSED, 1);
+    peer_log(AESD_LOG_CLOSE, "Closed", peer);
+}
+
+/* Worker thread function, serves queued clients one after the other until shutdown */
+void *worker_thread(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    work_item_t item;
+
+    for (;;)
+    {
+        /* Nobody looks at the session while client_fd is -1 */
+        session_init(&worker->session);
+        aesd_metrics_lock(&work_queue.lock);
+        while (work_queue.count == 0 && !work_queue.shutdown)
+        {
+            pthread_cond_wait(&work_queue.not_empty, &work_queue.lock);
+        }
+        if (work_queue.shutdown)
+        {
+            pthread_mutex_unlock(&work_queue.lock);
+            break;
+        }
+
+        /* Take the oldest client, publishing its fd so shutdown can interrupt it */
+        item = work_queue.items[work_queue.head];
+        work_queue.head = (work_queue.head + 1) % WORK_QUEUE_DEPTH;
+        work_queue.count--;
+        session_touch(&worker->session);
+        worker->client_fd = item.client_fd;
+        pthread_cond_signal(&work_queue.not_full);
+        pthread_mutex_unlock(&work_queue.lock);
+
+        connection_handler(item.client_fd, &item.peer, &worker->session);
+
+        /* Completion is just handing the worker back, there is nothing left for the acceptor to reap */
+        aesd_metrics_lock(&work_queue.lock);
+        worker->client_fd = -1;
+        pthread_mutex_unlock(&work_queue.lock);
+        close(item.client_fd);
+        connection_release();
+    }
+    return NULL;
+}
+
+/*
+ * Queue an accepted client for the worker pool.
+ * Blocks while the queue is full so that pending clients wait in the listen backlog instead.
+ * Returns 0 on success, -1 if a signal was caught while waiting.
+ */
+static int work_queue_push(int client_fd, const peer_addr_t *peer)
+{
+    struct timespec deadline;
+
+    aesd_metrics_lock(&work_queue.lock);
+    while (work_queue.count == WORK_QUEUE_DEPTH)
+    {
+        if (caught_signal)
+        {
+            pthread_mutex_unlock(&work_queue.lock);
+            return -1;
+        }
+        /* Condition variables are not woken by signals, poll the flag every 100ms */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&work_queue.not_full, &work_queue.lock, &deadline);
+    }
+
+    work_queue.items[(work_queue.head + work_queue.count) % WORK_QUEUE_DEPTH].client_fd = client_fd;
+    work_queue.items[(work_queue.head + work_queue.count) % WORK_QUEUE_DEPTH].peer = *peer;
+    work_queue.count++;
+    pthread_cond_signal(&work_queue.not_empty);
+    pthread_mutex_unlock(&work_queue.lock);
+    return 0;
+}
+
+/* Interrupt every client that exceeded the idle or the read timeout, its worker then closes it */
+static void threaded_reap(void)
+{
+    time_t now = monotonic_seconds();
+    int i;
+
+    aesd_metrics_lock(&work_queue.lock);
+    for (i = 0; i < work_queue.worker_count; i++)
+    {
+        if (work_queue.workers[i].client_fd != -1 && session_expired(&work_queue.workers[i].session, now))
+        {
+            aesd_metrics_add(AESD_METRIC_CONNECTIONS_TIMED_OUT, 1);
+            shutdown(work_queue.workers[i].client_fd, SHUT_RDWR);
+            /* Counted once, the worker has no traffic left to refresh the session with */
+            atomic_store_explicit(&work_queue.workers[i].session.last_active, now, memory_order_relaxed);
+            atomic_store_explicit(&work_queue.workers[i].session.partial_since, 0, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&work_queue.lock);
+}
+
+/* Accept a connection from listen_fd and queue it for the worker pool */
+static void threaded_accept(int listen_fd)
+{
+    peer_addr_t client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd;
+
+    client_fd = accept(listen_fd, &client_addr.sa, &client_addr_len);
+    if (client_fd == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("accept error");
+        }
+        return;
+    }
+
+    if (connection_admit(client_fd) != 0)
+    {
+        return;
+    }
+    if (work_queue_push(client_fd, &client_addr) != 0)
+    {
+        close(client_fd);
+        connection_release();
+    }
+}
+
+/* Accept connections and hand them to a pool of worker threads until a signal is caught */
+static int run_threaded(int server_fd, int num_workers)
+{
+    worker_t *workers;
+    struct pollfd listeners[2] = { { .fd = server_fd, .events = POLLIN }, { .fd = local_fd, .events = POLLIN } };
+    sigset_t block_mask;
+    sigset_t orig_mask;
+    int started;
+    int i;
+
+    workers = calloc(num_workers, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "malloc failed");
+        return -1;
+    }
+
+    /* Workers block SIGINT and SIGTERM so the signal always interrupts accept in this thread */
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+    for (started = 0; started < num_workers; started++)
+    {
+        workers[started].client_fd = -1;
+        if (pthread_create(&workers[started].thread_id, NULL, worker_thread, &workers[started]) != 0)
+        {
+            aesd_log(AESD_LOG_SERVER, LOG_ERR, "pthread_create failed");
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    pthread_mutex_lock(&work_queue.lock);
+    work_queue.workers = workers;
+    work_queue.worker_count = started;
+    pthread_mutex_unlock(&work_queue.lock);
+
+    /* Loop until a signal is caught */
+    while (!caught_signal && started > 0)
+    {
+        if (local_fd == -1)
+        {
+            threaded_accept(server_fd);
+            continue;
+        }
+
+        /* With the Unix domain socket as well, wait for either; this thread is the only one accepting */
+        if (poll(listeners, 2, -1) == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("poll");
+            }
+            continue;
+        }
+        for (i = 0; i < 2; i++)
+        {
+            if (listeners[i].revents & POLLIN)
+            {
+                threaded_accept(listeners[i].fd);
+            }
+        }
+    }
+
+    /* Request exit from all workers and interrupt the clients they are serving */
+    pthread_mutex_lock(&work_queue.lock);
+    work_queue.shutdown = 1;
+    work_queue.workers = NULL;
+    work_queue.worker_count = 0;
+    for (i = 0; i < started; i++)
+    {
+        if (workers[i].client_fd != -1)
+        {
+            shutdown(workers[i].client_fd, SHUT_RDWR);
+        }
+    }
+    pthread_cond_broadcast(&work_queue.not_empty);
+    pthread_mutex_unlock(&work_queue.lock);
+
+    /* Join all workers */
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread_id, NULL);
+    }
+
+    /* Close clients that were still waiting for a worker */
+    while (work_queue.count > 0)
+    {
+        close(work_queue.items[work_queue.head].client_fd);
+        connection_release();
+        work_queue.head = (work_queue.head + 1) % WORK_QUEUE_DEPTH;
+        work_queue.count--;
+    }
+
+    free(workers);
+    return 0;
+}
+#endif
+
+#if USE_IO_URING == 1
+/* Get a submission entry for a request of conn, or of the server itself when conn is NULL */
+static struct io_uring_sqe *uring_prep(struct aesd_uring *ring, uring_conn_t *conn, uring_op_t op)
+{
+    struct io_uring_sqe *sqe = aesd_uring_get_sqe(ring);
+
+    if (sqe == NULL)
+    {
+        aesd_log(AESD_LOG_SERVER, LOG_ERR, "io_uring submission queue full");
+        return NULL;
+    }
+    /* Connections are malloc aligned, which leaves the low bits for the request type */
+    sqe->user_data = (unsigned long)conn | op;
+    if (conn != NULL)
+    {
+        conn->inflight++;
+    }
+    return sqe;
+}
+
+/* Make room for a chain of count linked requests, so that no flush of a full queue splits it */
+static int uring_reserve_chain(struct aesd_uring *ring, unsigned count)
+{
+    if (aesd_uring_reserve(ring, count) != 0)
+    {
+        aesd_log(AESD_LOG_SERVER, LOG_ERR, "io_uring submission queue full");
+        return -1;
+    }
+    return 0;
+}
+
+/* Arm the multishot accept on a listening socket, the TCP one or the Unix domain socket */
+static int uring_arm_accept(struct aesd_uring *ring, int listen_fd)
+{
+    struct io_uring_sqe *sqe = uring_prep(ring, NULL, listen_fd == local_fd ? URING_OP_ACCEPT_LOCAL : URING_OP_ACCEPT);
+
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
+
+/* Arm the read of the reaper job's eventfd into count */
+static int uring_arm_reap(struct aesd_uring *ring, eventfd_t *count)
+{
+    struct io_uring_sqe *sqe = uring_prep(ring, NULL, URING_OP_REAP);
+
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reap_fd;
+    sqe->addr = (unsigned long)count;
+    sqe->len = sizeof(*count);
+    return 0;
+}
+
+/* Arm the multishot receive of a connection, the kernel picks a provided buffer for each completion */
+static int uring_arm_recv(struct aesd_uring *ring, uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_prep(ring, conn, URING_OP_RECV);
+
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->client_fd;
+    sqe->msg_flags = conn->session.recv_flags;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    return 0;
+}
+
+/* Descriptor replies of the connection are read from */
+static int uring_reply_fd(uring_conn_t *conn)
+{
+#if USE_AESD_CHAR_DEVICE == 1
+    return conn->session.reply.fd;
+#else
+    (void)conn;
+    return data_log.fd;
+#endif
+}
+
+/* Queue the read of the next reply chunk, after the request already queued when linked */
+static int uring_queue_read(struct aesd_uring *ring, uring_conn_t *conn)
+{
+    reply_t *reply = &conn->session.reply;
+    struct io_uring_sqe *sqe = uring_prep(ring, conn, URING_OP_READ);
+    size_t len = URING_CHUNK_SIZE;
+
+#if USE_AESD_CHAR_DEVICE == 0
+    /* Only committed data belongs to the reply */
+    if ((size_t)(reply->end - reply->offset) < len)
+#else
+    /* Record slices end before the device does */
+    if (reply->end != -1 && (size_t)(reply->end - reply->offset) < len)
+#endif
+    {
+        len = reply->end - reply->offset;
+    }
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = uring_reply_fd(conn);
+    sqe->addr = (unsigned long)conn->chunk;
+    sqe->len = len;
+    sqe->off = reply->offset;
+    return 0;
+}
+
+/*
+ * Queue the send of len bytes at buf, a chunk just read or the buffered start of a binary response, linked to the
+ * read of the following chunk unless it is the last
+ */
+static int uring_queue_send(struct aesd_uring *ring, uring_conn_t *conn, const char *buf, size_t len)
+{
+    reply_t *reply = &conn->session.reply;
+    struct io_uring_sqe *sqe;
+#if USE_AESD_CHAR_DEVICE == 0
+    int last = reply->offset == reply->end;
+#else
+    int last = reply->fd == -1 || reply->offset == reply->end;
+#endif
+
+    if (!last && uring_reserve_chain(ring, 2) != 0)
+    {
+        return -1;
+    }
+    sqe = uring_prep(ring, conn, URING_OP_SEND);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->client_fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    /* The kernel retries partial sends, a short result is an error */
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+    if (last)
+    {
+        conn->last_chunk = 1;
+        return 0;
+    }
+    /* The read reuses the chunk, so it must not start before the send completes */
+    sqe->flags = IOSQE_IO_LINK;
+    return uring_queue_read(ring, conn);
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
+/* Queue the write of a packet to the device, hard linked to the next request */
+static int uring_queue_write(struct aesd_uring *ring, uring_conn_t *conn, const char *packet, size_t packet_length)
+{
+    struct io_uring_sqe *sqe;
+
+    if (packet_length > conn->packet_size)
+    {
+        free(conn->packet);
+        conn->packet = malloc(packet_length);
+        conn->packet_size = conn->packet == NULL ? 0 : packet_length;
+        if (conn->packet == NULL)
+        {
+            return -1;
+        }
+    }
+    /* The write leads a chain of up to three: the send of a buffered binary header and the read after it */
+    if (uring_reserve_chain(ring, 3) != 0)
+    {
+        return -1;
+    }
+    sqe = uring_prep(ring, conn, URING_OP_WRITE);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    memcpy(conn->packet, packet, packet_length);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = device_write_fd();
+    sqe->addr = (unsigned long)conn->packet;
+    sqe->len = packet_length;
+    sqe->off = (unsigned long long)-1;
+    /* The reply is read even if the write fails, like with the other engines */
+    sqe->flags = IOSQE_IO_HARDLINK;
+    return 0;
+}
+#endif
+
+/* Stop serving a connection, it is freed once its last request completes */
+static void uring_conn_close(uring_conn_t *conn)
+{
+    if (!conn->closing)
+    {
+        conn->closing = 1;
+        /* Completes the armed receive and fails anything queued on the socket */
+        shutdown(conn->client_fd, SHUT_RDWR);
+    }
+}
+
+/* Free a closing connection once nothing refers to it anymore */
+static void uring_conn_release(uring_conn_t *conn)
+{
+    if (!conn->closing || conn->inflight > 0)
+    {
+        return;
+    }
+    peer_log(AESD_LOG_CLOSE, "Closed", &conn->peer);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_CLOSED, 1);
+    connection_release();
+    LIST_REMOVE(conn, entries);
+    close(conn->client_fd);
+    session_close(&conn->session);
+    aesd_recv_buf_free(&conn->rx);
+    free(conn->packet);
+    free(conn->chunk);
+    free(conn);
+}
+
+/* Finish the reply in progress */
+static void uring_reply_done(uring_conn_t *conn)
+{
+    reply_close(&conn->session.reply);
+    metrics_stage_done(&conn->session, AESD_STAGE_REPLY);
+    conn->replying = 0;
+    conn->last_chunk = 0;
+}
+
+/*
+ * Handle the buffered packets in order until one needs a reply, which is then queued.
+ * Device writes are linked to the first read of the reply so both go out in one submission.
+ */
+static void uring_next_packets(struct aesd_uring *ring, uring_conn_t *conn)
+{
+    reply_t *reply;
+    const char *packet;
+    size_t packet_length;
+    const char *data;
+    size_t data_length;
+    int rc;
+
+    while (!conn->replying && !conn->closing &&
+           (packet = session_next_packet(&conn->session, &conn->rx, &packet_length)) != NULL)
+    {
+        session_framed(&conn->session);
+        rc = handle_command(&conn->session, packet, packet_length);
+        if (rc < 0)
+        {
+            data_length = packet_length;
+            data = packet_data(&conn->session, packet, &data_length);
+#if USE_AESD_CHAR_DEVICE == 1
+            rc = reply_start(&conn->session);
+            if (!rc)
+            {
+                append_packet(data, data_length);
+                metrics_stage_done(&conn->session, AESD_STAGE_APPEND);
+            }
+            else if (uring_queue_write(ring, conn, data, data_length) != 0)
+            {
+                aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "write failed");
+                reply_close(&conn->session.reply);
+                rc = 0;
+            }
+#else
+            struct iovec iov = { (char *)data, data_length };
+
+            /* The ring thread is the only client writer here, so the write is never batched */
+            if (aesd_append_log_appendv(&data_log, &iov, 1) != 0)
+            {
+                aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "write failed");
+            }
+            metrics_stage_done(&conn->session, AESD_STAGE_APPEND);
+            rc = reply_start(&conn->session);
+#endif
+        }
+
+        aesd_recv_buf_consume(&conn->rx, packet_length);
+
+        if (rc <= 0)
+        {
+            continue;
+        }
+        conn->replying = 1;
+        reply = &conn->session.reply;
+        if (reply->off < reply->len)
+        {
+            /* A binary response starts with its buffered part, the header and maybe all of it */
+            if (uring_queue_send(ring, conn, reply->buf, reply->len) != 0)
+            {
+                uring_conn_close(conn);
+            }
+            continue;
+        }
+#if USE_AESD_CHAR_DEVICE == 0
+        if (reply->offset == reply->end)
+        {
+            uring_reply_done(conn);
+            continue;
+        }
+#endif
+        if (uring_queue_read(ring, conn) != 0)
+        {
+            uring_conn_close(conn);
+        }
+    }
+    /* Without a reply in flight the loop only stops once no complete packet is left */
+    if (!conn->replying && !conn->closing && session_partial(&conn->session, &conn->rx) != 0)
+    {
+        uring_conn_close(conn);
+    }
+}
+
+/* Close every connection that exceeded the idle or the read timeout */
+static void uring_reap(void)
+{
+    uring_conn_t *conn;
+    time_t now = monotonic_seconds();
+
+    LIST_FOREACH(conn, &uring_conns, entries)
+    {
+        if (!conn->closing && session_expired(&conn->session, now))
+        {
+            aesd_metrics_add(AESD_METRIC_CONNECTIONS_TIMED_OUT, 1);
+            uring_conn_close(conn);
+        }
+    }
+}
+
+/* Set up a connection accepted by the multishot accept of a listener of the given address family */
+static void uring_accept(struct aesd_uring *ring, int client_fd, sa_family_t family)
+{
+    socklen_t peer_len = sizeof(peer_addr_t);
+    uring_conn_t *conn;
+
+    conn = calloc(1, sizeof(uring_conn_t));
+    if (conn != NULL)
+    {
+        conn->chunk = malloc(URING_CHUNK_SIZE);
+    }
+    if (conn == NULL || conn->chunk == NULL)
+    {
+        aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "malloc failed");
+        free(conn);
+        close(client_fd);
+        connection_release();
+        return;
+    }
+    conn->client_fd = client_fd;
+    aesd_recv_buf_init(&conn->rx);
+    session_init(&conn->session);
+    session_transport(&conn->session, family);
+    conn->peer.sa.sa_family = family;
+    /* The multishot accept does not return addresses, only logging needs them */
+    if (aesd_log_enabled(LOG_INFO))
+    {
+        getpeername(client_fd, &conn->peer.sa, &peer_len);
+    }
+    LIST_INSERT_HEAD(&uring_conns, conn, entries);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_ACCEPTED, 1);
+    peer_log(AESD_LOG_ACCEPT, "Accepted", &conn->peer);
+
+    if (uring_arm_recv(ring, conn) != 0)
+    {
+        uring_conn_close(conn);
+        uring_conn_release(conn);
+    }
+}
+
+/* Dispatch one completion of a connection request */
+static void uring_complete(struct aesd_uring *ring, uring_conn_t *conn, uring_op_t op, int res, unsigned flags)
+{
+    unsigned short bid;
+
+    /* A multishot request stays in flight until its final completion */
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        conn->inflight--;
+    }
+
+    switch (op)
+    {
+        case URING_OP_RECV:
+            if (res > 0)
+            {
+                bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                metrics_received(&conn->session, res);
+                session_touch(&conn->session);
+                if (session_truncated(&conn->session, res, URING_RECV_BUF_SIZE) != 0)
+                {
+                    uring_conn_close(conn);
+                }
+                else if (!conn->closing && aesd_recv_buf_append(&conn->rx, aesd_uring_buffer(ring, bid), res) != 0)
+                {
+                    aesd_log(AESD_LOG_ALLOC_ERROR, LOG_ERR, "realloc failed");
+                    uring_conn_close(conn);
+                }
+                aesd_uring_recycle_buffer(ring, bid);
+                uring_next_packets(ring, conn);
+            }
+            else if (res == 0)
+            {
+                conn->eof = 1;
+            }
+            else if (res != -ENOBUFS)
+            {
+                uring_conn_close(conn);
+            }
+            /* The receive stops when it runs out of buffers, they are recycled by now */
+            if (!(flags & IORING_CQE_F_MORE) && !conn->closing && !conn->eof && uring_arm_recv(ring, conn) != 0)
+            {
+                uring_conn_close(conn);
+            }
+            break;
+
+        case URING_OP_WRITE:
+            if (res < 0)
+            {
+                aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "write failed");
+            }
+            metrics_stage_done(&conn->session, AESD_STAGE_APPEND);
+            break;
+
+        case URING_OP_READ:
+            if (res < 0)
+            {
+                if (res != -ECANCELED)
+                {
+                    aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "read failed");
+                }
+                uring_conn_close(conn);
+            }
+            else if (res == 0 && conn->session.reply.end != -1)
+            {
+                /* The data ends before the length the reply announced, e.g. the driver dropped entries */
+                aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "read failed");
+                uring_conn_close(conn);
+            }
+            else if (res == 0)
+            {
+                uring_reply_done(conn);
+                uring_next_packets(ring, conn);
+            }
+            else
+            {
+                conn->session.reply.offset += res;
+                if (uring_queue_send(ring, conn, conn->chunk, res) != 0)
+                {
+                    uring_conn_close(conn);
+                }
+            }
+            break;
+
+        case URING_OP_SEND:
+            if (res < 0)
             {
+                if (res != -EPIPE && res != -ECONNRESET)
+                {
+                    aesd_log(AESD_LOG_IO_ERROR, LOG_ERR, "send failed");
+                }
+                uring_conn_close(conn);
                 break;
             }
-            
-            usleep(100000);
-        }
-
-        if (caught_signal)
-        {
+            aesd_metrics_add(AESD_METRIC_BYTES_SENT, res);
+            session_touch(&conn->session);
+            if (conn->last_chunk)
+            {
+                uring_reply_done(conn);
+                uring_next_packets(ring, conn);
+            }
             break;
-        }
 
-        now = time(NULL);
-        localtime_r(&now, &tm_info);
-        strftime(time_str, sizeof(time_str), "timestamp:%a, %d %b %Y %T %z\n", &tm_info);
+        default:
+            break;
+    }
 
-        pthread_mutex_lock(&file_mutex);
-        fp = fopen(AESD_DATA_FILE, "a");
-        if (fp != NULL)
-        {
-            if (fputs(time_str, fp) == EOF)
-            {
-                syslog(LOG_ERR, "write timestamp failed");
-            }
-            fclose(fp);
-        }
-        pthread_mutex_unlock(&file_mutex);
+    if (conn->eof && !conn->replying)
+    {
+        uring_conn_close(conn);
     }
-    return NULL;
+    uring_conn_release(conn);
 }
-#endif
 
-/* Connection handling thread function */
-void *connection_handler(void *arg)
+/*
+ * Serve clients from an io_uring instance until a signal is caught.
+ * Returns -1 without serving if the kernel lacks the required io_uring features.
+ */
+static int run_uring(int server_fd, const sigset_t *wait_mask)
 {
-    thread_data_t *data = (thread_data_t *)arg;
-    int client_fd = data->client_fd;
-    char ip_str[INET_ADDRSTRLEN];
-    char recv_buf[1024];
-    char *buf = NULL;
-    size_t buf_len = 0;
-    ssize_t bytes_received;
-    char *new_buf;
-    char *newline_ptr;
-    size_t packet_length;
-    FILE *fp;
-    FILE *read_fp;
-    char send_buf[1024];
-    size_t bytes_read;
+    struct aesd_uring ring;
+    struct io_uring_cqe *cqe;
+    uring_conn_t *conn;
+    unsigned long user_data;
+    eventfd_t reap_count;
+    unsigned flags;
+    int listen_fd;
+    int res;
+    /* Server requests whose re-arm found the submission queue full, retried before the next wait */
+    int rearm_accept = 0;
+    int rearm_accept_local = 0;
+    int rearm_reap = 0;
+
+    if (aesd_uring_init(&ring, URING_ENTRIES) != 0)
+    {
+        aesd_log(AESD_LOG_SERVER, LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    if (aesd_uring_setup_buffers(&ring, URING_BUF_GROUP, URING_RECV_BUFS, URING_RECV_BUF_SIZE) != 0)
+    {
+        aesd_log(AESD_LOG_SERVER, LOG_ERR, "io_uring buffer ring failed: %s", strerror(errno));
+        aesd_uring_exit(&ring);
+        return -1;
+    }
 
-    inet_ntop(AF_INET, &data->client_addr.sin_addr, ip_str, sizeof(ip_str));
-    syslog(LOG_INFO, "Accepted connection from %s", ip_str);
+    LIST_INIT(&uring_conns);
+    if (uring_arm_accept(&ring, server_fd) != 0 || (local_fd != -1 && uring_arm_accept(&ring, local_fd) != 0) ||
+        (reap_fd != -1 && uring_arm_reap(&ring, &reap_count) != 0))
+    {
+        aesd_uring_exit(&ring);
+        return -1;
+    }
 
-    while ((bytes_received = recv(client_fd, recv_buf, sizeof(recv_buf), 0)) > 0)
+    while (!caught_signal)
     {
-        new_buf = realloc(buf, buf_len + bytes_received);
-        if (new_buf == NULL)
+        if (rearm_accept && uring_arm_accept(&ring, server_fd) == 0)
         {
-            syslog(LOG_ERR, "realloc failed");
-            if (buf) free(buf);
-            buf = NULL;
-            buf_len = 0;
-            break;
+            rearm_accept = 0;
+        }
+        if (rearm_accept_local && uring_arm_accept(&ring, local_fd) == 0)
+        {
+            rearm_accept_local = 0;
+        }
+        if (rearm_reap && uring_arm_reap(&ring, &reap_count) == 0)
+        {
+            rearm_reap = 0;
+        }
+
+        /* Signals are only unblocked while waiting, so none is lost between the check and the wait */
+        if (aesd_uring_submit_and_wait(&ring, 1, wait_mask) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("io_uring_enter");
+                break;
+            }
+            continue;
         }
-        buf = new_buf;
-        memcpy(buf + buf_len, recv_buf, bytes_received);
-        buf_len += bytes_received;
 
-        while ((newline_ptr = memchr(buf, '\n', buf_len)) != NULL)
+        while ((cqe = aesd_uring_peek_cqe(&ring)) != NULL)
         {
-            packet_length = newline_ptr - buf + 1;
-            struct aesd_seekto seekto;
-            int is_ioctl = 0;
+            user_data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            aesd_uring_cqe_seen(&ring);
 
-            if (strncmp(buf, "AESDCHAR_IOCSEEKTO:", 19) == 0)
+            conn = (uring_conn_t *)(user_data & ~(unsigned long)URING_OP_MASK);
+            if (conn != NULL)
+            {
+                uring_complete(&ring, conn, user_data & URING_OP_MASK, res, flags);
+                continue;
+            }
+            if ((user_data & URING_OP_MASK) == URING_OP_REAP)
             {
-                char *cmd_str = malloc(packet_length + 1);
-                if (cmd_str)
+                uring_reap();
+                if (uring_arm_reap(&ring, &reap_count) != 0)
                 {
-                    unsigned int cmd, offset;
-                    memcpy(cmd_str, buf, packet_length);
-                    cmd_str[packet_length] = '\0';
-                    if (sscanf(cmd_str, "AESDCHAR_IOCSEEKTO:%u,%u", &cmd, &offset) == 2)
-                    {
-                        seekto.write_cmd = cmd;
-                        seekto.write_cmd_offset = offset;
-                        is_ioctl = 1;
-                    }
-                    free(cmd_str);
+                    rearm_reap = 1;
                 }
+                continue;
             }
 
-            if (is_ioctl)
+            listen_fd = (user_data & URING_OP_MASK) == URING_OP_ACCEPT_LOCAL ? local_fd : server_fd;
+            if (res >= 0)
             {
-                fp = fopen(AESD_DATA_FILE, "r");
-                if (fp != NULL)
+                if (connection_admit(res) == 0)
                 {
-                    if (ioctl(fileno(fp), AESDCHAR_IOCSEEKTO, &seekto) != 0)
-                    {
-                        syslog(LOG_ERR, "ioctl failed");
-                    }
-                    else
-                    {
-                        while ((bytes_read = fread(send_buf, 1, sizeof(send_buf), fp)) > 0)
-                        {
-                            if (send(client_fd, send_buf, bytes_read, 0) == -1)
-                            {
-                                syslog(LOG_ERR, "send failed");
-                                break;
-                            }
-                        }
-                    }
-                    fclose(fp);
+                    uring_accept(&ring, res, listen_fd == local_fd ? AF_UNIX : AF_UNSPEC);
                 }
             }
-            else
+            else if (res != -EINTR && res != -ECONNABORTED)
+            {
+                aesd_log(AESD_LOG_SERVER, LOG_ERR, "accept failed: %s", strerror(-res));
+            }
+            if (!(flags & IORING_CQE_F_MORE) && uring_arm_accept(&ring, listen_fd) != 0)
             {
-                pthread_mutex_lock(&file_mutex);
-                fp = fopen(AESD_DATA_FILE, "a");
-                if (fp != NULL)
+                /* A full queue only delays new connections, it does not stop the server */
+                if (listen_fd == local_fd)
                 {
-                    if (fwrite(buf, 1, packet_length, fp) != packet_length)
-                    {
-                        syslog(LOG_ERR, "fwrite failed");
-                    }
-                    fclose(fp);
+                    rearm_accept_local = 1;
                 }
-                pthread_mutex_unlock(&file_mutex);
-
-                read_fp = fopen(AESD_DATA_FILE, "r");
-                if (read_fp != NULL)
+                else
                 {
-                    while ((bytes_read = fread(send_buf, 1, sizeof(send_buf), read_fp)) > 0)
-                    {
-                        if (send(client_fd, send_buf, bytes_read, 0) == -1)
-                        {
-                            syslog(LOG_ERR, "send failed");
-                            break;
-                        }
-                    }
-                    fclose(read_fp);
+                    rearm_accept = 1;
                 }
             }
-
-            memmove(buf, newline_ptr + 1, buf_len - packet_length);
-            buf_len -= packet_length;
         }
     }
 
-    if (buf)
+    /* Tearing down the ring cancels every request, so the connections can go right away */
+    aesd_uring_exit(&ring);
+    while (!LIST_EMPTY(&uring_conns))
     {
-        free(buf);
+        conn = LIST_FIRST(&uring_conns);
+        conn->closing = 1;
+        conn->inflight = 0;
+        uring_conn_release(conn);
     }
-    syslog(LOG_INFO, "Closed connection from %s", ip_str);
-    close(client_fd);
-    data->thread_complete = 1;
-    return NULL;
+    return 0;
+}
+#endif
+
+#if USE_AESD_CHAR_DEVICE == 0
+/* Timer job: append a timestamp packet to the data file */
+static void timestamp_job(void *arg)
+{
+    time_t now;
+    struct tm tm_info;
+    char time_str[128];
+
+    (void)arg;
+    now = time(NULL);
+    localtime_r(&now, &tm_info);
+    strftime(time_str, sizeof(time_str), "timestamp:%a, %d %b %Y %T %z\n", &tm_info);
+
+    append_packet(time_str, strlen(time_str));
+}
+#endif
+
+/* Timer job: log a summary of the metrics */
+static void metrics_job(void *arg)
+{
+    char summary[AESD_LOG_MSG_SIZE];
+
+    (void)arg;
+    aesd_metrics_summary(summary, sizeof(summary));
+    aesd_log(AESD_LOG_SERVER, LOG_INFO, "Metrics: %s", summary);
+}
+
+/* Timer job: have whichever engine is serving close its expired connections */
+static void reap_job(void *arg)
+{
+    (void)arg;
+#if USE_EPOLL_REACTOR == 0
+    threaded_reap();
+#endif
+    /* Event loops reap on their own thread, which owns the connections */
+    eventfd_write(reap_fd, 1);
+}
+
+/* Register the periodic jobs with the scheduler and start it */
+static int start_timer_jobs(long metrics_interval)
+{
+    long timeout;
+
+#if USE_AESD_CHAR_DEVICE == 0
+    if (aesd_timer_add(TIMESTAMP_INTERVAL_MS, timestamp_job, NULL) != 0)
+    {
+        return -1;
+    }
+#endif
+    if (metrics_interval > 0 && aesd_timer_add(metrics_interval * 1000, metrics_job, NULL) != 0)
+    {
+        return -1;
+    }
+    if (idle_timeout > 0 || read_timeout > 0)
+    {
+        reap_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        /* Checking twice per timeout closes a connection within 1.5 timeouts */
+        timeout = idle_timeout;
+        if (timeout == 0 || (read_timeout > 0 && read_timeout < timeout))
+        {
+            timeout = read_timeout;
+        }
+        if (reap_fd == -1 || aesd_timer_add(timeout * 500, reap_job, NULL) != 0)
+        {
+            return -1;
+        }
+    }
+    return aesd_timer_start();
+}
+
+/* Print command line usage */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d] [-u] [-A cores] [-t threads] [-b packets] [-l usec] [-m port|path] [-L level] [-s sec]\n"
+                    "       [-a address] [-p port] [-B backlog] [-U path] [-S] [-c connections] [-i sec] [-r sec] [-P bytes]\n", prog);
+    fprintf(stderr, "  -d          run as a daemon\n");
+    fprintf(stderr, "  -u          serve clients with the io_uring engine, falls back to the built-in one if unsupported\n");
+    fprintf(stderr, "  -A cores    serve from an event loop pinned to each of this many cores, 0 for all, with a\n"
+                    "              SO_REUSEPORT listener each\n");
+    fprintf(stderr, "  -t threads  worker threads of the threaded engine (default %d, not the number of cores).  A client\n"
+                    "              keeps its worker until it disconnects, so at most this many are served at once and\n"
+                    "              later ones wait, even while the served ones are idle\n",
+            WORKER_THREADS_DEFAULT);
+    fprintf(stderr, "  -b packets  most packets written to the data file at once, 1 disables group commit (default %d, max %d)\n",
+            BATCH_SIZE_DEFAULT, AESD_APPEND_LOG_MAX_BATCH);
+    fprintf(stderr, "  -l usec     longest a threaded client waits for others to join its write (default %d)\n",
+            BATCH_LATENCY_US_DEFAULT);
+    fprintf(stderr, "  -m port     serve Prometheus metrics on 127.0.0.1:port, or on a Unix socket if given a path\n");
+    fprintf(stderr, "  -L level    least severe syslog priority logged, a name like warning or 0-7 (default info)\n");
+    fprintf(stderr, "  -s sec      log a summary of the metrics every sec seconds\n");
+    fprintf(stderr, "  -a address  IPv6 or IPv4 address to listen on (default every address of both)\n");
+    fprintf(stderr, "  -p port     port to listen on (default 9000)\n");
+    fprintf(stderr, "  -B backlog  connections the kernel queues until they are accepted (default %d)\n", SOMAXCONN);
+    fprintf(stderr, "  -U path     also listen on a Unix domain socket, for clients on the same host\n");
+    fprintf(stderr, "  -S          make the -U socket SOCK_SEQPACKET, each message at most %d bytes\n", LOCAL_MESSAGE_MAX);
+    fprintf(stderr, "  -c conns    most clients served at once, further ones get an error and are closed\n");
+    fprintf(stderr, "  -i sec      close connections without traffic for sec seconds\n");
+    fprintf(stderr, "  -r sec      close connections that take more than sec seconds to finish a packet\n");
+    fprintf(stderr, "  -P bytes    close connections sending a packet longer than this\n");
 }
 
 int main(int argc, char *argv[])
 {
     int server_fd;
-    struct sockaddr_in server_addr;    
     struct sigaction sa;
-#if USE_AESD_CHAR_DEVICE == 0
-    pthread_t timer_thread;
+    sigset_t block_mask;
+    sigset_t wait_mask;
+    int daemon_mode = 0;
+    long num_workers = WORKER_THREADS_DEFAULT;
+    long max_batch = BATCH_SIZE_DEFAULT;
+    long max_batch_latency_us = BATCH_LATENCY_US_DEFAULT;
+    const char *metrics_address = NULL;
+    long metrics_interval = 0;
+    long backlog;
+    long port;
+    char *end;
+    /* Pinned event loops of the per-core mode, 0 for one per core, -1 for a single loop on the main thread */
+    long reactors = -1;
+    long long packet_limit;
+    int use_uring = 0;
+    int served = 0;
+    int opt;
+
+    /* Parse command line options */
+    while ((opt = getopt(argc, argv, "duA:t:b:l:m:L:s:a:p:B:U:Sc:i:r:P:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'u':
+#if USE_IO_URING == 0
+                fprintf(stderr, "Built without io_uring support\n");
+                return -1;
 #endif
-    thread_data_t *entry = NULL;
-    thread_data_t *cur;
-    thread_data_t *prev;    
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len;
+                use_uring = 1;
+                break;
+            case 'A':
+#if USE_EPOLL_REACTOR == 0
+                fprintf(stderr, "Per-core event loops need the epoll reactor\n");
+                return -1;
+#endif
+                reactors = strtol(optarg, NULL, 10);
+                if (reactors < 0 || reactors > CPU_SETSIZE)
+                {
+                    fprintf(stderr, "Invalid number of event loops: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                num_workers = strtol(optarg, NULL, 10);
+                if (num_workers <= 0)
+                {
+                    fprintf(stderr, "Invalid number of worker threads: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'b':
+                max_batch = strtol(optarg, NULL, 10);
+                if (max_batch <= 0 || max_batch > AESD_APPEND_LOG_MAX_BATCH)
+                {
+                    fprintf(stderr, "Invalid batch size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'l':
+                max_batch_latency_us = strtol(optarg, NULL, 10);
+                if (max_batch_latency_us < 0)
+                {
+                    fprintf(stderr, "Invalid batch latency: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                metrics_address = optarg;
+                break;
+            case 'L':
+                aesd_log_level = aesd_log_parse_level(optarg);
+                if (aesd_log_level < 0)
+                {
+                    fprintf(stderr, "Invalid log level: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                metrics_interval = strtol(optarg, NULL, 10);
+                if (metrics_interval <= 0 || metrics_interval > 86400)
+                {
+                    fprintf(stderr, "Invalid metrics interval: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'B':
+                backlog = strtol(optarg, NULL, 10);
+                if (backlog <= 0 || backlog > 65535)
+                {
+                    fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                    return -1;
+                }
+                listen_backlog = backlog;
+                break;
+            case 'a':
+                bind_address = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, &end, 10);
+                if (*end != '\0' || port <= 0 || port > 65535)
+                {
+                    fprintf(stderr, "Invalid port: %s\n", optarg);
+                    return -1;
+                }
+                bind_port = optarg;
+                break;
+            case 'U':
+                local_path = optarg;
+                break;
+            case 'S':
+                local_type = SOCK_SEQPACKET;
+                break;
+            case 'c':
+                max_connections = strtol(optarg, NULL, 10);
+                if (max_connections <= 0)
+                {
+                    fprintf(stderr, "Invalid connection limit: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'i':
+                idle_timeout = strtol(optarg, NULL, 10);
+                if (idle_timeout <= 0 || idle_timeout > 86400)
+                {
+                    fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'r':
+                read_timeout = strtol(optarg, NULL, 10);
+                if (read_timeout <= 0 || read_timeout > 86400)
+                {
+                    fprintf(stderr, "Invalid read timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'P':
+                packet_limit = strtoll(optarg, NULL, 10);
+                if (packet_limit <= 0)
+                {
+                    fprintf(stderr, "Invalid packet size limit: %s\n", optarg);
+                    return -1;
+                }
+                max_packet_size = packet_limit;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (use_uring && reactors >= 0)
+    {
+        fprintf(stderr, "The io_uring engine has no per-core mode\n");
+        return -1;
+    }
+    if (local_type == SOCK_SEQPACKET && local_path == NULL)
+    {
+        fprintf(stderr, "-S needs a Unix domain socket path with -U\n");
+        return -1;
+    }
 
     /* Open the system log */
     openlog("aesdsocket", LOG_PID, LOG_USER);
-    
+
     /* Initialize signal action structure to zero */
     memset(&sa, 0, sizeof(sa));
 
@@ -260,7 +3292,7 @@ int main(int argc, char *argv[])
         perror("sigaction");
         return -1;
     }
-    
+
     /* Register signal handler for SIGTERM */
     if (sigaction(SIGTERM, &sa, NULL) != 0)
     {
@@ -268,50 +3300,24 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    /* Create a stream socket */
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    /* Create the listening socket, with SO_REUSEPORT so the per-core event loops can add theirs */
+    server_fd = open_listener(reactors >= 0);
     if (server_fd == -1)
     {
-        perror("socket");
-        return -1;
-    }
-
-    /* Set SO_REUSEADDR socket option to reuse address to allow restarting server immediately */
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
-    {
-        perror("setsockopt");
-        close(server_fd);
-        return -1;
-    }
-
-    /* Clear the server address structure */
-    memset(&server_addr, 0, sizeof(server_addr));
-    /* Set address family to AF_INET (IPv4) */
-    server_addr.sin_family = AF_INET;
-    /* Accept connections from any IP address */
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    /* Set port number to 9000, converted to network byte order */
-    server_addr.sin_port = htons(9000);
-
-    /* Bind the socket to the specified address and port 9000 */
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
-    {
-        perror("bind");
-        close(server_fd);
         return -1;
     }
-
-    /* Start listening for connections with a backlog of 1 to allow 1 client at a time */
-    if (listen(server_fd, 1) == -1)
+    if (local_path != NULL)
     {
-        perror("listen");
-        close(server_fd);
-        return -1;
+        local_fd = open_local_listener();
+        if (local_fd == -1)
+        {
+            close(server_fd);
+            return -1;
+        }
     }
 
     /* Check for daemon mode argument */
-    if (argc > 1 && strcmp(argv[1], "-d") == 0)
+    if (daemon_mode)
     {
         pid_t pid = fork();
         if (pid < 0)
@@ -342,14 +3348,14 @@ int main(int argc, char *argv[])
         close(STDIN_FILENO);       /* Close FD 0 */
         close(STDOUT_FILENO);      /* Close FD 1 */
         close(STDERR_FILENO);      /* Close FD 2 */
-        
+
         /* Open /dev/null. Since 0 is free, it gets FD 0. */
         if (open("/dev/null", O_RDWR) == -1)
         {
             syslog(LOG_ERR, "open /dev/null failed");
             exit(EXIT_FAILURE);
         }
-        
+
         /* Duplicates FD 0. Since 1 is free, it gets FD 1. */
         if (dup(0) == -1)
         {
@@ -367,123 +3373,128 @@ int main(int argc, char *argv[])
         /* This ensures that future sockets and files get unique descriptors starting from 3 */
     }
 
-    printf("Server listening on port 9000\n");
-
-    /* Initialize list head */
-    SLIST_INIT(&head);
+    printf("Server listening on %s port %s\n", bind_address != NULL ? bind_address : "every address", bind_port);
+    if (local_fd != -1)
+    {
+        printf("Server listening on %s\n", local_bound_path);
+    }
 
-    /* Start timestamp thread */
 #if USE_AESD_CHAR_DEVICE == 0
-    if (pthread_create(&timer_thread, NULL, timestamp_thread, NULL) != 0)
+    /* Open the data file for replies, data left by a previous run is part of the history */
+    if (aesd_append_log_open(&data_log, AESD_DATA_FILE) != 0)
     {
-        syslog(LOG_ERR, "Failed to create timestamp thread");
+        syslog(LOG_ERR, "Failed to open %s", AESD_DATA_FILE);
+        close_local_listener();
         close(server_fd);
         return -1;
     }
+    aesd_record_index_init(&record_index);
+    batch_size = max_batch;
+#if USE_EPOLL_REACTOR == 0
+    /* Worker threads write concurrently, so they batch inside the log; the reactor batches per pass */
+    aesd_append_log_set_batching(&data_log, batch_size, max_batch_latency_us);
+#endif
 #endif
 
-    /* Loop until a signal is caught */
-    while (!caught_signal)
+    /* Block SIGINT and SIGTERM while starting helper threads, so only the serving thread is interrupted */
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &block_mask, &wait_mask) != 0)
     {
-        client_addr_len = sizeof(client_addr);
-        
-        /* Accept a new connection */
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_fd == -1)
-        {
-            if (errno != EINTR)
-            {
-                perror("accept error");
-            }
-            continue;
-        }
-        
-        /* Create thread data */
-        thread_data_t *new_thread = malloc(sizeof(thread_data_t));
-        if (new_thread == NULL)
-        {
-            syslog(LOG_ERR, "malloc failed");
-            close(client_fd);
-            continue;
-        }
-        new_thread->client_fd = client_fd;
-        new_thread->client_addr = client_addr;
-        new_thread->thread_complete = 0;
+        perror("sigprocmask");
+        close_local_listener();
+        close(server_fd);
+        return -1;
+    }
 
-        /* Insert into list */
-        SLIST_INSERT_HEAD(&head, new_thread, entries);
+    /* Hand syslog writes to a background thread, serving threads only queue their messages */
+    if (aesd_log_start() != 0)
+    {
+        syslog(LOG_ERR, "Failed to start the log thread, logging synchronously");
+    }
+
+    /* Serve metrics from a thread of their own, with the signals blocked like the other helpers */
+    if (metrics_address != NULL && aesd_metrics_server_start(metrics_address) != 0)
+    {
+        perror("metrics endpoint");
+        aesd_log_stop();
+        close_local_listener();
+        close(server_fd);
+        return -1;
+    }
+
+    /* Periodic jobs share one thread that only wakes up when one of them is due */
+    if (start_timer_jobs(metrics_interval) != 0)
+    {
+        syslog(LOG_ERR, "Failed to start the timer jobs: %s", strerror(errno));
+        aesd_timer_stop();
+        aesd_metrics_server_stop();
+        aesd_log_stop();
+        close_local_listener();
+        close(server_fd);
+        return -1;
+    }
 
-        /* Create thread */
-        if (pthread_create(&new_thread->thread_id, NULL, connection_handler, (void *)new_thread) != 0)
+    /* Serve clients until a signal is caught */
+#if USE_IO_URING == 1
+    if (use_uring)
+    {
+        served = run_uring(server_fd, &wait_mask) == 0;
+        if (!served)
         {
-            syslog(LOG_ERR, "pthread_create failed");
-            close(client_fd);
-            SLIST_REMOVE(&head, new_thread, thread_data_s, entries);
-            free(new_thread);
-            continue;
+            fprintf(stderr, "io_uring unavailable, using the built-in engine\n");
+        }
+    }
+#else
+    (void)use_uring;
+#endif
+    if (!served)
+    {
+#if USE_EPOLL_REACTOR == 1
+        (void)num_workers;
+        if (reactors >= 0)
+        {
+            run_reactors(server_fd, reactors, &wait_mask);
         }
-        
-        /* Cleanup completed threads */
-        cur = SLIST_FIRST(&head);
-        prev = NULL;
-        while (cur != NULL)
+        else
         {
-            if (cur->thread_complete)
-            {
-                pthread_join(cur->thread_id, NULL);
-                if (prev == NULL)
-                {
-                    SLIST_REMOVE_HEAD(&head, entries);
-                    free(cur);
-                    cur = SLIST_FIRST(&head);
-                }
-                else
-                {
-                    SLIST_REMOVE(&head, cur, thread_data_s, entries);
-                    free(cur);
-                    cur = SLIST_NEXT(prev, entries);
-                }
-            }
-            else
-            {
-                prev = cur;
-                cur = SLIST_NEXT(cur, entries);
-            }
+            run_reactor(server_fd, &wait_mask);
         }
+#else
+        (void)reactors;
+        pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+        run_threaded(server_fd, num_workers);
+#endif
     }
 
-    /* Check if loop exited due to a signal */
     if (caught_signal)
     {
-        syslog(LOG_INFO, "Caught signal, exiting");
-        
-        /* Wait for the timestamp thread to exit */
-#if USE_AESD_CHAR_DEVICE == 0
-        pthread_join(timer_thread, NULL);
-#endif
-
-        /* Request exit from all threads */
-        SLIST_FOREACH(entry, &head, entries)
-        {
-            shutdown(entry->client_fd, SHUT_RDWR);
-        }
+        aesd_log(AESD_LOG_SERVER, LOG_INFO, "Caught signal, exiting");
+    }
 
-        /* Join all threads */
-        while (!SLIST_EMPTY(&head))
-        {
-            entry = SLIST_FIRST(&head);
-            pthread_join(entry->thread_id, NULL);
-            SLIST_REMOVE_HEAD(&head, entries);
-            free(entry);
-        }
+    /* No job may append to the data store once it is closed */
+    aesd_timer_stop();
+    if (reap_fd != -1)
+    {
+        close(reap_fd);
+    }
 
 #if USE_AESD_CHAR_DEVICE == 0
-        remove(AESD_DATA_FILE);
-#endif
+    remove(AESD_DATA_FILE);
+    aesd_append_log_close(&data_log);
+    aesd_record_index_free(&record_index);
+#else
+    if (data_fd != -1)
+    {
+        close(data_fd);
     }
+#endif
 
+    aesd_metrics_server_stop();
+    aesd_log_stop();
     closelog();
+    close_local_listener();
     close(server_fd);
-    pthread_mutex_destroy(&file_mutex);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
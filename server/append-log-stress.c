@@ -0,0 +1,233 @@
+/**
+ * @file append-log-stress.c
+ * @brief Concurrent writers against the append log of aesdsocket
+ *
+ * Starts more writer threads than a group commit batch holds, each appending numbered records
+ * of varying lengths through aesd_append_log_append, then checks the data file below the
+ * committed length: it must hold every record whose append succeeded exactly once, whole, and
+ * nothing else.  With -f the file size is limited with RLIMIT_FSIZE, so the writes that cross
+ * the limit fail with EFBIG and the records written after them must still be committed without
+ * a hole where the failed ones were reserved.  Run it under AddressSanitizer to catch writers
+ * overrunning the batch.
+ *
+ * Usage: append-log-stress [-w writers] [-n records] [-b batch] [-l latency us] [-f file size limit]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "aesd-append-log.h"
+
+#define DEFAULT_PATH "/var/tmp/aesd-append-log-stress"
+#define MAX_RECORD 512
+
+struct writer
+{
+    pthread_t thread;
+    int id;
+    /* 1 for each record whose append succeeded, then 2 once it was found in the file */
+    unsigned char *stored;
+    long failures;
+};
+
+static struct aesd_append_log log_under_test;
+static long records = 1000;
+
+/* Length of record number of writer id, from 14 bytes up to MAX_RECORD */
+static size_t record_length(int id, long number)
+{
+    return 14 + (id * 7919 + number * 104729) % (MAX_RECORD - 14);
+}
+
+/* Format the record as "iiii:nnnnnnn " padded with the last digit of the writer, ended by a newline */
+static size_t format_record(char *buf, int id, long number)
+{
+    size_t length = record_length(id, number);
+
+    snprintf(buf, MAX_RECORD, "%04d:%07ld ", id, number);
+    memset(buf + 13, '0' + id % 10, length - 14);
+    buf[length - 1] = '\n';
+    return length;
+}
+
+static void *writer_main(void *arg)
+{
+    struct writer *writer = arg;
+    char buf[MAX_RECORD];
+    size_t length;
+    long i;
+
+    for (i = 0; i < records; i++)
+    {
+        length = format_record(buf, writer->id, i);
+        if (aesd_append_log_append(&log_under_test, buf, length) == 0)
+        {
+            writer->stored[i] = 1;
+        }
+        else
+        {
+            writer->failures++;
+        }
+    }
+    return NULL;
+}
+
+/* Check the committed part of the file against the records stored, returns the number of errors */
+static long check_file(const char *path, struct writer *writers, int num_writers)
+{
+    char expected[MAX_RECORD];
+    char *data, *line, *end;
+    size_t length = aesd_append_log_length(&log_under_test);
+    long errors = 0;
+    long number;
+    int id;
+    int fd;
+    int i;
+
+    data = malloc(length + 1);
+    fd = open(path, O_RDONLY);
+    if (data == NULL || fd == -1 || pread(fd, data, length, 0) != (ssize_t)length)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    for (line = data; line < data + length; line = end + 1)
+    {
+        end = memchr(line, '\n', data + length - line);
+        if (end == NULL || sscanf(line, "%4d:%7ld ", &id, &number) != 2 || id < 0 || id >= num_writers ||
+            number < 0 || number >= records || (size_t)(end + 1 - line) != format_record(expected, id, number) ||
+            memcmp(line, expected, end + 1 - line) != 0)
+        {
+            fprintf(stderr, "offset %zd: not a record: %.30s\n", line - data, line);
+            errors++;
+            break;
+        }
+        if (writers[id].stored[number] != 1)
+        {
+            fprintf(stderr, "offset %zd: record %d:%ld %s\n", line - data, id, number,
+                    writers[id].stored[number] == 0 ? "failed but was committed" : "is committed twice");
+            errors++;
+        }
+        writers[id].stored[number] = 2;
+    }
+    for (i = 0; i < num_writers; i++)
+    {
+        for (number = 0; number < records; number++)
+        {
+            if (writers[i].stored[number] == 1)
+            {
+                fprintf(stderr, "record %d:%ld succeeded but is not committed\n", i, number);
+                errors++;
+            }
+        }
+    }
+    free(data);
+    return errors;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = DEFAULT_PATH;
+    struct writer *writers;
+    struct rlimit limit;
+    int num_writers = 4 * AESD_APPEND_LOG_MAX_BATCH;
+    long max_batch = AESD_APPEND_LOG_MAX_BATCH;
+    long latency_us = 1000;
+    long file_limit = 0;
+    long failures = 0;
+    long errors;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "w:n:b:l:f:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                num_writers = atoi(optarg);
+                break;
+            case 'n':
+                records = atol(optarg);
+                break;
+            case 'b':
+                max_batch = atol(optarg);
+                break;
+            case 'l':
+                latency_us = atol(optarg);
+                break;
+            case 'f':
+                file_limit = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w writers] [-n records] [-b batch] [-l latency us] [-f file size limit]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (num_writers <= 0 || num_writers > 9999 || records <= 0 || records > 9999999)
+    {
+        fprintf(stderr, "1 to 9999 writers of 1 to 9999999 records\n");
+        return EXIT_FAILURE;
+    }
+
+    unlink(path);
+    if (aesd_append_log_open(&log_under_test, path) != 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    aesd_append_log_set_batching(&log_under_test, max_batch, latency_us);
+    if (file_limit > 0)
+    {
+        /* Writes past the limit fail with EFBIG instead of killing the process */
+        signal(SIGXFSZ, SIG_IGN);
+        limit.rlim_cur = file_limit;
+        limit.rlim_max = RLIM_INFINITY;
+        setrlimit(RLIMIT_FSIZE, &limit);
+    }
+
+    writers = calloc(num_writers, sizeof(writers[0]));
+    for (i = 0; i < num_writers; i++)
+    {
+        writers[i].id = i;
+        writers[i].stored = calloc(records, 1);
+        if (writers[i].stored == NULL || pthread_create(&writers[i].thread, NULL, writer_main, &writers[i]) != 0)
+        {
+            fprintf(stderr, "could not start writer %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < num_writers; i++)
+    {
+        pthread_join(writers[i].thread, NULL);
+        failures += writers[i].failures;
+    }
+
+    if (file_limit > 0)
+    {
+        limit.rlim_cur = RLIM_INFINITY;
+        setrlimit(RLIMIT_FSIZE, &limit);
+    }
+    errors = check_file(path, writers, num_writers);
+    printf("%d writers, batch %ld: %ld appends, %ld failed, %zu bytes committed, %ld errors\n", num_writers,
+           max_batch, num_writers * records, failures, aesd_append_log_length(&log_under_test), errors);
+
+    aesd_append_log_close(&log_under_test);
+    unlink(path);
+    for (i = 0; i < num_writers; i++)
+    {
+        free(writers[i].stored);
+    }
+    free(writers);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,328 @@
+/**
+ * @file engine-bench.c
+ * @brief Packet rate and latency of the aesdsocket engines under concurrent clients
+ *
+ * Starts the server once per engine, connects the clients, switches them to delta replies
+ * and has each client send its packets one at a time, waiting for the reply that carries
+ * its packet before sending the next one.  Compares the worker thread engine (-t clients)
+ * against the io_uring engine (-u), so the server must be built in data file mode with the
+ * thread pool:
+ *
+ *     make CFLAGS="-O2 -DUSE_AESD_CHAR_DEVICE=0 -DUSE_EPOLL_REACTOR=0" aesdsocket bench
+ *
+ * Usage: engine-bench [-b server] [-c clients] [-n packets] [-s size]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SERVER_PORT 9000
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define DELTA_ON "AESDSOCKET_DELTA:1\n"
+
+/* Work and results of one client thread */
+typedef struct
+{
+    int id;
+    int fd;
+    int packets;
+    size_t size;
+    double *latency;
+    int failed;
+} client_t;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t sent;
+
+    while (len > 0)
+    {
+        sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Send the packets of one client, each after the reply to the previous one arrived */
+static void *client_thread(void *arg)
+{
+    client_t *client = arg;
+    size_t cap = 4 * client->size + 65536;
+    char *packet = malloc(client->size);
+    char *buf = malloc(cap);
+    size_t buf_len = 0;
+    size_t tag_len;
+    char tag[64];
+    char *match;
+    ssize_t received;
+    double start;
+    int i;
+
+    if (packet == NULL || buf == NULL)
+    {
+        client->failed = 1;
+        free(packet);
+        free(buf);
+        return NULL;
+    }
+    memset(packet, 'z', client->size);
+    packet[client->size - 1] = '\n';
+
+    for (i = 0; i < client->packets && !client->failed; i++)
+    {
+        /* A unique tag identifies our packet in replies that also carry other clients' data */
+        tag_len = snprintf(tag, sizeof(tag), "c%d-%d-", client->id, i);
+        memcpy(packet, tag, tag_len < client->size - 1 ? tag_len : client->size - 1);
+
+        start = now_seconds();
+        if (send_all(client->fd, packet, client->size) != 0)
+        {
+            client->failed = 1;
+            break;
+        }
+        for (;;)
+        {
+            match = memmem(buf, buf_len, packet, client->size);
+            if (match != NULL)
+            {
+                /* Keep what follows, it belongs to the same reply */
+                buf_len -= match + client->size - buf;
+                memmove(buf, match + client->size, buf_len);
+                break;
+            }
+            /* Only the tail can hold the start of our packet */
+            if (buf_len > client->size)
+            {
+                memmove(buf, buf + buf_len - client->size, client->size);
+                buf_len = client->size;
+            }
+            received = recv(client->fd, buf + buf_len, cap - buf_len, 0);
+            if (received <= 0)
+            {
+                client->failed = 1;
+                break;
+            }
+            buf_len += received;
+        }
+        client->latency[i] = now_seconds() - start;
+    }
+
+    free(packet);
+    free(buf);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Start the server with the given arguments and wait until it accepts connections */
+static pid_t start_server(char *const argv[])
+{
+    pid_t pid;
+    int fd;
+    int i;
+
+    unlink(DATA_FILE);
+    pid = fork();
+    if (pid == 0)
+    {
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    for (i = 0; i < 50; i++)
+    {
+        usleep(100000);
+        fd = connect_server();
+        if (fd != -1)
+        {
+            close(fd);
+            return pid;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/* Run one engine, prints packets per second and latency percentiles */
+static int run_engine(const char *name, char *const argv[], int num_clients, int packets, size_t size)
+{
+    client_t *clients = calloc(num_clients, sizeof(client_t));
+    pthread_t *threads = calloc(num_clients, sizeof(pthread_t));
+    double *latency = calloc((size_t)num_clients * packets, sizeof(double));
+    double start, elapsed;
+    size_t total = (size_t)num_clients * packets;
+    pid_t pid;
+    int failed = 0;
+    int i;
+
+    if (clients == NULL || threads == NULL || latency == NULL)
+    {
+        return -1;
+    }
+    pid = start_server(argv);
+    if (pid == -1)
+    {
+        fprintf(stderr, "%s: server did not start\n", name);
+        return -1;
+    }
+
+    for (i = 0; i < num_clients; i++)
+    {
+        clients[i].id = i;
+        clients[i].packets = packets;
+        clients[i].size = size;
+        clients[i].latency = latency + (size_t)i * packets;
+        clients[i].fd = connect_server();
+        if (clients[i].fd == -1 || send_all(clients[i].fd, DELTA_ON, strlen(DELTA_ON)) != 0)
+        {
+            fprintf(stderr, "%s: connect failed\n", name);
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return -1;
+        }
+    }
+
+    start = now_seconds();
+    for (i = 0; i < num_clients; i++)
+    {
+        pthread_create(&threads[i], NULL, client_thread, &clients[i]);
+    }
+    for (i = 0; i < num_clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+        failed |= clients[i].failed;
+        close(clients[i].fd);
+    }
+    elapsed = now_seconds() - start;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    if (failed)
+    {
+        fprintf(stderr, "%s: a client failed\n", name);
+    }
+    else
+    {
+        qsort(latency, total, sizeof(double), compare_double);
+        printf("%-10s %12.0f %10.1f %10.1f %10.1f\n", name, total / elapsed,
+               latency[total / 2] * 1e6, latency[total * 99 / 100] * 1e6, latency[total - 1] * 1e6);
+    }
+
+    free(clients);
+    free(threads);
+    free(latency);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *server = "./aesdsocket";
+    int num_clients = 8;
+    int packets = 2000;
+    size_t size = 64;
+    char threads_arg[16];
+    char *threaded_argv[4];
+    char *uring_argv[3];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                server = optarg;
+                break;
+            case 'c':
+                num_clients = atoi(optarg);
+                break;
+            case 'n':
+                packets = atoi(optarg);
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b server] [-c clients] [-n packets] [-s size]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (num_clients <= 0 || packets <= 0 || size < 16)
+    {
+        fprintf(stderr, "Need at least one client, one packet and 16 byte packets\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Every client gets a worker of its own, the thread engine never queues */
+    snprintf(threads_arg, sizeof(threads_arg), "%d", num_clients);
+    threaded_argv[0] = server;
+    threaded_argv[1] = "-t";
+    threaded_argv[2] = threads_arg;
+    threaded_argv[3] = NULL;
+    uring_argv[0] = server;
+    uring_argv[1] = "-u";
+    uring_argv[2] = NULL;
+
+    printf("%d clients x %d packets of %zu bytes\n", num_clients, packets, size);
+    printf("%-10s %12s %10s %10s %10s\n", "engine", "packets/s", "p50 us", "p99 us", "max us");
+    run_engine("threads", threaded_argv, num_clients, packets, size);
+    run_engine("io_uring", uring_argv, num_clients, packets, size);
+    return EXIT_SUCCESS;
+}
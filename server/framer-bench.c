@@ -0,0 +1,266 @@
+/**
+ * @file framer-bench.c
+ * @brief Framing throughput of the aesdsocket receive buffer in GB/s
+ *
+ * Builds a 1 MB payload of pipelined newline terminated packets, feeds it to a receive buffer
+ * in recv sized chunks and takes every complete packet off the front after each chunk, the
+ * way the engines do.  Each newline search implementation runs with the remembered scan
+ * position; "rescan" searches the whole pending data after every chunk with memchr(), which
+ * is what the framer did before it kept a scan cursor; "binary" frames the same payload as
+ * length-prefixed frames of the binary protocol, taken off by their header without a search.
+ * Also times the seekto parser.
+ *
+ * Usage: framer-bench [-r recv size] [-t seconds per run]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-binproto.h"
+#include "aesd-framer.h"
+#include "aesd-recv-buf.h"
+
+#define PAYLOAD_SIZE (1024 * 1024)
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill the payload with packets of packet_size bytes, the last one may be shorter */
+static void fill_payload(char *payload, size_t packet_size)
+{
+    size_t i;
+
+    for (i = 0; i < PAYLOAD_SIZE; i++)
+    {
+        payload[i] = 'a' + i % 26;
+        if (i % packet_size == packet_size - 1 || i == PAYLOAD_SIZE - 1)
+        {
+            payload[i] = '\n';
+        }
+    }
+}
+
+/* Fill the payload with binary frames of packet_size bytes including their header, the last one may be shorter */
+static void fill_frames(char *payload, size_t packet_size)
+{
+    size_t offset, len;
+
+    for (offset = 0; offset < PAYLOAD_SIZE; offset += len)
+    {
+        len = PAYLOAD_SIZE - offset < packet_size ? PAYLOAD_SIZE - offset : packet_size;
+        memset(payload + offset, 'a', len);
+        aesd_bin_encode_header(payload + offset, AESD_BIN_OP_APPEND, AESD_BIN_OK, len - AESD_BIN_HEADER_SIZE);
+    }
+}
+
+/* Frame the payload once, returns the number of packets found */
+static size_t frame_payload(struct aesd_recv_buf *rx, const char *payload, size_t recv_size, int rescan,
+                            int binary)
+{
+    const char *packet;
+    size_t packet_length;
+    size_t packets = 0;
+    size_t offset, len;
+
+    for (offset = 0; offset < PAYLOAD_SIZE; offset += len)
+    {
+        len = PAYLOAD_SIZE - offset < recv_size ? PAYLOAD_SIZE - offset : recv_size;
+        if (aesd_recv_buf_append(rx, payload + offset, len) != 0)
+        {
+            return 0;
+        }
+        for (;;)
+        {
+            if (rescan)
+            {
+                /* Forget what was searched, as the framer without a scan cursor did */
+                rx->scan = rx->start;
+            }
+            if (binary)
+            {
+                packet = aesd_recv_buf_next_frame(rx, &packet_length);
+            }
+            else
+            {
+                packet = aesd_recv_buf_next_packet(rx, &packet_length);
+            }
+            if (packet == NULL)
+            {
+                break;
+            }
+            packets++;
+            aesd_recv_buf_consume(rx, packet_length);
+        }
+    }
+    return packets;
+}
+
+/* Time one implementation on the payload, returns GB/s */
+static double run_framer(aesd_find_newline_fn fn, int rescan, int binary, const char *payload,
+                         size_t recv_size, double seconds, size_t expected_packets)
+{
+    struct aesd_recv_buf rx;
+    double start, elapsed;
+    size_t rounds = 0;
+
+    if (fn != NULL)
+    {
+        aesd_find_newline = fn;
+    }
+    aesd_recv_buf_init(&rx);
+    start = now_seconds();
+    do
+    {
+        if (frame_payload(&rx, payload, recv_size, rescan, binary) != expected_packets)
+        {
+            aesd_recv_buf_free(&rx);
+            return -1;
+        }
+        rounds++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+    aesd_recv_buf_free(&rx);
+    return (double)rounds * PAYLOAD_SIZE / elapsed / 1e9;
+}
+
+/* Time the seekto parser, returns millions of commands per second */
+static double run_seekto(double seconds)
+{
+    static const char command[] = "AESDCHAR_IOCSEEKTO:7,4294967295\n";
+    struct aesd_seekto seekto;
+    volatile unsigned int sink = 0;
+    double start, elapsed;
+    size_t rounds = 0;
+    int i;
+
+    start = now_seconds();
+    do
+    {
+        for (i = 0; i < 100000; i++)
+        {
+            if (!aesd_parse_seekto(command, sizeof(command) - 1, &seekto))
+            {
+                return -1;
+            }
+            sink += seekto.write_cmd_offset;
+        }
+        rounds += 100000;
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+    return rounds / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t packet_sizes[] = { 16, 64, 256, 1024, 4096, 65536, PAYLOAD_SIZE };
+    struct
+    {
+        const char *name;
+        aesd_find_newline_fn fn;
+        int rescan;
+        int binary;
+    } impls[5];
+    int num_impls = 0;
+    size_t recv_size = 4096;
+    double seconds = 0.2;
+    size_t expected_packets;
+    char *payload;
+    char *frames;
+    double gbps;
+    size_t p;
+    int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+                recv_size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r recv size] [-t seconds per run]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (recv_size == 0)
+    {
+        fprintf(stderr, "The recv size must be positive\n");
+        return EXIT_FAILURE;
+    }
+    payload = malloc(PAYLOAD_SIZE);
+    frames = malloc(PAYLOAD_SIZE);
+    if (payload == NULL || frames == NULL)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("Default newline search: %s\n", aesd_framer_impl_name());
+    memset(impls, 0, sizeof(impls));
+    impls[num_impls].name = "rescan";
+    impls[num_impls].fn = aesd_find_newline_memchr;
+    impls[num_impls++].rescan = 1;
+    impls[num_impls].name = "memchr";
+    impls[num_impls].fn = aesd_find_newline_memchr;
+    impls[num_impls++].rescan = 0;
+#ifdef AESD_FRAMER_X86
+    impls[num_impls].name = "sse2";
+    impls[num_impls].fn = aesd_find_newline_sse2;
+    impls[num_impls++].rescan = 0;
+    if (__builtin_cpu_supports("avx2"))
+    {
+        impls[num_impls].name = "avx2";
+        impls[num_impls].fn = aesd_find_newline_avx2;
+        impls[num_impls++].rescan = 0;
+    }
+#endif
+    impls[num_impls].name = "binary";
+    impls[num_impls++].binary = 1;
+
+    printf("1 MB payload in %zu byte receives, GB/s\n", recv_size);
+    printf("%-10s", "packet");
+    for (i = 0; i < num_impls; i++)
+    {
+        printf(" %10s", impls[i].name);
+    }
+    printf("\n");
+    for (p = 0; p < sizeof(packet_sizes) / sizeof(packet_sizes[0]); p++)
+    {
+        fill_payload(payload, packet_sizes[p]);
+        fill_frames(frames, packet_sizes[p]);
+        expected_packets = (PAYLOAD_SIZE + packet_sizes[p] - 1) / packet_sizes[p];
+        printf("%-10zu", packet_sizes[p]);
+        for (i = 0; i < num_impls; i++)
+        {
+            gbps = run_framer(impls[i].fn, impls[i].rescan, impls[i].binary,
+                              impls[i].binary ? frames : payload, recv_size, seconds, expected_packets);
+            if (gbps < 0)
+            {
+                printf(" %10s", "FAILED");
+            }
+            else
+            {
+                printf(" %10.2f", gbps);
+            }
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    printf("seekto parser: %.1f M commands/s\n", run_seekto(seconds));
+    free(payload);
+    free(frames);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,332 @@
+/**
+ * @file latency-bench.c
+ * @brief Round-trip latency of aesdsocket over TCP loopback and its Unix domain sockets
+ *
+ * Starts the server with a Unix domain socket next to its TCP listener, once as SOCK_STREAM and
+ * once as SOCK_SEQPACKET (-U, -S), and has one client send a packet and wait for its reply, over
+ * and over, through each transport in turn.  The client runs in delta mode, so every reply is
+ * just the packet it answers and the data file growing does not make later round trips slower.
+ * Besides the latency percentiles it reports the CPU time the server spent per round trip,
+ * read from the server's process CPU clock.
+ *
+ * Build the server in data file mode, delta mode needs it:
+ *
+ *     make CFLAGS="-O2 -DUSE_AESD_CHAR_DEVICE=0" aesdsocket bench
+ *
+ * Usage: latency-bench [-b server] [-e server option] [-n round trips] [-s packet size]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SERVER_PORT 9000
+#define SOCKET_PATH "/tmp/aesdsocket-bench.sock"
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define DELTA_COMMAND "AESDSOCKET_DELTA:1\n"
+/* Round trips before the measured ones, to warm up caches and the server's buffers */
+#define WARMUP_ROUND_TRIPS 1000
+
+/* Transport measured by one run */
+typedef struct
+{
+    const char *name;
+    int domain;
+    int type;
+} transport_t;
+
+static const transport_t transports[] =
+{
+    { "tcp", AF_INET, SOCK_STREAM },
+    { "unix stream", AF_UNIX, SOCK_STREAM },
+    { "unix seqpacket", AF_UNIX, SOCK_SEQPACKET },
+};
+
+static double now_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Connect to the server through the transport, returns the socket or -1 */
+static int connect_transport(const transport_t *transport)
+{
+    struct sockaddr_in in_addr;
+    struct sockaddr_un un_addr;
+    struct sockaddr *addr;
+    socklen_t addr_len;
+    int fd;
+
+    if (transport->domain == AF_INET)
+    {
+        memset(&in_addr, 0, sizeof(in_addr));
+        in_addr.sin_family = AF_INET;
+        in_addr.sin_port = htons(SERVER_PORT);
+        in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr = (struct sockaddr *)&in_addr;
+        addr_len = sizeof(in_addr);
+    }
+    else
+    {
+        memset(&un_addr, 0, sizeof(un_addr));
+        un_addr.sun_family = AF_UNIX;
+        strcpy(un_addr.sun_path, SOCKET_PATH);
+        addr = (struct sockaddr *)&un_addr;
+        addr_len = sizeof(un_addr);
+    }
+    fd = socket(transport->domain, transport->type, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, addr, addr_len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send the packet and wait for the reply ending with it, returns 0 on success */
+static int round_trip(int fd, const char *packet, size_t len, char *reply, size_t reply_size)
+{
+    size_t received = 0;
+    ssize_t n;
+
+    if (send(fd, packet, len, MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        return -1;
+    }
+    /* A timestamp written meanwhile comes along in the same reply, ahead of the packet */
+    while (received < len || memcmp(reply + received - len, packet, len) != 0)
+    {
+        if (received == reply_size)
+        {
+            memmove(reply, reply + received - len, len);
+            received = len;
+        }
+        n = recv(fd, reply + received, reply_size - received, 0);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+/* Start the server with the given arguments and wait until it answers through the probe transport */
+static pid_t start_server(char *const argv[], const transport_t *probe)
+{
+    pid_t pid;
+    int fd;
+    int i;
+
+    unlink(DATA_FILE);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        /* Keep the server's banner out of the table */
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    for (i = 0; i < 50; i++)
+    {
+        usleep(100000);
+        fd = connect_transport(probe);
+        if (fd != -1)
+        {
+            close(fd);
+            return pid;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/* Measure one transport against the running server and print its line of the table */
+static int measure(const transport_t *transport, pid_t server, int round_trips, size_t packet_size)
+{
+    double *samples = malloc(round_trips * sizeof(double));
+    char *packet = malloc(packet_size);
+    size_t reply_size = packet_size + 65536;
+    char *reply = malloc(reply_size);
+    clockid_t server_clock;
+    double server_cpu = 0;
+    double total = 0;
+    double start;
+    int rc = -1;
+    int fd;
+    int i;
+
+    if (samples == NULL || packet == NULL || reply == NULL || clock_getcpuclockid(server, &server_clock) != 0)
+    {
+        goto out;
+    }
+    memset(packet, 'x', packet_size - 1);
+    packet[packet_size - 1] = '\n';
+    fd = connect_transport(transport);
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: connect: %s\n", transport->name, strerror(errno));
+        goto out;
+    }
+    if (send(fd, DELTA_COMMAND, strlen(DELTA_COMMAND), MSG_NOSIGNAL) != (ssize_t)strlen(DELTA_COMMAND))
+    {
+        close(fd);
+        goto out;
+    }
+
+    for (i = 0; i < WARMUP_ROUND_TRIPS + round_trips; i++)
+    {
+        if (i == WARMUP_ROUND_TRIPS)
+        {
+            server_cpu = now_us(server_clock);
+        }
+        start = now_us(CLOCK_MONOTONIC);
+        if (round_trip(fd, packet, packet_size, reply, reply_size) != 0)
+        {
+            fprintf(stderr, "%s: round trip %d failed\n", transport->name, i);
+            close(fd);
+            goto out;
+        }
+        if (i >= WARMUP_ROUND_TRIPS)
+        {
+            samples[i - WARMUP_ROUND_TRIPS] = now_us(CLOCK_MONOTONIC) - start;
+            total += samples[i - WARMUP_ROUND_TRIPS];
+        }
+    }
+    server_cpu = now_us(server_clock) - server_cpu;
+    close(fd);
+
+    qsort(samples, round_trips, sizeof(double), compare_double);
+    printf("%-15s %8.1f %8.1f %8.1f %8.1f %10.0f %12.2f\n", transport->name, samples[0],
+           samples[round_trips / 2], samples[(int)(round_trips * 0.99)], total / round_trips,
+           round_trips / (total / 1e6), server_cpu / round_trips);
+    fflush(stdout);
+    rc = 0;
+
+out:
+    free(samples);
+    free(packet);
+    free(reply);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    char *server_argv[16];
+    char *extra_args[8];
+    const transport_t *local;
+    int extra_count = 0;
+    int round_trips = 20000;
+    long packet_size = 64;
+    int seqpacket;
+    int argc_server;
+    int rc = 0;
+    pid_t pid;
+    int opt;
+    int i;
+
+    server_argv[0] = "./aesdsocket";
+    while ((opt = getopt(argc, argv, "b:e:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                server_argv[0] = optarg;
+                break;
+            case 'e':
+                if (extra_count == (int)(sizeof(extra_args) / sizeof(extra_args[0])))
+                {
+                    fprintf(stderr, "Too many server options\n");
+                    return EXIT_FAILURE;
+                }
+                extra_args[extra_count++] = optarg;
+                break;
+            case 'n':
+                round_trips = atoi(optarg);
+                break;
+            case 's':
+                packet_size = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b server] [-e server option] [-n round trips] [-s packet size]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    /* A SOCK_SEQPACKET message must fit the server's receive, which takes at least 4096 bytes */
+    if (round_trips <= 0 || packet_size < 2 || packet_size > 4096)
+    {
+        fprintf(stderr, "Need at least one round trip and a packet size from 2 to 4096\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d round trips of %ld byte packets, latency in us\n", round_trips, packet_size);
+    printf("%-15s %8s %8s %8s %8s %10s %12s\n", "transport", "min", "p50", "p99", "mean", "trips/s", "server cpu");
+    /* The Unix domain socket has one type per run, TCP is measured alongside the SOCK_STREAM one */
+    for (seqpacket = 0; seqpacket <= 1 && rc == 0; seqpacket++)
+    {
+        local = &transports[1 + seqpacket];
+        argc_server = 1;
+        server_argv[argc_server++] = "-U";
+        server_argv[argc_server++] = SOCKET_PATH;
+        if (seqpacket)
+        {
+            server_argv[argc_server++] = "-S";
+        }
+        server_argv[argc_server++] = "-L";
+        server_argv[argc_server++] = "warning";
+        for (i = 0; i < extra_count; i++)
+        {
+            server_argv[argc_server++] = extra_args[i];
+        }
+        server_argv[argc_server] = NULL;
+
+        pid = start_server(server_argv, local);
+        if (pid == -1)
+        {
+            fprintf(stderr, "server did not start\n");
+            return EXIT_FAILURE;
+        }
+        if (!seqpacket)
+        {
+            rc = measure(&transports[0], pid, round_trips, packet_size);
+        }
+        if (rc == 0)
+        {
+            rc = measure(local, pid, round_trips, packet_size);
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
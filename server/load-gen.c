@@ -0,0 +1,586 @@
+/**
+ * @file load-gen.c
+ * @brief Load generator and latency benchmark for a running aesdsocket server
+ *
+ * Opens N connections to the server, one thread each, and sends fixed size packets on every
+ * connection, waiting for the reply that carries a packet before sending the next one.  Each
+ * packet starts with a tag unique to the run, connection and sequence number, so it can be found
+ * in a reply that also holds other clients' data, with full replies as well as with delta
+ * replies (-D, data file servers only).
+ *
+ * With a rate limit every packet has a scheduled send time and its latency is measured from
+ * that time rather than from the actual send, so a stalled server is charged for the packets
+ * that queued up behind the stall instead of hiding them.  Optionally a share of the packets
+ * is preceded by an AESDCHAR_IOCSEEKTO:0,0 command in the same send; those round trips, which
+ * include the seek reply, go to a histogram of their own.
+ *
+ * Packets must be at least 32 bytes to hold the tag.  Latencies are recorded in log-linear histograms with 128 sub-buckets per power of two of
+ * nanoseconds, which bounds the error of any reported percentile below 1%.
+ *
+ * Usage: load-gen [-H host] [-p port] [-c connections] [-n packets | -d seconds] [-s size]
+ *                 [-r packets/s per connection] [-k seekto percent] [-D] [-j]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DELTA_ON "AESDSOCKET_DELTA:1\n"
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:0,0\n"
+#define SEEKTO_COMMAND_LEN (sizeof(SEEKTO_COMMAND) - 1)
+#define RECV_SIZE 65536
+
+/* Log-linear histogram: values below HIST_SUB are exact, above that each power of two has HIST_SUB buckets */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} hist_t;
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    int connections;
+    long packets;
+    double duration;
+    size_t size;
+    double rate;
+    int seekto_percent;
+    int delta;
+    int json;
+} options_t;
+
+/* Work and results of one connection thread */
+typedef struct
+{
+    int id;
+    int fd;
+    /* Distinguishes the tags of this run from packets earlier runs left in the server's data */
+    unsigned int run;
+    const options_t *options;
+    struct timespec start;
+    hist_t data;
+    hist_t seekto;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    int failed;
+} conn_t;
+
+static void hist_init(hist_t *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+static int hist_index(uint64_t value)
+{
+    int magnitude;
+    int shift;
+
+    if (value < HIST_SUB)
+    {
+        return value;
+    }
+    magnitude = 63 - __builtin_clzll(value);
+    shift = magnitude - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+}
+
+/* Highest value that falls into the bucket at index */
+static uint64_t hist_value(int index)
+{
+    int shift;
+
+    if (index < HIST_SUB)
+    {
+        return index;
+    }
+    shift = index / HIST_SUB - 1;
+    return ((uint64_t)(index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_record(hist_t *hist, uint64_t value)
+{
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value < hist->min)
+    {
+        hist->min = value;
+    }
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+static void hist_merge(hist_t *into, const hist_t *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min)
+    {
+        into->min = from->min;
+    }
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+/* Value at the given percentile, never above the recorded maximum */
+static uint64_t hist_percentile(const hist_t *hist, double percentile)
+{
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    uint64_t seen = 0;
+    uint64_t value;
+    int i;
+
+    if (hist->total == 0)
+    {
+        return 0;
+    }
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= rank)
+        {
+            value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+static int connect_server(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *res, *ai;
+    int one = 1;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t sent;
+
+    while (len > 0)
+    {
+        sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Send the packets of one connection, each after the reply to the previous one arrived */
+static void *conn_thread(void *arg)
+{
+    conn_t *conn = arg;
+    const options_t *options = conn->options;
+    size_t cap = options->size + RECV_SIZE;
+    char *out = malloc(SEEKTO_COMMAND_LEN + options->size);
+    char *buf = malloc(cap);
+    char *packet = out + SEEKTO_COMMAND_LEN;
+    uint64_t interval = options->rate > 0 ? (uint64_t)(1e9 / options->rate) : 0;
+    uint64_t start = timespec_ns(&conn->start);
+    uint64_t deadline = start + (uint64_t)(options->duration * 1e9);
+    uint64_t scheduled;
+    unsigned int seed = conn->id + 1;
+    struct timespec wake;
+    size_t buf_len = 0;
+    size_t tag_len;
+    char tag[64];
+    char *match;
+    ssize_t received;
+    int with_seekto;
+    long i;
+
+    if (out == NULL || buf == NULL)
+    {
+        conn->failed = 1;
+        free(out);
+        free(buf);
+        return NULL;
+    }
+    memcpy(out, SEEKTO_COMMAND, SEEKTO_COMMAND_LEN);
+    memset(packet, 'z', options->size);
+    packet[options->size - 1] = '\n';
+
+    for (i = 0; options->duration > 0 || i < options->packets; i++)
+    {
+        scheduled = interval > 0 ? start + i * interval : now_ns();
+        if (options->duration > 0 && scheduled >= deadline)
+        {
+            break;
+        }
+        if (interval > 0)
+        {
+            wake.tv_sec = scheduled / 1000000000ull;
+            wake.tv_nsec = scheduled % 1000000000ull;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+            {
+            }
+        }
+
+        /* A unique tag identifies our packet in replies that also carry other clients' data */
+        tag_len = snprintf(tag, sizeof(tag), "%06x-%d-%ld-", conn->run, conn->id, i);
+        if (tag_len >= options->size)
+        {
+            conn->failed = 1;
+            break;
+        }
+        memcpy(packet, tag, tag_len);
+        /* Seek only once the device holds an entry to seek to */
+        with_seekto = i > 0 && options->seekto_percent > 0 && (int)(rand_r(&seed) % 100) < options->seekto_percent;
+
+        if (with_seekto)
+        {
+            if (send_all(conn->fd, out, SEEKTO_COMMAND_LEN + options->size) != 0)
+            {
+                conn->failed = 1;
+                break;
+            }
+            conn->bytes_sent += SEEKTO_COMMAND_LEN + options->size;
+        }
+        else
+        {
+            if (send_all(conn->fd, packet, options->size) != 0)
+            {
+                conn->failed = 1;
+                break;
+            }
+            conn->bytes_sent += options->size;
+        }
+
+        for (;;)
+        {
+            match = memmem(buf, buf_len, packet, options->size);
+            if (match != NULL)
+            {
+                /* Keep what follows, it belongs to the same reply */
+                buf_len -= match + options->size - buf;
+                memmove(buf, match + options->size, buf_len);
+                break;
+            }
+            /* Only the tail can hold the start of our packet */
+            if (buf_len > options->size)
+            {
+                memmove(buf, buf + buf_len - options->size, options->size);
+                buf_len = options->size;
+            }
+            received = recv(conn->fd, buf + buf_len, cap - buf_len, 0);
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (received <= 0)
+            {
+                conn->failed = 1;
+                break;
+            }
+            buf_len += received;
+            conn->bytes_received += received;
+        }
+        if (conn->failed)
+        {
+            break;
+        }
+        hist_record(with_seekto ? &conn->seekto : &conn->data, now_ns() - scheduled);
+    }
+
+    free(out);
+    free(buf);
+    return NULL;
+}
+
+static void print_hist_text(const char *name, const hist_t *hist)
+{
+    if (hist->total == 0)
+    {
+        return;
+    }
+    printf("%-8s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, (unsigned long long)hist->total,
+           hist->min / 1e3, hist->sum / hist->total / 1e3, hist_percentile(hist, 50) / 1e3,
+           hist_percentile(hist, 90) / 1e3, hist_percentile(hist, 99) / 1e3,
+           hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+}
+
+/* Percentile distribution in the layout of HdrHistogram's text output */
+static void print_distribution(const char *name, const hist_t *hist)
+{
+    static const double percentiles[] = { 0, 50, 75, 90, 95, 99, 99.5, 99.9, 99.95, 99.99, 100 };
+    size_t i;
+
+    if (hist->total == 0)
+    {
+        return;
+    }
+    printf("\n%s latency distribution\n%12s %12s %14s\n", name, "value us", "percentile", "1/(1-p)");
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        if (percentiles[i] < 100)
+        {
+            printf("%12.1f %12.6f %14.2f\n", hist_percentile(hist, percentiles[i]) / 1e3, percentiles[i] / 100,
+                   100 / (100 - percentiles[i]));
+        }
+        else
+        {
+            printf("%12.1f %12.6f %14s\n", hist->max / 1e3, 1.0, "inf");
+        }
+    }
+}
+
+static void print_hist_json(const char *name, const hist_t *hist, int last)
+{
+    printf("    \"%s\": {\"count\": %llu, \"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+           "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}%s\n",
+           name, (unsigned long long)hist->total, hist->total ? hist->min / 1e3 : 0.0,
+           hist->total ? hist->sum / hist->total / 1e3 : 0.0, hist_percentile(hist, 50) / 1e3,
+           hist_percentile(hist, 90) / 1e3, hist_percentile(hist, 99) / 1e3,
+           hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3, last ? "" : ",");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-n packets | -d seconds] [-s size]\n"
+                    "          [-r packets/s per connection] [-k seekto percent] [-D] [-j]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    options_t options = { "localhost", "9000", 8, 1000, 0, 64, 0, 0, 0, 0 };
+    conn_t *conns;
+    pthread_t *threads;
+    hist_t *data, *seekto;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    uint64_t packets;
+    struct timespec start;
+    unsigned int run = (getpid() ^ (unsigned int)now_ns()) & 0xffffff;
+    double elapsed;
+    int failed = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "H:p:c:n:d:s:r:k:Dj")) != -1)
+    {
+        switch (opt)
+        {
+            case 'H':
+                options.host = optarg;
+                break;
+            case 'p':
+                options.port = optarg;
+                break;
+            case 'c':
+                options.connections = atoi(optarg);
+                break;
+            case 'n':
+                options.packets = atol(optarg);
+                break;
+            case 'd':
+                options.duration = atof(optarg);
+                break;
+            case 's':
+                options.size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                options.rate = atof(optarg);
+                break;
+            case 'k':
+                options.seekto_percent = atoi(optarg);
+                break;
+            case 'D':
+                options.delta = 1;
+                break;
+            case 'j':
+                options.json = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (options.connections <= 0 || options.packets <= 0 || options.duration < 0 || options.size < 32 ||
+        options.rate < 0 || options.seekto_percent < 0 || options.seekto_percent > 100)
+    {
+        fprintf(stderr, "Need at least one connection and one packet, packets of 32 bytes or more "
+                        "and a seekto percentage between 0 and 100\n");
+        return EXIT_FAILURE;
+    }
+
+    conns = calloc(options.connections, sizeof(conn_t));
+    threads = calloc(options.connections, sizeof(pthread_t));
+    data = malloc(sizeof(hist_t));
+    seekto = malloc(sizeof(hist_t));
+    if (conns == NULL || threads == NULL || data == NULL || seekto == NULL)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < options.connections; i++)
+    {
+        conns[i].id = i;
+        conns[i].run = run;
+        conns[i].options = &options;
+        hist_init(&conns[i].data);
+        hist_init(&conns[i].seekto);
+        conns[i].fd = connect_server(options.host, options.port);
+        if (conns[i].fd == -1 || (options.delta && send_all(conns[i].fd, DELTA_ON, strlen(DELTA_ON)) != 0))
+        {
+            fprintf(stderr, "Connecting to %s port %s failed\n", options.host, options.port);
+            return EXIT_FAILURE;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < options.connections; i++)
+    {
+        conns[i].start = start;
+        if (pthread_create(&threads[i], NULL, conn_thread, &conns[i]) != 0)
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    hist_init(data);
+    hist_init(seekto);
+    for (i = 0; i < options.connections; i++)
+    {
+        pthread_join(threads[i], NULL);
+        close(conns[i].fd);
+        failed += conns[i].failed;
+        bytes_sent += conns[i].bytes_sent;
+        bytes_received += conns[i].bytes_received;
+        hist_merge(data, &conns[i].data);
+        hist_merge(seekto, &conns[i].seekto);
+    }
+    elapsed = (now_ns() - timespec_ns(&start)) / 1e9;
+    packets = data->total + seekto->total;
+
+    if (options.json)
+    {
+        printf("{\n  \"connections\": %d,\n  \"packet_size\": %zu,\n  \"rate_per_connection\": %.1f,\n"
+               "  \"seekto_percent\": %d,\n  \"delta\": %s,\n  \"failed_connections\": %d,\n"
+               "  \"elapsed_s\": %.3f,\n  \"packets\": %llu,\n  \"packets_per_s\": %.1f,\n"
+               "  \"sent_bytes_per_s\": %.1f,\n  \"received_bytes_per_s\": %.1f,\n  \"latency_us\": {\n",
+               options.connections, options.size, options.rate, options.seekto_percent,
+               options.delta ? "true" : "false", failed, elapsed, (unsigned long long)packets,
+               packets / elapsed, bytes_sent / elapsed, bytes_received / elapsed);
+        print_hist_json("data", data, 0);
+        print_hist_json("seekto", seekto, 1);
+        printf("  }\n}\n");
+    }
+    else
+    {
+        printf("%d connections, %zu byte packets, ", options.connections, options.size);
+        if (options.rate > 0)
+        {
+            printf("%.1f packets/s each", options.rate);
+        }
+        else
+        {
+            printf("unlimited rate");
+        }
+        printf(", %d%% seekto, %s replies\n", options.seekto_percent, options.delta ? "delta" : "full");
+        printf("%llu packets in %.2f s: %.0f packets/s, %.2f MB/s sent, %.2f MB/s received\n",
+               (unsigned long long)packets, elapsed, packets / elapsed, bytes_sent / elapsed / 1e6,
+               bytes_received / elapsed / 1e6);
+        if (failed > 0)
+        {
+            printf("%d connections failed\n", failed);
+        }
+        printf("\n%-8s %10s %9s %9s %9s %9s %9s %9s %9s\n", "us", "count", "min", "mean", "p50", "p90", "p99",
+               "p99.9", "max");
+        print_hist_text("data", data);
+        print_hist_text("seekto", seekto);
+        print_distribution("data", data);
+        print_distribution("seekto", seekto);
+    }
+
+    free(conns);
+    free(threads);
+    free(data);
+    free(seekto);
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
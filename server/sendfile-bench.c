@@ -0,0 +1,331 @@
+/**
+ * @file sendfile-bench.c
+ * @brief Throughput of the ways aesdsocket can stream its data file to a client
+ *
+ * Compares the original fread()/send() loop with a 1024 byte buffer against sendfile(2)
+ * and splice(2) over a TCP loopback connection, for data files of several sizes.
+ * The file is read once before measuring, so every method streams from the page cache.
+ *
+ * Usage: sendfile-bench [-f path] [-r repeats] [size ...]
+ * Sizes accept K, M and G suffixes and default to 1M 100M 1G.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PATH "/var/tmp/aesdsocket-bench"
+
+typedef int (*stream_fn)(int file_fd, int sock_fd, size_t size);
+
+/* Receiving side of one run, discards everything until the sender closes */
+static void *drain_thread(void *arg)
+{
+    int fd = *(int *)arg;
+    static char buf[256 * 1024];
+
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+    {
+    }
+    return NULL;
+}
+
+/* The reply loop aesdsocket used before: stdio reads into a 1 KiB buffer, one send per chunk */
+static int stream_fread_send(int file_fd, int sock_fd, size_t size)
+{
+    char send_buf[1024];
+    size_t bytes_read;
+    FILE *fp;
+
+    (void)size;
+    /* The duplicate shares the file offset, which the other methods leave untouched */
+    lseek(file_fd, 0, SEEK_SET);
+    fp = fdopen(dup(file_fd), "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    while ((bytes_read = fread(send_buf, 1, sizeof(send_buf), fp)) > 0)
+    {
+        if (send(sock_fd, send_buf, bytes_read, 0) == -1)
+        {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int stream_sendfile(int file_fd, int sock_fd, size_t size)
+{
+    off_t offset = 0;
+    ssize_t sent;
+
+    while ((size_t)offset < size)
+    {
+        sent = sendfile(sock_fd, file_fd, &offset, size - offset);
+        if (sent <= 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int stream_splice(int file_fd, int sock_fd, size_t size)
+{
+    int pipe_fd[2];
+    loff_t offset = 0;
+    ssize_t in_pipe;
+    ssize_t moved;
+
+    if (pipe(pipe_fd) == -1)
+    {
+        return -1;
+    }
+    while ((size_t)offset < size)
+    {
+        in_pipe = splice(file_fd, &offset, pipe_fd[1], NULL, size - offset, SPLICE_F_MOVE);
+        if (in_pipe <= 0)
+        {
+            break;
+        }
+        while (in_pipe > 0)
+        {
+            moved = splice(pipe_fd[0], NULL, sock_fd, NULL, in_pipe, SPLICE_F_MOVE);
+            if (moved <= 0)
+            {
+                in_pipe = -1;
+                break;
+            }
+            in_pipe -= moved;
+        }
+        if (in_pipe < 0)
+        {
+            break;
+        }
+    }
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return (size_t)offset == size ? 0 : -1;
+}
+
+/* Parse a size with an optional K, M or G suffix */
+static size_t parse_size(const char *str)
+{
+    char *end;
+    size_t size = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+        case 'G': case 'g': size <<= 10; /* fall through */
+        case 'M': case 'm': size <<= 10; /* fall through */
+        case 'K': case 'k': size <<= 10; break;
+        default: break;
+    }
+    return size;
+}
+
+/* Make sure the file at path holds exactly size bytes and is in the page cache */
+static int prepare_file(const char *path, size_t size)
+{
+    static char buf[1024 * 1024];
+    size_t written = 0;
+    ssize_t rc;
+    int fd;
+    size_t i;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    for (i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = (i % 64 == 63) ? '\n' : 'a' + (i % 26);
+    }
+    while (written < size)
+    {
+        rc = write(fd, buf, size - written < sizeof(buf) ? size - written : sizeof(buf));
+        if (rc <= 0)
+        {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        written += rc;
+    }
+    /* Warm the page cache */
+    lseek(fd, 0, SEEK_SET);
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+    }
+    return fd;
+}
+
+/* Connect a loopback socket pair through the listener, returns the sending side */
+static int connect_loopback(int listen_fd, int *recv_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int send_fd;
+
+    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len);
+    send_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (send_fd == -1 || connect(send_fd, (struct sockaddr *)&addr, addr_len) == -1)
+    {
+        perror("connect");
+        return -1;
+    }
+    *recv_fd = accept(listen_fd, NULL, NULL);
+    if (*recv_fd == -1)
+    {
+        perror("accept");
+        close(send_fd);
+        return -1;
+    }
+    return send_fd;
+}
+
+/* Time one streaming run, returns the elapsed seconds or a negative value on failure */
+static double run_once(stream_fn fn, int file_fd, int listen_fd, size_t size)
+{
+    struct timespec start, end;
+    pthread_t drain;
+    int recv_fd;
+    int send_fd;
+    int rc;
+
+    send_fd = connect_loopback(listen_fd, &recv_fd);
+    if (send_fd == -1)
+    {
+        return -1;
+    }
+    pthread_create(&drain, NULL, drain_thread, &recv_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = fn(file_fd, send_fd, size);
+    close(send_fd);
+    pthread_join(drain, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    close(recv_fd);
+    if (rc != 0)
+    {
+        return -1;
+    }
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *default_sizes[] = { "1M", "100M", "1G" };
+    static const struct
+    {
+        const char *name;
+        stream_fn fn;
+    } methods[] =
+    {
+        { "fread/send", stream_fread_send },
+        { "sendfile", stream_sendfile },
+        { "splice", stream_splice },
+    };
+    const char *path = DEFAULT_PATH;
+    const char **sizes = default_sizes;
+    int num_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    int repeats = 3;
+    struct sockaddr_in addr;
+    int listen_fd;
+    int file_fd;
+    int opt;
+    int s, m, r;
+
+    while ((opt = getopt(argc, argv, "f:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                path = optarg;
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-f path] [-r repeats] [size ...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+    {
+        sizes = (const char **)&argv[optind];
+        num_sizes = argc - optind;
+    }
+    if (repeats <= 0)
+    {
+        repeats = 1;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 1) == -1)
+    {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %-12s %12s\n", "size", "method", "MB/s (best)");
+    for (s = 0; s < num_sizes; s++)
+    {
+        size_t size = parse_size(sizes[s]);
+
+        file_fd = prepare_file(path, size);
+        if (file_fd == -1)
+        {
+            return EXIT_FAILURE;
+        }
+        for (m = 0; m < (int)(sizeof(methods) / sizeof(methods[0])); m++)
+        {
+            double best = 0;
+
+            for (r = 0; r < repeats; r++)
+            {
+                double elapsed = run_once(methods[m].fn, file_fd, listen_fd, size);
+
+                if (elapsed < 0)
+                {
+                    fprintf(stderr, "%s failed: %s\n", methods[m].name, strerror(errno));
+                    break;
+                }
+                if (best == 0 || elapsed < best)
+                {
+                    best = elapsed;
+                }
+            }
+            if (best > 0)
+            {
+                printf("%-10s %-12s %12.1f\n", sizes[s], methods[m].name, size / best / 1e6);
+            }
+        }
+        close(file_fd);
+    }
+
+    unlink(path);
+    close(listen_fd);
+    return EXIT_SUCCESS;
+}